@@ -0,0 +1,344 @@
+/**
+ * @file c100k.c
+ * @brief Idle connection benchmark
+ *
+ * Opens a large number of idle connections to a running cserv, spread over
+ * several loopback source addresses so the ephemeral port range of a single
+ * address is not the limit, then measures:
+ *
+ *  - how many of them the server let complete the handshake
+ *  - the server's resident memory per idle connection (with -P)
+ *  - the latency of requests sent on fresh connections while the idle
+ *    ones stay open
+ *
+ * Build with "make bench", run e.g.
+ *   bin/c100k -p 8080 -P $(pidof cserv) -n 100000 -s 8
+ * Needs a file descriptor limit above the connection count, raise it with
+ * ulimit -n (and fs.nr_open) first.
+ */
+
+// Define feature macros before including headers
+// These enable clock_gettime and getopt
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// defines
+#define BENCH_BATCH 1000
+#define BENCH_RESPONSE_BUFFER 4096
+
+/**
+ * @brief Command line options
+ */
+typedef struct {
+    const char *host;    // server address, IPv4
+    int port;            // server port
+    long connections;    // idle connections to open
+    int sources;         // loopback source addresses to spread them over, 127.0.0.1 and up
+    int requests;        // requests to time on active connections
+    int timeout_ms;      // how long a connect or a request may take
+    long pid;            // server process to read the memory of, 0 to skip
+    const char *path;    // path requested on active connections
+} options_t;
+
+/**
+ * @brief Current time in milliseconds
+ */
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/**
+ * @brief Resident memory of a process in kB, -1 if unknown
+ */
+static long read_rss_kb(long pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%ld/status", pid);
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        return -1;
+    }
+    char line[256];
+    long rss = -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "VmRSS:", 6) == 0) {
+            rss = strtol(line + 6, NULL, 10);
+            break;
+        }
+    }
+    fclose(f);
+    return rss;
+}
+
+/**
+ * @brief Start a non-blocking connect from a given source address
+ *
+ * @return The socket, or -1 on error
+ */
+static int start_connect(const options_t *opts, int source) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    struct sockaddr_in src;
+    memset(&src, 0, sizeof(src));
+    src.sin_family = AF_INET;
+    src.sin_addr.s_addr = htonl(INADDR_LOOPBACK + (unsigned)source);
+    struct sockaddr_in dst;
+    memset(&dst, 0, sizeof(dst));
+    dst.sin_family = AF_INET;
+    dst.sin_port = htons((unsigned short)opts->port);
+    inet_pton(AF_INET, opts->host, &dst.sin_addr);
+
+    if (bind(fd, (struct sockaddr *)&src, sizeof(src)) < 0 ||
+        (connect(fd, (struct sockaddr *)&dst, sizeof(dst)) < 0 && errno != EINPROGRESS)) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * @brief Wait for a batch of connects, closing the ones that fail or time out
+ *
+ * @return Number of connections established
+ */
+static long finish_connects(struct pollfd *pending, int count, int timeout_ms) {
+    long established = 0;
+    int left = count;
+    double deadline = now_ms() + timeout_ms;
+    while (left > 0) {
+        int wait = (int)(deadline - now_ms());
+        if (wait <= 0 || poll(pending, (nfds_t)count, wait) <= 0) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (pending[i].fd < 0 || pending[i].revents == 0) {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(pending[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            if (err == 0) {
+                established++;
+            } else {
+                close(pending[i].fd);
+            }
+            pending[i].fd = -1; // poll() skips negative descriptors
+            left--;
+        }
+    }
+    // Whatever did not make it in time counts as refused
+    for (int i = 0; i < count; i++) {
+        if (pending[i].fd >= 0) {
+            close(pending[i].fd);
+        }
+    }
+    return established;
+}
+
+/**
+ * @brief Time one request on a fresh connection
+ *
+ * @return Milliseconds until the response was complete, -1 on timeout or error
+ */
+static double timed_request(const options_t *opts) {
+    double start = now_ms();
+    double deadline = start + opts->timeout_ms;
+    int fd = start_connect(opts, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    struct pollfd pfd = {fd, POLLOUT, 0};
+    if (poll(&pfd, 1, opts->timeout_ms) <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    char request[512];
+    int len = snprintf(request, sizeof(request),
+                       "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n", opts->path,
+                       opts->host);
+    if (send(fd, request, (size_t)len, 0) != len) {
+        close(fd);
+        return -1;
+    }
+
+    // The server closes the connection after the response
+    char buf[BENCH_RESPONSE_BUFFER];
+    pfd.events = POLLIN;
+    while (1) {
+        int wait = (int)(deadline - now_ms());
+        if (wait <= 0 || poll(&pfd, 1, wait) <= 0) {
+            close(fd);
+            return -1;
+        }
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n == 0) {
+            break;
+        }
+        if (n < 0 && errno != EAGAIN && errno != EINTR) {
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    return now_ms() - start;
+}
+
+/**
+ * @brief Compare two latencies for qsort()
+ */
+static int compare_ms(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Print the usage message
+ */
+static void print_help(void) {
+    printf("Usage: c100k [options]\n");
+    printf("Options:\n");
+    printf("  -H host\tServer IPv4 address (default 127.0.0.1)\n");
+    printf("  -p port\tServer port (default 8080)\n");
+    printf("  -n count\tIdle connections to open (default 100000)\n");
+    printf("  -s count\tLoopback source addresses to use (default 4)\n");
+    printf("  -r count\tRequests to time on active connections (default 100)\n");
+    printf("  -t ms\t\tConnect and request timeout (default 1000)\n");
+    printf("  -P pid\tServer process to measure memory of\n");
+    printf("  -x path\tPath to request (default /)\n");
+}
+
+int main(int argc, char *argv[]) {
+    options_t opts = {"127.0.0.1", 8080, 100000, 4, 100, 1000, 0, "/"};
+    int opt;
+    while ((opt = getopt(argc, argv, "H:p:n:s:r:t:P:x:h")) != -1) {
+        switch (opt) {
+        case 'H':
+            opts.host = optarg;
+            break;
+        case 'p':
+            opts.port = atoi(optarg);
+            break;
+        case 'n':
+            opts.connections = atol(optarg);
+            break;
+        case 's':
+            opts.sources = atoi(optarg);
+            break;
+        case 'r':
+            opts.requests = atoi(optarg);
+            break;
+        case 't':
+            opts.timeout_ms = atoi(optarg);
+            break;
+        case 'P':
+            opts.pid = atol(optarg);
+            break;
+        case 'x':
+            opts.path = optarg;
+            break;
+        default:
+            print_help();
+            return 1;
+        }
+    }
+    if (opts.connections < 0 || opts.sources < 1 || opts.sources > 254 || opts.requests < 1) {
+        print_help();
+        return 1;
+    }
+
+    // Every connection is a descriptor
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    rlim_t needed = (rlim_t)opts.connections + 64;
+    if (limit.rlim_cur < needed) {
+        limit.rlim_cur = needed < limit.rlim_max ? needed : limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+        if (limit.rlim_cur < needed) {
+            printf("Warning: descriptor limit %lu, at most that many connections will open\n",
+                   (unsigned long)limit.rlim_cur);
+        }
+    }
+
+    long rss_before = opts.pid > 0 ? read_rss_kb(opts.pid) : -1;
+
+    // Open the idle connections a batch at a time
+    static struct pollfd pending[BENCH_BATCH];
+    long established = 0;
+    long failed = 0;
+    double start = now_ms();
+    for (long i = 0; i < opts.connections;) {
+        int count = 0;
+        for (; count < BENCH_BATCH && i < opts.connections; i++) {
+            int fd = start_connect(&opts, (int)(i % opts.sources));
+            if (fd < 0) {
+                failed++;
+                continue;
+            }
+            pending[count].fd = fd;
+            pending[count].events = POLLOUT;
+            pending[count].revents = 0;
+            count++;
+        }
+        long done = finish_connects(pending, count, opts.timeout_ms);
+        established += done;
+        failed += count - done;
+    }
+    printf("idle connections: %ld established, %ld failed, %.0f ms\n", established, failed,
+           now_ms() - start);
+
+    // Give the server a moment to settle before sampling its memory
+    sleep(1);
+    long rss_after = opts.pid > 0 ? read_rss_kb(opts.pid) : -1;
+    if (rss_before >= 0 && rss_after >= 0) {
+        printf("server rss: %ld kB before, %ld kB after, %.0f bytes per connection\n",
+               rss_before, rss_after,
+               established > 0 ? (rss_after - rss_before) * 1024.0 / established : 0.0);
+    }
+
+    // Requests on active connections while the idle ones stay open
+    double *latencies = malloc((size_t)opts.requests * sizeof(double));
+    if (latencies == NULL) {
+        printf("Error: Memory allocation failed\n");
+        return 1;
+    }
+    int ok = 0;
+    int timed_out = 0;
+    for (int i = 0; i < opts.requests; i++) {
+        double ms = timed_request(&opts);
+        if (ms < 0) {
+            timed_out++;
+        } else {
+            latencies[ok++] = ms;
+        }
+    }
+    printf("active requests: %d ok, %d timed out", ok, timed_out);
+    if (ok > 0) {
+        qsort(latencies, (size_t)ok, sizeof(double), compare_ms);
+        printf(", p50 %.2f ms, p99 %.2f ms, max %.2f ms", latencies[ok / 2],
+               latencies[(ok * 99) / 100], latencies[ok - 1]);
+    }
+    printf("\n");
+    free(latencies);
+
+    // The idle connections close with the process
+    return timed_out > 0 ? 2 : 0;
+}
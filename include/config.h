@@ -16,4 +16,103 @@
 #define _KBYTE (1024 * _BYTE)
 #define _MBYTE (1024 * _KBYTE)
 
+// file cache, the budget is CACHE_MEMORY_PERCENT of the memory limit, clamped to min/max
+// DEFAULT_CACHE_BUDGET is used when the limit cannot be determined
+#define DEFAULT_CACHE_BUDGET (64 * _MBYTE)
+#define MIN_CACHE_BUDGET (8 * _MBYTE)
+#define MAX_CACHE_BUDGET (16384UL * _MBYTE)
+#define CACHE_MEMORY_PERCENT 25
+#define MAX_CACHE_OBJECT_SIZE (8 * _MBYTE)
+// how long a request waits on another request's in-flight load before reading the file itself
+#define CACHE_WAIT_TIMEOUT_MS 2000
+// objects modified more recently than this are not cached, mtimes may be this coarse
+#define CACHE_RACY_SECONDS 1
+
+// cache arena, sized for the cache budget plus size class rounding plus the site index
+#define ARENA_INDEX_RESERVE (16 * _MBYTE)
+
+// memory pressure, PSI "some avg10" thresholds in percent and anonymous memory high watermark
+#define MEMORY_POLL_MS 1000
+#define MEMORY_PSI_HIGH 10.0
+#define MEMORY_PSI_LOW 1.0
+#define MEMORY_ANON_HIGH_PERCENT 90
+#define MEMORY_CALM_SAMPLES 30
+
+// large files, sent with sendfile() and dropped from the page cache behind the cursor
+#define LARGE_FILE_THRESHOLD MAX_CACHE_OBJECT_SIZE
+#define STREAM_CHUNK_SIZE (1 * _MBYTE)
+
+// generated bodies, how much a body producer is asked for at a time
+#define STREAM_PRODUCER_BUFFER_SIZE (64 * _KBYTE)
+
+// site index, how long to let a burst of directory changes settle before re-indexing
+#define BLOOM_REBUILD_DELAY_MS 100
+
+// heavy hitters, counters per sketch, window length and how many keys show up in metrics
+#define TOPK_CAPACITY 64
+#define TOPK_WINDOW_SECONDS 60
+#define TOPK_METRICS_ITEMS 10
+
+// pre-warming, how many hot paths are persisted and how often
+#define HOT_PATHS_MAX 128
+#define HOT_PATHS_SAVE_SECONDS 300
+
+// directories, the file served for a directory path and whether to list directories without one
+#define DIRECTORY_INDEX "index.html"
+#define AUTOINDEX_ENABLED 0
+
+// file metadata cache, how long variant lookups are trusted when directories are not watched
+#define META_TTL_SECONDS 5
+
+// browser caching, max-age in seconds for fingerprinted files, HTML, static assets and the rest
+#define CACHE_MAX_AGE_IMMUTABLE 31536000
+#define CACHE_MAX_AGE_HTML 60
+#define CACHE_MAX_AGE_ASSETS 3600
+#define CACHE_MAX_AGE_DEFAULT 300
+
+// bundles, several files in one multipart response
+#define BUNDLE_PATH "/_bundle"
+#define BUNDLE_MAX_PARTS 32
+
+// prefetch of the assets HTML pages link to, PREFETCH_LINK_PRELOAD 1 also sends preload Links
+#define PREFETCH_QUEUE_SIZE 64
+#define PREFETCH_MAX_ASSETS 16
+#define PREFETCH_REWARM_SECONDS 30
+#define PREFETCH_LINK_PRELOAD 0
+
+// 103 Early Hints for HTML pages whose linked assets are known from a prefetch scan
+#define EARLY_HINTS_ENABLED 1
+
+// per-thread size classes for requests, responses and body buffers, larger blocks use malloc()
+#define MEM_SIZE_CLASSES_ENABLED 1
+#define MEM_MAX_CLASS_SIZE (32 * _KBYTE)
+#define MEM_SLAB_SIZE (256 * _KBYTE)
+
+// server-side includes in HTML pages, nested up to SSI_MAX_DEPTH levels
+#define SSI_ENABLED 0
+#define SSI_MAX_DEPTH 4
+#define SSI_MAX_PARTS 128
+#define SSI_MAX_SEGMENTS 1024
+
+// FastCGI scripts, run by FCGI_WORKERS workers on sockets in a private dir below FCGI_SOCKET_DIR
+#define FCGI_EXTENSION ".php"
+#define FCGI_WORKERS 4
+#define FCGI_SOCKET_DIR "/tmp"
+#define FCGI_TIMEOUT_SECONDS 30
+
+// TCP_INFO of every Nth connection goes into the access log and the metrics histograms
+#define TCP_INFO_SAMPLE_EVERY 1
+
+// Sampling CPU profiler, PROF_HZ samples per CPU second into per-thread rings of
+// PROF_BUFFER_SAMPLES stacks, drained every PROF_DRAIN_MS into PROF_MAX_STACKS distinct stacks
+#define PROF_HZ 99
+#define PROF_MAX_THREADS 32
+#define PROF_MAX_DEPTH 32
+#define PROF_BUFFER_SAMPLES 256
+#define PROF_DRAIN_MS 100
+#define PROF_MAX_STACKS 4096
+
+// admin endpoints, only served to loopback clients
+#define ADMIN_PATH_PREFIX "/_cserv/"
+
 #endif
\ No newline at end of file
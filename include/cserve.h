@@ -12,8 +12,19 @@
  * @brief Initialize the server
  *
  * @param port Port number to listen on
+ * @param directory Root directory to serve
+ * @param state_file File hot paths are persisted in for cache pre-warming, empty to disable
+ * @param fastcgi_command Command starting one FastCGI worker (e.g. php-cgi), empty to disable
+ * @param access_log File to append the access log to, empty to disable
  * @return 0 on success, negative value on error
  */
-int cserve_init(int port, const char *directory);
+int cserve_init(int port, const char *directory, const char *state_file,
+                const char *fastcgi_command, const char *access_log);
+
+/**
+ * @brief Run the server until SIGINT or SIGTERM
+ *
+ * @return 0 on clean shutdown, negative value on error
+ */
 int cserve_start();
 #endif
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef CSERVE_ACCESS_H
+#define CSERVE_ACCESS_H
+
+/**
+ * cserve_access.h
+ *
+ * Access log and per-connection TCP statistics
+ *
+ * When a response has been handed to the kernel, every
+ * TCP_INFO_SAMPLE_EVERY-th connection has its TCP_INFO read: smoothed RTT
+ * and its variance, retransmits, congestion window, delivery rate, and how
+ * long the connection was busy sending and how much of that it was held
+ * back by the client's receive window or our send buffer. Along with the
+ * time the server spent on the request, these go into the access log line
+ * and into histograms in the metrics output. A slow request with a large
+ * server time was slow here. One with a small server time but a long RTT,
+ * retransmits or a mostly rwnd limited busy time was slow on the network.
+ * Fields the running kernel does not report are left out of the log line
+ * and the histograms.
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Open the access log and register the histograms
+ *
+ * @param log_file File to append access log lines to, empty to only keep the histograms
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_access_init(const char *log_file);
+
+/**
+ * @brief Record a finished request
+ *
+ * @param sock The client socket, still open
+ * @param req The request
+ * @param res The response that was sent
+ * @param server_ms Time from accepting the connection until the response was sent
+ */
+void cserve_access_record(int sock, const cserver_http_req_t *req, const cserver_http_res_t *res,
+                          double server_ms);
+
+#endif
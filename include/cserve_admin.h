@@ -0,0 +1,31 @@
+#ifndef CSERVE_ADMIN_H
+#define CSERVE_ADMIN_H
+
+/**
+ * cserve_admin.h
+ *
+ * Admin endpoints (metrics and friends) under ADMIN_PATH_PREFIX
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Check whether a request targets an admin endpoint
+ *
+ * @param path The request path
+ * @return 1 if the path is under ADMIN_PATH_PREFIX, 0 otherwise
+ */
+int cserve_admin_is_admin_path(const char *path);
+
+/**
+ * @brief Handle a request for an admin endpoint
+ *
+ * Only loopback clients are served, everyone else gets a 404 so the
+ * endpoints are not discoverable from outside.
+ *
+ * @param req The request to handle
+ * @return cserver_http_res_t* The response
+ */
+cserver_http_res_t *cserve_admin_handler(cserver_http_req_t *req);
+
+#endif
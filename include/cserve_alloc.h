@@ -0,0 +1,70 @@
+#ifndef CSERVE_ALLOC_H
+#define CSERVE_ALLOC_H
+
+/**
+ * cserve_alloc.h
+ *
+ * Allocation accounting
+ *
+ * Built with ALLOC_STATS=1, cserv's calls to malloc, calloc, realloc,
+ * strdup and free are routed through counting wrappers (ld --wrap, so
+ * allocations made inside libc itself are not seen). Every allocation is
+ * charged to the request stage the calling thread is in, and the totals
+ * are reported in the metrics output along with how many requests
+ * allocated at all. Once the caches are warm a request should not, so a
+ * growing cserv_alloc_requests_allocating_total points at a regression.
+ * "make check" builds such a server, warms it up and fails if the counter
+ * moves for the requests that follow.
+ *
+ * In normal builds the stage markers compile to nothing.
+ */
+
+/**
+ * @brief Request processing stages allocations are charged to
+ */
+typedef enum {
+    ALLOC_STAGE_OTHER,     // Outside request handling (startup, background threads)
+    ALLOC_STAGE_PARSE,     // Reading and parsing the request
+    ALLOC_STAGE_HANDLE,    // Running the handler, building the response
+    ALLOC_STAGE_SERIALIZE, // Turning the response headers into text
+    ALLOC_STAGE_SEND,      // Sending the response and freeing it all
+    ALLOC_STAGE_COUNT
+} cserver_alloc_stage_t;
+
+/**
+ * @brief Register the allocation counters with the metrics output
+ *
+ * Does nothing unless built with ALLOC_STATS=1.
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_alloc_init(void);
+
+#ifdef CSERV_ALLOC_STATS
+
+/**
+ * @brief Start accounting a request, the calling thread enters ALLOC_STAGE_PARSE
+ */
+void cserve_alloc_request_begin(void);
+
+/**
+ * @brief Charge the calling thread's allocations to a stage from now on
+ *
+ * @param stage The stage the thread enters
+ */
+void cserve_alloc_set_stage(cserver_alloc_stage_t stage);
+
+/**
+ * @brief Finish accounting a request, the calling thread returns to ALLOC_STAGE_OTHER
+ */
+void cserve_alloc_request_end(void);
+
+#else
+
+#define cserve_alloc_request_begin() ((void)0)
+#define cserve_alloc_set_stage(stage) ((void)(stage))
+#define cserve_alloc_request_end() ((void)0)
+
+#endif
+
+#endif
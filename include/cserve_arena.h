@@ -0,0 +1,68 @@
+#ifndef CSERVE_ARENA_H
+#define CSERVE_ARENA_H
+
+/**
+ * cserve_arena.h
+ *
+ * Huge-page backed memory arena for the file cache and the site index
+ *
+ * One large mapping is reserved up front, backed by explicit huge pages
+ * (MAP_HUGETLB) when the system has them reserved, or by transparent huge
+ * pages (MADV_HUGEPAGE) otherwise. Allocations that do not fit fall back
+ * to malloc(), so callers never have to care where memory came from.
+ */
+
+#include <stddef.h>
+
+/**
+ * @brief Reserve the arena
+ *
+ * Failing to map the arena is not an error, all allocations then go
+ * straight to malloc().
+ *
+ * @param size Arena size in bytes, rounded up to a huge page
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_arena_init(size_t size);
+
+/**
+ * @brief Allocate memory from the arena, falling back to malloc()
+ *
+ * @param size Number of bytes to allocate
+ * @return Pointer to the memory, or NULL if allocation failed
+ *
+ * Note: The returned pointer must be freed using cserve_arena_free()
+ */
+void *cserve_arena_alloc(size_t size);
+
+/**
+ * @brief Allocate zeroed memory from the arena, falling back to calloc()
+ *
+ * @param count Number of elements
+ * @param size Size of each element
+ * @return Pointer to the memory, or NULL if allocation failed
+ *
+ * Note: The returned pointer must be freed using cserve_arena_free()
+ */
+void *cserve_arena_calloc(size_t count, size_t size);
+
+/**
+ * @brief Free memory from cserve_arena_alloc() or cserve_arena_calloc()
+ *
+ * Also accepts pointers that came from the malloc() fallback.
+ *
+ * @param ptr The memory to free, may be NULL
+ */
+void cserve_arena_free(void *ptr);
+
+/**
+ * @brief Hand the pages of free arena blocks back to the kernel
+ *
+ * Used under memory pressure. The blocks stay on their free lists and are
+ * faulted back in when reused.
+ *
+ * @return Number of bytes released
+ */
+size_t cserve_arena_release_free(void);
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef CSERVE_AUTOINDEX_H
+#define CSERVE_AUTOINDEX_H
+
+/**
+ * cserve_autoindex.h
+ *
+ * Directory listings for directories without an index file
+ *
+ * Listings are rendered once and kept in the file cache under the directory
+ * path (with its trailing slash), validated against the directory's mtime.
+ * Adding, removing or renaming an entry bumps that mtime, so a large
+ * directory is only re-scanned after it actually changed.
+ */
+
+#include "cserve_net.h"
+#include <sys/stat.h>
+
+/**
+ * @brief Create a response listing a directory
+ *
+ * @param path Request path of the directory, ending with '/'
+ * @param st The directory's stat information
+ * @return cserver_http_res_t* The response
+ */
+cserver_http_res_t *cserve_autoindex_response(const char *path, const struct stat *st);
+
+#endif
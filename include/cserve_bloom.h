@@ -0,0 +1,47 @@
+#ifndef CSERVE_BLOOM_H
+#define CSERVE_BLOOM_H
+
+/**
+ * cserve_bloom.h
+ *
+ * Site index: a Bloom filter of every path under the served directory
+ *
+ * Lets the GET handler answer requests for paths that cannot exist
+ * (scanner noise like /wp-login.php) without touching the filesystem.
+ * The filter is rebuilt in the background whenever inotify reports a
+ * change, and is bypassed from the moment the change is queued until the
+ * rebuild finishes. A negative answer also checks the inotify queue for
+ * changes the watcher has not read yet, so it never produces a false 404.
+ */
+
+/**
+ * @brief Build the site index and start watching the directory for changes
+ *
+ * If the directory cannot be watched the filter stays disabled and every
+ * lookup is answered with "maybe".
+ *
+ * @param root_dir Root directory being served
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_bloom_init(const char *root_dir);
+
+/**
+ * @brief Check whether a path may exist under the served directory
+ *
+ * @param path Request path, starting with '/'
+ * @return SUCCESS if the path may exist, FAILURE if it definitely does not
+ */
+int cserve_bloom_check(const char *path);
+
+/**
+ * @brief Get a counter that changes whenever an entry is added or removed
+ *
+ * Lets other caches of directory contents validate themselves without a
+ * syscall. Only changes to which names exist are tracked, not file contents.
+ *
+ * @param gen Set to the current generation
+ * @return SUCCESS if directories are being watched, FAILURE if the generation cannot be trusted
+ */
+int cserve_bloom_generation(unsigned long *gen);
+
+#endif
@@ -0,0 +1,86 @@
+#ifndef CSERVE_BUF_H
+#define CSERVE_BUF_H
+
+/**
+ * cserve_buf.h
+ *
+ * Reference counted body buffers
+ *
+ * A buffer is something a response body can point at: a heap allocation,
+ * memory owned by someone else (a file cache entry, an mmap()ed region) or
+ * an open file. Response bodies are lists of segments, each a byte range
+ * of a buffer holding its own reference, so one buffer can back many
+ * segments of many concurrent responses and is freed when the last of them
+ * lets go. Nothing is copied on the way to the socket: memory goes out
+ * with writev(), files with sendfile().
+ */
+
+#include <stddef.h>
+
+/**
+ * @brief A reference counted buffer
+ */
+typedef struct {
+    // Memory holding the bytes, NULL if they live in fd instead
+    const char *data;
+
+    // File holding the bytes when data is NULL, -1 otherwise
+    int fd;
+
+    // Number of bytes, starting at data or at offset 0 of fd
+    size_t size;
+
+    // References held, the buffer is destroyed when this drops to zero
+    unsigned long refs;
+
+    // Called with ctx once the last reference is gone, may be NULL
+    void (*destroy)(void *ctx);
+    void *ctx;
+} cserver_buf_t;
+
+/**
+ * @brief Allocate a heap buffer
+ *
+ * @param size Number of bytes, one more is allocated and can hold a NUL
+ * @param data Set to the writable bytes
+ * @return The buffer holding one reference, or NULL if allocation failed
+ */
+cserver_buf_t *cserve_buf_alloc(size_t size, char **data);
+
+/**
+ * @brief Wrap memory owned by something else
+ *
+ * @param data The memory
+ * @param size Number of bytes
+ * @param destroy Called with ctx once the last reference is gone, may be NULL
+ * @param ctx Passed to destroy
+ * @return The buffer holding one reference, or NULL if allocation failed, ctx is destroyed then
+ */
+cserver_buf_t *cserve_buf_wrap(const char *data, size_t size, void (*destroy)(void *ctx),
+                               void *ctx);
+
+/**
+ * @brief Wrap an open file
+ *
+ * @param fd The file, closed once the last reference is gone
+ * @param size Number of bytes from offset 0
+ * @return The buffer holding one reference, or NULL if allocation failed, fd is closed then
+ */
+cserver_buf_t *cserve_buf_file(int fd, size_t size);
+
+/**
+ * @brief Take another reference
+ *
+ * @param buf The buffer
+ * @return buf
+ */
+cserver_buf_t *cserve_buf_ref(cserver_buf_t *buf);
+
+/**
+ * @brief Drop a reference, destroying the buffer if it was the last
+ *
+ * @param buf The buffer, may be NULL
+ */
+void cserve_buf_unref(cserver_buf_t *buf);
+
+#endif
@@ -0,0 +1,42 @@
+#ifndef CSERVE_BUNDLE_H
+#define CSERVE_BUNDLE_H
+
+/**
+ * cserve_bundle.h
+ *
+ * Multi-file bundles
+ *
+ * BUNDLE_PATH returns several files in one multipart/mixed response, so
+ * clients that open one connection per request (HTTP/1.0, high latency
+ * links) fetch a page's assets in a single round trip. The file list comes
+ * from the query string on GET or the body on POST, as comma or '&'
+ * separated paths with an optional "f=" in front of each:
+ *
+ *   GET /_bundle?f=/style.css,/app.js
+ *
+ * Parts are sent in sorted path order, each with Content-Location and
+ * Content-Length headers, straight from the file cache without copying.
+ * The ETag is a hash of the sorted list and each file's version, so any
+ * ordering of the same list can be revalidated with If-None-Match.
+ * Scripts and admin paths are refused with 403, they are not files to hand out.
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Check whether a request targets the bundle endpoint
+ *
+ * @param path The request path
+ * @return 1 if it does, 0 otherwise
+ */
+int cserve_bundle_is_bundle_path(const char *path);
+
+/**
+ * @brief Handle a bundle request
+ *
+ * @param req The request to handle
+ * @return cserver_http_res_t* The response
+ */
+cserver_http_res_t *cserve_bundle_handler(cserver_http_req_t *req);
+
+#endif
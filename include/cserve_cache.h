@@ -0,0 +1,174 @@
+#ifndef CSERVE_CACHE_H
+#define CSERVE_CACHE_H
+
+/**
+ * cserve_cache.h
+ *
+ * In-memory file cache
+ *
+ * Entries are keyed by request path and validated against the file's
+ * mtime, to the nanosecond, and size. Concurrent misses for the same key are
+ * coalesced: the first caller loads the object, everyone else waits on the
+ * in-flight entry.
+ *
+ * Timestamps only advance with the kernel's clock tick, and on some
+ * filesystems by whole seconds, so an object modified less than
+ * CACHE_RACY_SECONDS ago could change again without its mtime moving. Such
+ * objects are not cached yet, cserve_cache_acquire() reports a fallback and
+ * the caller loads them directly.
+ */
+
+#include <stddef.h>
+#include <time.h>
+
+// Size passed to cserve_cache_acquire() for generated objects, only the mtime is validated
+#define CACHE_SIZE_UNKNOWN ((size_t)-1)
+
+/**
+ * @brief Loader callback used to fill a cache entry on a miss
+ *
+ * @param key The cache key being loaded
+ * @param ctx Opaque pointer passed through from cserve_cache_acquire()
+ * @param data Set to a cserve_arena_alloc()ed buffer holding the object (owned by the cache afterwards)
+ * @param size Set to the size of the object in bytes
+ * @return SUCCESS on success, FAILURE on error
+ */
+typedef int (*cserver_cache_loader_t)(const char *key, void *ctx, char **data, size_t *size);
+
+/**
+ * @brief State of a cache entry
+ */
+typedef enum {
+    CACHE_ENTRY_LOADING, // A loader is currently filling this entry
+    CACHE_ENTRY_READY,   // Data is valid and can be served
+    CACHE_ENTRY_FAILED   // The loader failed, waiters must fall back
+} cserver_cache_state_t;
+
+/**
+ * @brief How a cserve_cache_acquire() call was satisfied
+ */
+typedef enum {
+    CACHE_RESULT_HIT,       // Entry was already cached
+    CACHE_RESULT_MISS,      // We loaded the entry ourselves
+    CACHE_RESULT_COALESCED, // Another caller loaded it while we waited
+    CACHE_RESULT_FALLBACK,  // Wait timed out or loader failed, caller must load directly
+    CACHE_RESULT_ERROR      // Our own load failed
+} cserver_cache_result_t;
+
+/**
+ * @brief Why an entry left the cache
+ */
+typedef enum {
+    CACHE_EVICT_CAPACITY,   // LRU eviction to make room for a new object
+    CACHE_EVICT_PRESSURE,   // Budget shrunk because of memory pressure
+    CACHE_EVICT_STALE,      // File changed on disk
+    CACHE_EVICT_INVALIDATE, // Explicit cserve_cache_invalidate()
+    CACHE_EVICT_REASON_COUNT
+} cserver_cache_evict_reason_t;
+
+/**
+ * @brief A cached object
+ *
+ * Entries are reference counted. An entry returned by cserve_cache_acquire()
+ * stays valid until it is handed back with cserve_cache_release(), even if it
+ * is evicted or invalidated in the meantime.
+ */
+typedef struct cserver_cache_entry {
+    // Object contents and their size in bytes
+    char *data;
+    size_t size;
+
+    // Validators, the entry is stale once the file on disk differs
+    struct timespec mtime;
+
+    // Number of cache hits served from this entry
+    unsigned long hits;
+
+    // Internal bookkeeping, protected by the cache lock
+    cserver_cache_state_t state;
+    int refcount;
+    int linked;
+    unsigned long hash;
+    struct cserver_cache_entry *hash_next;
+    struct cserver_cache_entry *lru_prev;
+    struct cserver_cache_entry *lru_next;
+
+    // Cache key (request path)
+    char key[];
+} cserver_cache_entry_t;
+
+/**
+ * @brief Snapshot of cache counters
+ */
+typedef struct {
+    unsigned long hits;
+    unsigned long misses;
+    unsigned long coalesced;
+    unsigned long fallbacks;
+    unsigned long evictions[CACHE_EVICT_REASON_COUNT];
+    size_t entries;
+    size_t bytes;
+    size_t budget;
+} cserver_cache_stats_t;
+
+/**
+ * @brief Initialize the cache
+ *
+ * @param budget Maximum number of bytes of object data to keep cached
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_cache_init(size_t budget);
+
+/**
+ * @brief Look up an object, loading it on a miss
+ *
+ * If another caller is already loading the same key, this waits for that
+ * load (bounded by CACHE_WAIT_TIMEOUT_MS) instead of loading it again.
+ *
+ * @param key Cache key
+ * @param mtime Current modification time of the object (st_mtim), used to detect stale entries
+ * @param size Current size of the object, used to detect stale entries, or CACHE_SIZE_UNKNOWN
+ * @param loader Callback used to load the object on a miss
+ * @param ctx Opaque pointer passed to the loader
+ * @param result Set to how the lookup was satisfied, may be NULL
+ * @return Referenced entry, or NULL on fallback/error
+ *
+ * Note: The returned entry must be handed back using cserve_cache_release()
+ */
+cserver_cache_entry_t *cserve_cache_acquire(const char *key, const struct timespec *mtime,
+                                            size_t size,
+                                            cserver_cache_loader_t loader, void *ctx,
+                                            cserver_cache_result_t *result);
+
+/**
+ * @brief Drop a reference obtained from cserve_cache_acquire()
+ *
+ * @param entry The entry to release
+ */
+void cserve_cache_release(cserver_cache_entry_t *entry);
+
+/**
+ * @brief Remove a key from the cache
+ *
+ * @param key The key to invalidate
+ */
+void cserve_cache_invalidate(const char *key);
+
+/**
+ * @brief Change the cache budget
+ *
+ * Shrinking the budget evicts least recently used entries right away.
+ *
+ * @param budget New maximum number of bytes of object data to keep cached
+ * @param reason Reason recorded for entries evicted to meet the new budget
+ */
+void cserve_cache_set_budget(size_t budget, cserver_cache_evict_reason_t reason);
+
+/**
+ * @brief Get a snapshot of the cache counters
+ *
+ * @param stats Filled with the current counters
+ */
+void cserve_cache_get_stats(cserver_cache_stats_t *stats);
+
+#endif
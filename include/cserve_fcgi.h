@@ -0,0 +1,66 @@
+#ifndef CSERVE_FCGI_H
+#define CSERVE_FCGI_H
+
+/**
+ * cserve_fcgi.h
+ *
+ * FastCGI worker pool for dynamic scripts
+ *
+ * Files ending in FCGI_EXTENSION are run by a pool of FCGI_WORKERS
+ * persistent worker processes (e.g. php-cgi) that cserv starts at init.
+ * Each worker gets its own listening Unix socket as its FastCGI listen
+ * socket (fd 0), the way spawn-fcgi does it, in a directory under
+ * FCGI_SOCKET_DIR that only cserv's user can enter. cserv keeps one
+ * connection to every worker open across requests (FCGI_KEEP_CONN).
+ * A request checks out an idle worker, and the script's output is streamed
+ * to the client as it arrives, chunked unless the script sends a
+ * Content-Length. Bodies larger than the request buffer are refused with
+ * 413, a script is never handed part of one.
+ * Workers that die are started again on their next request.
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Start the worker pool
+ *
+ * @param root_dir Root directory being served, scripts are found below it
+ * @param command Shell command starting one worker, empty to disable FastCGI
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_fcgi_init(const char *root_dir, const char *command);
+
+/**
+ * @brief Stop every worker and remove their sockets and the socket directory
+ */
+void cserve_fcgi_shutdown(void);
+
+/**
+ * @brief Check whether a request targets a script
+ *
+ * @param path The request path
+ * @return 1 if FastCGI is enabled and the path is a script, 0 otherwise
+ */
+int cserve_fcgi_is_script(const char *path);
+
+/**
+ * @brief Check whether a path must never be sent as a file
+ *
+ * Scripts would go out as their source and admin endpoints are for local
+ * clients only, so handlers that read files on behalf of other paths
+ * (includes, bundles) refuse these, whether or not FastCGI is enabled.
+ *
+ * @param path The path to check
+ * @return 1 if the path is a script or an admin path, 0 otherwise
+ */
+int cserve_fcgi_is_private(const char *path);
+
+/**
+ * @brief Run a script and stream back its output
+ *
+ * @param req The request to handle
+ * @return cserver_http_res_t* The response
+ */
+cserver_http_res_t *cserve_fcgi_handler(cserver_http_req_t *req);
+
+#endif
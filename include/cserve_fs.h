@@ -0,0 +1,47 @@
+#ifndef CSERVE_FS_H
+#define CSERVE_FS_H
+
+/**
+ * cserve_fs.h
+ *
+ * Root-anchored file access
+ *
+ * An O_PATH descriptor for the served directory is opened once; files are
+ * opened relative to it with openat2(RESOLVE_BENEATH | RESOLVE_NO_MAGICLINKS),
+ * so the kernel only walks the request path and refuses anything that would
+ * resolve outside the root (.., absolute symlinks, /proc magic links).
+ * Kernels without openat2() fall back to plain openat() on the same
+ * descriptor, relying on validate_path() for traversal safety.
+ */
+
+#include <sys/stat.h>
+
+/**
+ * @brief Open the root directory
+ *
+ * @param root_dir Root directory to serve
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_fs_init(const char *root_dir);
+
+/**
+ * @brief Open a file below the root
+ *
+ * @param path Request path, starting with '/'
+ * @param flags open() flags, O_CLOEXEC is always added
+ * @return File descriptor, or -1 with errno set on error (EXDEV/ELOOP for escapes)
+ */
+int cserve_fs_open(const char *path, int flags);
+
+/**
+ * @brief Get file information for a path below the root
+ *
+ * Metadata only, file contents are always read through cserve_fs_open().
+ *
+ * @param path Request path, starting with '/'
+ * @param st Filled with the file information
+ * @return SUCCESS on success, FAILURE with errno set on error
+ */
+int cserve_fs_stat(const char *path, struct stat *st);
+
+#endif
@@ -10,7 +10,53 @@
  */
 
 #include "cserve_net.h"
+#include <sys/stat.h>
 
-cserver_http_res_t *cserve_get_handler(cserver_http_req_t *req, const char *root_dir);
+/**
+ * @brief Validate the path
+ *
+ * Only absolute paths made of letters, digits, '/', '_', '.' and '-'
+ * without ".." are accepted.
+ *
+ * @param path The path to validate
+ * @return SUCCESS on success, FAILURE on failure
+ */
+int validate_path(const char *path);
+
+/**
+ * @brief Get the content type for a file based on its extension
+ *
+ * @param path The path of the file
+ * @return MIME type of the file, text/plain if unknown
+ */
+const char *cserve_get_content_type(const char *path);
+
+cserver_http_res_t *cserve_get_handler(cserver_http_req_t *req);
+
+/**
+ * @brief Warm the cache for a path before it is requested
+ *
+ * Small files are loaded into the file cache, files too large to cache get a
+ * readahead hint so the kernel pulls them into the page cache instead.
+ *
+ * @param path Request path, starting with '/'
+ * @return SUCCESS if the path was warmed, FAILURE if it was skipped
+ */
+int cserve_get_warm(const char *path);
+
+/**
+ * @brief Make a response body segment for a file without copying it
+ *
+ * Small files are served from the file cache and the segment's buffer
+ * holds a reference to the cache entry, large files are streamed from an
+ * open descriptor. Either is released with the buffer.
+ *
+ * @param path Request path of a regular file
+ * @param st The file's stat information
+ * @param segment Filled with the segment, the caller owns its buffer reference
+ * @return SUCCESS on success, FAILURE on error with errno set
+ */
+int cserve_get_file_segment(const char *path, const struct stat *st,
+                            cserver_http_segment_t *segment);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,105 @@
+#ifndef CSERVE_MEM_H
+#define CSERVE_MEM_H
+
+/**
+ * cserve_mem.h
+ *
+ * Allocator for per-request memory
+ *
+ * Requests, responses, their header text and segment arrays, and body
+ * buffers are allocated through this interface instead of malloc(). The
+ * cache's object memory has its own allocator, see cserve_arena.h.
+ *
+ * The allocator behind it can be swapped with cserve_mem_set_allocator()
+ * before the server starts. The default (MEM_SIZE_CLASSES_ENABLED) keeps
+ * per-thread free lists for power of two size classes up to
+ * MEM_MAX_CLASS_SIZE, refilled by carving MEM_SLAB_SIZE slabs, so a warm
+ * server does not go to malloc() for requests at all and threads do not
+ * contend on malloc's arenas. A block freed by another thread than the one
+ * that allocated it is pushed onto a lock-free list of its owner, which
+ * takes it back on its next refill. Larger blocks go straight to malloc().
+ *
+ * Slabs are never returned to the system, the metrics show how much of
+ * them is in use and how much of that was actually requested, which is
+ * the fragmentation to watch over long uptimes.
+ */
+
+#include <stddef.h>
+
+/**
+ * @brief An allocator implementation
+ *
+ * Every function must be thread safe. Blocks may be freed by a different
+ * thread than the one that allocated them.
+ */
+typedef struct {
+    const char *name;                          // Shown in the metrics output
+    void *(*alloc)(size_t size);               // Like malloc()
+    void *(*realloc)(void *ptr, size_t size);  // Like realloc()
+    void (*free)(void *ptr);                   // Like free()
+} cserver_mem_allocator_t;
+
+// The C library's malloc(), realloc() and free()
+extern const cserver_mem_allocator_t cserve_mem_system;
+
+// Per-thread size-class free lists, the default
+extern const cserver_mem_allocator_t cserve_mem_size_classes;
+
+/**
+ * @brief Replace the allocator
+ *
+ * Must be called before anything is allocated, i.e. before cserve_init().
+ *
+ * @param allocator The allocator to use from now on, must stay valid
+ */
+void cserve_mem_set_allocator(const cserver_mem_allocator_t *allocator);
+
+/**
+ * @brief Register the allocator's counters with the metrics output
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_mem_init(void);
+
+/**
+ * @brief Allocate memory
+ *
+ * @param size Number of bytes
+ * @return Pointer to the memory, or NULL if allocation failed
+ */
+void *cserve_mem_alloc(size_t size);
+
+/**
+ * @brief Allocate zeroed memory for an array
+ *
+ * @param nmemb Number of elements
+ * @param size Size of an element
+ * @return Pointer to the memory, or NULL if allocation failed
+ */
+void *cserve_mem_calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief Resize memory from cserve_mem_alloc()
+ *
+ * @param ptr The memory to resize, NULL to allocate
+ * @param size New size in bytes
+ * @return Pointer to the resized memory, or NULL if allocation failed (ptr is left alone then)
+ */
+void *cserve_mem_realloc(void *ptr, size_t size);
+
+/**
+ * @brief Copy a string into memory from cserve_mem_alloc()
+ *
+ * @param s The string to copy
+ * @return The copy, or NULL if allocation failed
+ */
+char *cserve_mem_strdup(const char *s);
+
+/**
+ * @brief Free memory from cserve_mem_alloc() and friends
+ *
+ * @param ptr The memory to free, may be NULL
+ */
+void cserve_mem_free(void *ptr);
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef CSERVE_MEMORY_H
+#define CSERVE_MEMORY_H
+
+/**
+ * cserve_memory.h
+ *
+ * Memory-pressure aware cache sizing
+ *
+ * The cache budget is derived from the cgroup v2 memory.max limit (or the
+ * host's available memory outside a limited cgroup). A background thread
+ * watches memory.pressure (PSI) and the cgroup's usage, shrinking the cache
+ * when pressure rises and growing it back once things are calm.
+ */
+
+#include <stddef.h>
+
+/**
+ * @brief Work out the largest cache budget for this container
+ *
+ * Called before the arena and cache are set up, they are sized from it.
+ *
+ * @return Maximum cache budget in bytes
+ */
+size_t cserve_memory_max_budget(void);
+
+/**
+ * @brief Start watching memory pressure
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_memory_init(void);
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef CSERVE_META_H
+#define CSERVE_META_H
+
+/**
+ * cserve_meta.h
+ *
+ * File metadata cache
+ *
+ * Remembers which alternative encodings exist next to a file (photo.jpg.avif,
+ * photo.jpg.webp) and how large they are, so content negotiation does not
+ * stat every candidate on every image request. Entries are validated against
+ * the site index generation, which changes whenever a file is added, removed
+ * or renamed; without a watched site index they expire after META_TTL_SECONDS.
+ */
+
+#include <sys/types.h>
+
+/**
+ * @brief Alternative encodings that may exist next to a file
+ *
+ * Ordered by preference, add new ones before VARIANT_COUNT and describe
+ * them in cserve_meta.c
+ */
+typedef enum {
+    VARIANT_AVIF,
+    VARIANT_WEBP,
+    VARIANT_COUNT
+} cserver_variant_t;
+
+/**
+ * @brief Which variants of a file exist
+ */
+typedef struct {
+    // Size in bytes of each variant, -1 if it does not exist
+    off_t size[VARIANT_COUNT];
+} cserver_meta_variants_t;
+
+/**
+ * @brief Initialize the metadata cache
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_meta_init(void);
+
+/**
+ * @brief Look up which variants of a file exist
+ *
+ * @param path Request path of the original file
+ * @param variants Filled with the variant sizes
+ */
+void cserve_meta_variants(const char *path, cserver_meta_variants_t *variants);
+
+/**
+ * @brief Get the file name suffix of a variant
+ *
+ * @param variant The variant
+ * @return Suffix appended to the original file name, e.g. ".webp"
+ */
+const char *cserve_meta_variant_suffix(cserver_variant_t variant);
+
+/**
+ * @brief Get the MIME type of a variant
+ *
+ * @param variant The variant
+ * @return MIME type, e.g. "image/webp"
+ */
+const char *cserve_meta_variant_type(cserver_variant_t variant);
+
+#endif
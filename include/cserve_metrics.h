@@ -0,0 +1,98 @@
+#ifndef CSERVE_METRICS_H
+#define CSERVE_METRICS_H
+
+/**
+ * cserve_metrics.h
+ *
+ * Server counters and the text rendering used by the metrics endpoint
+ */
+
+#include <stddef.h>
+
+/**
+ * @brief Global counters
+ *
+ * Add new counters before METRIC_COUNT and give them a name in cserve_metrics.c
+ */
+typedef enum {
+    METRIC_REQUESTS_TOTAL,      // Requests parsed successfully
+    METRIC_BLOOM_FILTERED,      // Requests rejected by the site index without touching the disk
+    METRIC_STREAMED_FILES,      // Large files sent with sendfile() instead of the cache
+    METRIC_STREAMED_BYTES,      // Bytes sent by those
+    METRIC_VARIANTS_SERVED,     // Images answered with a smaller AVIF/WebP variant
+    METRIC_VARIANT_BYTES_SAVED, // Bytes not sent thanks to those
+    METRIC_BUNDLES_SERVED,      // Multi-file bundle responses
+    METRIC_BUNDLE_PARTS,        // Files sent in those
+    METRIC_EARLY_HINTS,         // 103 Early Hints sent ahead of HTML pages
+    METRIC_QUERY_DROPPED,       // Query parameters removed by normalization
+    METRIC_FCGI_REQUESTS,       // Requests handed to a FastCGI worker
+    METRIC_FCGI_ERRORS,         // Of those, ones the worker failed to answer
+    METRIC_FCGI_RESPAWNS,       // FastCGI workers started again after exiting
+    METRIC_SSI_PAGES,           // HTML pages assembled from server-side includes
+    METRIC_SSI_INCLUDES,        // Fragments included into those
+    METRIC_COUNT
+} cserver_metric_t;
+
+/**
+ * @brief Growable text buffer that metrics sections render into
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} cserver_metrics_buf_t;
+
+/**
+ * @brief Callback that renders one section of the metrics output
+ *
+ * @param buf Buffer to append to using cserve_metrics_appendf()
+ */
+typedef void (*cserver_metrics_section_t)(cserver_metrics_buf_t *buf);
+
+/**
+ * @brief Increment a counter by one
+ *
+ * @param metric The counter to increment
+ */
+void cserve_metrics_inc(cserver_metric_t metric);
+
+/**
+ * @brief Add a value to a counter
+ *
+ * @param metric The counter to update
+ * @param value The amount to add
+ */
+void cserve_metrics_add(cserver_metric_t metric, unsigned long value);
+
+/**
+ * @brief Register a module specific section of the metrics output
+ *
+ * @param section Render callback, called on every metrics request
+ * @return SUCCESS on success, FAILURE if there is no room for more sections
+ */
+int cserve_metrics_register(cserver_metrics_section_t section);
+
+/**
+ * @brief Append formatted text to a metrics buffer
+ *
+ * Text that does not fit and can't be made to fit is dropped, the buffer
+ * keeps what it held before.
+ *
+ * @param buf The buffer to append to
+ * @param fmt printf style format string
+ * @return SUCCESS if the text was appended, FAILURE if it was dropped
+ */
+int cserve_metrics_appendf(cserver_metrics_buf_t *buf, const char *fmt, ...);
+
+/**
+ * @brief Render all counters and registered sections
+ *
+ * Output uses the Prometheus text format, one "name value" pair per line.
+ *
+ * @return Pointer to the rendered text, or NULL if rendering failed
+ *
+ * Note: The returned string must be freed by the caller using free()
+ */
+char *cserve_metrics_render(void);
+
+#endif
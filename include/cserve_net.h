@@ -9,7 +9,9 @@
  * Network related functions
  */
 
+#include "cserve_buf.h"
 #include <stddef.h>
+#include <sys/types.h>
 
 /**
  * @brief Structure to hold HTTP request information
@@ -27,6 +29,14 @@ typedef struct {
     // This tells us what resource the client wants
     char path[512];
 
+    // Query string - everything after the '?' in the URL, without the '?'
+    // (e.g., "f=/style.css,/app.js"), empty if there was none
+    char query[512];
+
+    // Request target as it appeared on the request line, path and query together
+    // Handlers rewrite path and query (index files, variants, normalization), this stays as sent
+    char target[512];
+
     // HTTP version (e.g., "HTTP/1.1", "HTTP/1.0")
     // Different versions have different capabilities
     char version[16];
@@ -47,6 +57,31 @@ typedef struct {
     // "keep-alive" means reuse connection, "close" means close after response
     char connection[32];
 
+    // If-None-Match header - validator (ETag) of the copy the client already has
+    // Lets us answer 304 Not Modified instead of sending the body again
+    char if_none_match[128];
+
+    // Content-Length header - size of the request body in bytes, 0 if none
+    size_t content_length;
+
+    // Content-Type header - format of the request body (e.g., form posts), empty if none
+    char content_type[128];
+
+    // Request body - as much of it as arrived with the request, NUL terminated
+    // Only small bodies (form posts) are supported, binary ones may hold NULs
+    char body[4096];
+
+    // Number of body bytes in body, less than content_length if it did not all fit
+    size_t body_len;
+
+    // Address of the client that sent the request (e.g., "127.0.0.1")
+    // Filled in by the server after parsing, not part of the HTTP message
+    char client_addr[46];
+
+    // Socket the request arrived on, -1 if unknown
+    // Lets handlers send interim responses ahead of the final one
+    int client_fd;
+
 } cserver_http_req_t;
 
 /**
@@ -56,11 +91,12 @@ typedef struct {
  * extracts the important information into a structured format.
  *
  * @param raw_request The raw HTTP request text from the client
+ * @param length Number of bytes received, the body may contain NULs
  * @return Pointer to parsed request structure, or NULL if parsing failed
  *
- * Note: The returned pointer must be freed by the caller using free()
+ * Note: The returned pointer must be freed by the caller using cserve_mem_free()
  */
-cserver_http_req_t *parse_http_request(const char *raw_request);
+cserver_http_req_t *parse_http_request(const char *raw_request, size_t length);
 
 /**
  * @brief Print an HTTP request for debugging
@@ -76,16 +112,22 @@ void print_http_request(cserver_http_req_t *req);
  * Each status code has a specific meaning defined by the HTTP protocol.
  */
 typedef enum {
+    HTTP_STATUS_EARLY_HINTS = 103,           // Interim response, resources to start loading
     HTTP_STATUS_OK = 200,                    // Request successful
     HTTP_STATUS_CREATED = 201,               // Resource created successfully
     HTTP_STATUS_NO_CONTENT = 204,            // Success but no content to return
+    HTTP_STATUS_MOVED_PERMANENTLY = 301,     // Resource lives at the Location header
+    HTTP_STATUS_FOUND = 302,                 // Resource temporarily at the Location header
+    HTTP_STATUS_NOT_MODIFIED = 304,          // Client's cached copy is still valid
     HTTP_STATUS_BAD_REQUEST = 400,           // Client sent invalid request
     HTTP_STATUS_UNAUTHORIZED = 401,          // Authentication required
     HTTP_STATUS_FORBIDDEN = 403,             // Server understood but refuses to authorize
     HTTP_STATUS_NOT_FOUND = 404,             // Requested resource not found
     HTTP_STATUS_METHOD_NOT_ALLOWED = 405,    // HTTP method not supported for resource
+    HTTP_STATUS_PAYLOAD_TOO_LARGE = 413,     // Request body larger than we accept
     HTTP_STATUS_INTERNAL_SERVER_ERROR = 500, // Server encountered unexpected condition
     HTTP_STATUS_NOT_IMPLEMENTED = 501,       // Server doesn't support functionality
+    HTTP_STATUS_BAD_GATEWAY = 502,           // Upstream (e.g., FastCGI worker) failed
     HTTP_STATUS_SERVICE_UNAVAILABLE = 503    // Server temporarily overloaded or down
 } cserver_http_status_t;
 
@@ -113,6 +155,87 @@ typedef enum {
  */
 cserver_http_method_t method_str_to_enum(const char *method);
 
+/**
+ * @brief One piece of a response body, a byte range of a buffer
+ *
+ * Segments hold a reference to their buffer until the response is freed.
+ */
+typedef struct {
+    cserver_buf_t *buf;
+    size_t offset;
+    size_t length;
+} cserver_http_segment_t;
+
+/**
+ * @brief Growable buffer of header lines
+ *
+ * Header lines are copied in as they are, with no format strings to parse.
+ * The buffer grows as needed and is always NUL terminated once something
+ * was appended. If an allocation fails the builder is marked failed and
+ * ignores everything appended after that, so callers can append a batch
+ * and check once.
+ */
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+    int failed;
+} cserver_http_headers_t;
+
+// Append a string literal, its length is known at compile time
+#define HTTP_HEADERS_APPEND_LITERAL(headers, str)                                                 \
+    http_headers_append((headers), (str), sizeof(str) - 1)
+
+/**
+ * @brief Append raw bytes to a header buffer
+ *
+ * @param headers The header buffer, zero initialized before first use
+ * @param data Bytes to append
+ * @param len Number of bytes
+ */
+void http_headers_append(cserver_http_headers_t *headers, const char *data, size_t len);
+
+/**
+ * @brief Append a decimal number to a header buffer
+ *
+ * @param headers The header buffer
+ * @param value The number
+ */
+void http_headers_append_uint(cserver_http_headers_t *headers, unsigned long long value);
+
+/**
+ * @brief Append a "name: value" header line
+ *
+ * @param headers The header buffer
+ * @param name Header name
+ * @param value Header value, must not contain CR or LF
+ */
+void http_headers_add(cserver_http_headers_t *headers, const char *name, const char *value);
+
+/**
+ * @brief Free a header buffer's memory and reset it for reuse
+ *
+ * @param headers The header buffer
+ */
+void http_headers_free(cserver_http_headers_t *headers);
+
+// Content-Length of a body whose size is not known until it has been produced
+#define HTTP_CONTENT_LENGTH_UNKNOWN ((size_t)-1)
+
+/**
+ * @brief Callback producing a response body piece by piece
+ *
+ * Called again only once the previous piece has been written to the
+ * socket, so a slow client slows the producer down instead of making it
+ * buffer the whole body.
+ *
+ * @param ctx The response's producer_ctx
+ * @param buf Buffer to write the next piece into
+ * @param size Size of the buffer
+ * @return Number of bytes written to buf, 0 at the end of the body, -1 on error
+ */
+typedef ssize_t (*cserver_http_producer_t)(void *ctx, char *buf, size_t size);
+
 /**
  * @brief Structure to hold HTTP response information
  *
@@ -145,8 +268,44 @@ typedef struct {
     // Connection header - whether to keep connection alive or close it
     char connection[32];
 
-    // Response body - the actual content (HTML, JSON, etc.)
-    char *body;
+    // Location header - where a redirect points to, omitted if empty
+    char location[520];
+
+    // Vary header - request headers the response was chosen by, omitted if empty
+    char vary[64];
+
+    // Complete "Cache-Control: ...\r\n" line shared between responses, omitted if NULL
+    // Not owned by the response, it points at a precomputed caching rule
+    const char *cache_control;
+
+    // Expires header - when HTTP/1.0 caches should consider the body stale, omitted if empty
+    char expires[64];
+
+    // ETag header - validator clients send back in If-None-Match, omitted if empty
+    char etag[48];
+
+    // Link header - assets the client should preload, omitted if empty
+    char link[512];
+
+    // Any other header lines, added with http_response_add_header()
+    cserver_http_headers_t headers;
+
+    // Response body - the actual content (HTML, JSON, etc.) as a list of segments
+    // content_length is the sum of the segment lengths, see http_response_append()
+    cserver_http_segment_t *segments;
+    size_t num_segments;
+    size_t segments_cap;
+
+    // Body generated while it is sent instead of segments, NULL if unused
+    // content_length is HTTP_CONTENT_LENGTH_UNKNOWN unless the handler knows it up front
+    cserver_http_producer_t producer;
+    void *producer_ctx;
+    void (*producer_release)(void *ctx); // called with producer_ctx when freed, may be NULL
+
+    // Send the produced body with Transfer-Encoding: chunked
+    // Set by the server for bodies of unknown length when the client speaks HTTP/1.1,
+    // older clients get the body unframed and read until the connection closes
+    int chunked;
 
 } cserver_http_res_t;
 
@@ -169,34 +328,103 @@ typedef struct {
 cserver_http_res_t *create_http_response(cserver_http_status_t status_code,
                                          const char *content_type, const char *body);
 
+/**
+ * @brief Add a header without a field of its own to a response
+ *
+ * Headers are sent in the order they were added, after the standard ones.
+ *
+ * @param response The response
+ * @param name Header name
+ * @param value Header value, must not contain CR or LF
+ * @return SUCCESS on success, FAILURE if memory allocation failed
+ */
+int http_response_add_header(cserver_http_res_t *response, const char *name, const char *value);
+
+/**
+ * @brief Append a byte range of a buffer to a response body
+ *
+ * The response takes its own reference, the caller keeps its reference.
+ * Appending the same buffer to many responses, or several ranges of it to
+ * one, shares it without copying.
+ *
+ * @param response The response, must not have a body producer
+ * @param buf The buffer
+ * @param offset Offset of the first byte in the buffer
+ * @param length Number of bytes
+ * @return SUCCESS on success, FAILURE if memory allocation failed
+ */
+int http_response_append(cserver_http_res_t *response, cserver_buf_t *buf, size_t offset,
+                         size_t length);
+
+/**
+ * @brief Create a response whose body is generated while it is sent
+ *
+ * The response starts out with an unknown Content-Length, a handler that
+ * knows the size can set content_length afterwards.
+ *
+ * @param status_code HTTP status code
+ * @param content_type MIME type of the content
+ * @param producer Callback producing the body
+ * @param ctx Passed to producer and release
+ * @param release Called with ctx when the response is freed, may be NULL
+ * @return Pointer to new response structure, or NULL if creation failed, ctx is released then
+ */
+cserver_http_res_t *create_streaming_response(cserver_http_status_t status_code,
+                                              const char *content_type,
+                                              cserver_http_producer_t producer, void *ctx,
+                                              void (*release)(void *ctx));
+
 /**
  * @brief Convert HTTP response structure to byte stream for transmission
  *
  * Converts the structured HTTP response into a properly formatted
- * HTTP response string that can be sent over a socket connection.
+ * HTTP header block that can be sent over a socket connection. The body
+ * is not copied in, it is sent from its segments after the headers.
  *
  * Format:
  * HTTP/1.1 200 OK\r\n
  * Date: ...\r\n
  * Server: ...\r\n
  * Content-Type: ...\r\n
- * Content-Length: ...\r\n
+ * Content-Length: ...\r\n (or Transfer-Encoding: chunked, or neither if the length is unknown)
  * Connection: ...\r\n
+ * Location: ...\r\n (redirects only)
+ * Vary: ...\r\n (negotiated responses only)
+ * Cache-Control: ...\r\n (files only)
+ * Expires: ...\r\n (files only)
+ * ETag: ...\r\n (if set)
+ * Link: ...\r\n (if set)
+ * [headers added with http_response_add_header()]
  * \r\n
- * [body content]
  *
  * @param response Pointer to the HTTP response structure
- * @return Pointer to formatted response string, or NULL if conversion failed
+ * @return Pointer to the NUL terminated header block, or NULL if conversion failed
  *
- * Note: The returned string must be freed by the caller using free()
+ * Note: The returned string must be freed by the caller using cserve_mem_free()
  */
 char *http_response_to_string(const cserver_http_res_t *response);
 
+/**
+ * @brief Send an interim (1xx) response ahead of the final one
+ *
+ * Written straight to the request's socket, so the client can act on it
+ * while the final response is still being built. HTTP/1.0 clients don't
+ * understand interim responses and are never sent one.
+ *
+ * @param req The request being answered
+ * @param status_code A 1xx status code
+ * @param headers Header lines of the interim response
+ * @return SUCCESS if it was sent, FAILURE otherwise
+ */
+int send_interim_response(const cserver_http_req_t *req, cserver_http_status_t status_code,
+                          const cserver_http_headers_t *headers);
+
 /**
  * @brief Free memory allocated for HTTP response structure
  *
  * Properly deallocates all memory associated with an HTTP response,
- * including the body content and the structure itself.
+ * including the structure itself and its extra headers, drops the
+ * references held by the body segments and releases the body producer.
  *
  * @param response Pointer to the HTTP response structure to free
  */
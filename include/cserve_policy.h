@@ -0,0 +1,57 @@
+#ifndef CSERVE_POLICY_H
+#define CSERVE_POLICY_H
+
+/**
+ * cserve_policy.h
+ *
+ * Browser caching policy
+ *
+ * Every served file is matched against a table of rules (fingerprinted
+ * name, path prefix, extension) and gets the Cache-Control and Expires
+ * headers of the first rule that matches. Fingerprinted names such as
+ * app.3f9a2c11.js change whenever their content does, so they are cached
+ * for a year and marked immutable. The Cache-Control line of every rule is
+ * formatted once at init and shared by all responses.
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Format the header lines of every rule
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_policy_init(void);
+
+/**
+ * @brief Set the caching headers of a response for a file
+ *
+ * @param response The response to a successful file request
+ * @param path Request path of the file actually served
+ */
+void cserve_policy_apply(cserver_http_res_t *response, const char *path);
+
+/**
+ * @brief Set the caching headers of a response made of several files
+ *
+ * The rule with the shortest max-age among all files is used.
+ *
+ * @param response The response to a successful request
+ * @param paths Request paths of the files served
+ * @param count Number of paths
+ */
+void cserve_policy_apply_all(cserver_http_res_t *response, const char *const *paths, size_t count);
+
+/**
+ * @brief Check whether a file name carries a content fingerprint
+ *
+ * A fingerprint is a dot or dash separated run of at least six lowercase
+ * hex digits, mixing digits and letters, followed by an extension, e.g.
+ * app.3f9a2c.js or logo-9b1e04d2.png.
+ *
+ * @param path Request path of the file
+ * @return 1 if the name is fingerprinted, 0 otherwise
+ */
+int cserve_policy_is_fingerprinted(const char *path);
+
+#endif
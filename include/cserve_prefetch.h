@@ -0,0 +1,52 @@
+#ifndef CSERVE_PREFETCH_H
+#define CSERVE_PREFETCH_H
+
+/**
+ * cserve_prefetch.h
+ *
+ * Predictive prefetch of the assets a page links to
+ *
+ * When an HTML page is served, a background thread scans it for same-origin
+ * stylesheets, scripts and images (<link href>, <script src>, <img src>) and
+ * warms them into the file cache, so the requests the browser sends right
+ * after the page find them hot. Scan results are cached per page and only
+ * redone when the page changes. With PREFETCH_LINK_PRELOAD set, pages whose
+ * scan is already cached also get a Link: rel=preload header.
+ */
+
+#include "cserve_net.h"
+#include <sys/stat.h>
+
+/**
+ * @brief Start the prefetch thread
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_prefetch_init(void);
+
+/**
+ * @brief Note that an HTML page is being served
+ *
+ * Queues the page for scanning and warming unless that was done recently.
+ * Never blocks, pages are dropped when the queue is full.
+ *
+ * @param path Request path of the page
+ * @param st The page's stat information
+ * @param response The page's response, gets a Link header if enabled and known
+ */
+void cserve_prefetch_page(const char *path, const struct stat *st, cserver_http_res_t *response);
+
+/**
+ * @brief Get the preload links of a page whose scan is cached
+ *
+ * Never scans, a page that was not scanned yet or changed since has no links.
+ *
+ * @param path Request path of the page
+ * @param st The page's stat information
+ * @param links Set to the value of a Link header, e.g. "</a.css>; rel=preload; as=style"
+ * @param size Size of the links buffer
+ * @return SUCCESS if the page has links to preload, FAILURE otherwise
+ */
+int cserve_prefetch_links(const char *path, const struct stat *st, char *links, size_t size);
+
+#endif
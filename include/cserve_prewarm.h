@@ -0,0 +1,33 @@
+#ifndef CSERVE_PREWARM_H
+#define CSERVE_PREWARM_H
+
+/**
+ * cserve_prewarm.h
+ *
+ * Cache pre-warming from persisted hotness statistics
+ *
+ * The hottest request paths are saved to a state file periodically and on
+ * shutdown. On startup a background thread reads them back and loads the
+ * files into the cache while the server is already accepting traffic.
+ */
+
+/**
+ * @brief Start pre-warming and periodic saving
+ *
+ * Does nothing if state_file is NULL or empty.
+ *
+ * @param state_file File the hot paths are kept in across restarts
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_prewarm_init(const char *state_file);
+
+/**
+ * @brief Save the current hot paths to the state file
+ *
+ * Called on shutdown, and periodically from the background thread.
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_prewarm_save(void);
+
+#endif
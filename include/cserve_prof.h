@@ -0,0 +1,68 @@
+#ifndef CSERVE_PROF_H
+#define CSERVE_PROF_H
+
+/**
+ * cserve_prof.h
+ *
+ * Sampling CPU profiler
+ *
+ * While running, an ITIMER_PROF timer sends SIGPROF PROF_HZ times per
+ * second of CPU the process uses. The handler walks the frame pointers of
+ * whichever thread was interrupted and writes the stack into that thread's
+ * sample buffer. The handler takes no locks and does not allocate. Each
+ * buffer is a single producer ring, so all it costs is a few loads and
+ * stores. Every PROF_DRAIN_MS a profiler thread moves the samples into a
+ * table of distinct stacks. The report symbolizes them, using the
+ * executable's own symbol table and dladdr() for shared libraries, and
+ * prints them in the folded format flamegraph.pl and speedscope read.
+ *
+ * It is driven through the admin endpoints profile/start, profile/stop and
+ * profile, so CPU profiles can be taken in containers where perf is not
+ * available. Stacks are only as good as the frame pointers, which the
+ * Makefile keeps. A sample taken inside a library built without them
+ * (libc mostly) shows the library function with its caller's caller
+ * below it. The walk never leaves the interrupted thread's stack, whose
+ * bounds are recorded when the thread registers. Threads that did not
+ * register are sampled with their leaf frame only.
+ */
+
+/**
+ * @brief Register the profiler's counters and the calling thread
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_prof_init(void);
+
+/**
+ * @brief Register the calling thread, so its samples get full stacks
+ *
+ * Records the bounds of the thread's stack, which the signal handler can't
+ * look up itself. Threads call it once when they start.
+ */
+void cserve_prof_register_thread(void);
+
+/**
+ * @brief Start profiling, dropping the stacks of an earlier run
+ *
+ * @return SUCCESS on success, FAILURE if already running or on error
+ */
+int cserve_prof_start(void);
+
+/**
+ * @brief Stop profiling, the collected stacks stay available for the report
+ */
+void cserve_prof_stop(void);
+
+/**
+ * @brief Render the collected stacks in folded format
+ *
+ * One line per distinct stack, frames from the outermost to the
+ * innermost separated by ';', then a space and the number of samples.
+ *
+ * @return Pointer to the report, or NULL if rendering failed
+ *
+ * Note: The returned string must be freed by the caller using free()
+ */
+char *cserve_prof_report(void);
+
+#endif
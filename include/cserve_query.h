@@ -0,0 +1,33 @@
+#ifndef CSERVE_QUERY_H
+#define CSERVE_QUERY_H
+
+/**
+ * cserve_query.h
+ *
+ * Query string normalization
+ *
+ * Requests are rewritten to a canonical query string as soon as they are
+ * parsed, so the same resource never shows up under endless keys just
+ * because links carry tracking or cache-busting parameters. A table of
+ * per-route rules decides which parameters a route depends on; tracking
+ * parameters (utm_*, fbclid, gclid) and the jQuery-style "_" cache buster
+ * are dropped. The parameters that are left are sorted by name, keeping
+ * the order of repeated names, and joined with '&'. Scripts are the
+ * exception, they see the query string exactly as the client sent it.
+ *
+ *   /_bundle?utm_source=x&f=/b.js&f=/a.css  ->  f=/b.js&f=/a.css
+ *   /style.css?v=3&_=1699999999             ->  v=3
+ */
+
+#include "cserve_net.h"
+
+/**
+ * @brief Rewrite the query string of a request to its canonical form
+ *
+ * Queries with more parameters than can be sorted are left unchanged.
+ *
+ * @param req The parsed request, its query is modified in place
+ */
+void cserve_query_normalize(cserver_http_req_t *req);
+
+#endif
@@ -0,0 +1,38 @@
+#ifndef CSERVE_SSI_H
+#define CSERVE_SSI_H
+
+/**
+ * cserve_ssi.h
+ *
+ * Server-side includes for HTML pages
+ *
+ * With SSI_ENABLED, HTML pages may pull in shared fragments (headers,
+ * footers) with <!--#include virtual="/path" -->, relative paths resolve
+ * against the page's directory. No other directives are supported.
+ * Scripts (FCGI_EXTENSION) and admin endpoints can't be included.
+ *
+ * A page is scanned once into a template of literal text and include
+ * references, kept in the file cache next to the fragments and validated
+ * against the page's mtime and size. A response is then a list of segments
+ * pointing into the cached template and fragments, sent with one writev(),
+ * nothing is copied or scanned again. Included HTML fragments are expanded
+ * the same way, up to SSI_MAX_DEPTH levels deep.
+ */
+
+#include "cserve_net.h"
+#include <sys/stat.h>
+
+/**
+ * @brief Append a page to a response, expanding its includes
+ *
+ * Pages without directives are appended as they are. Includes that cannot
+ * be resolved are replaced with an error message, the page is still served.
+ *
+ * @param response The response to append to
+ * @param path Request path of the page
+ * @param st The page's stat information
+ * @return SUCCESS on success, FAILURE with errno set if the page itself could not be loaded
+ */
+int cserve_ssi_append(cserver_http_res_t *response, const char *path, const struct stat *st);
+
+#endif
@@ -0,0 +1,49 @@
+#ifndef CSERVE_STREAM_H
+#define CSERVE_STREAM_H
+
+/**
+ * cserve_stream.h
+ *
+ * Page-cache-friendly delivery of large files
+ *
+ * Large one-off downloads are sent straight from the file with sendfile()
+ * instead of going through the file cache. The kernel is told the access
+ * is sequential, and pages we have already sent are dropped from the page
+ * cache behind the send cursor so bulk transfers do not push out the small
+ * hot assets everybody else is requesting.
+ */
+
+#include "cserve_net.h"
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Send a range of a file to a socket
+ *
+ * @param sock The client socket
+ * @param fd The file to send
+ * @param offset Offset of the first byte to send
+ * @param length Number of bytes to send
+ * @return SUCCESS if everything was sent, FAILURE on error
+ */
+int cserve_stream_file(int sock, int fd, off_t offset, size_t length);
+
+/**
+ * @brief Send a response to a socket
+ *
+ * The header block and the runs of memory segments after it go out in
+ * single writev() calls, file segments with cserve_stream_file(). Nothing
+ * is copied. A body producer is instead asked for one piece at a time,
+ * each written before the next is produced so the socket throttles it,
+ * and framed as chunks if the response is chunked.
+ *
+ * @param sock The client socket
+ * @param head The header block
+ * @param head_len Length of the header block
+ * @param response The response whose body to send
+ * @return SUCCESS if everything was sent, FAILURE on error
+ */
+int cserve_stream_response(int sock, const char *head, size_t head_len,
+                           const cserver_http_res_t *response);
+
+#endif
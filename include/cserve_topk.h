@@ -0,0 +1,92 @@
+#ifndef CSERVE_TOPK_H
+#define CSERVE_TOPK_H
+
+/**
+ * cserve_topk.h
+ *
+ * Heavy-hitter tracking with fixed size Space-Saving sketches
+ *
+ * One sketch per tracked dimension (paths, clients, user agents), each
+ * holding TOPK_CAPACITY counters for the current time window plus a copy
+ * of the previous, complete window.
+ */
+
+#include <stddef.h>
+
+// Longest key we track, longer keys are truncated
+#define TOPK_KEY_SIZE 128
+
+/**
+ * @brief Dimensions we track heavy hitters for
+ */
+typedef enum {
+    TOPK_PATHS,
+    TOPK_CLIENTS,
+    TOPK_USER_AGENTS,
+    TOPK_KIND_COUNT
+} cserver_topk_kind_t;
+
+/**
+ * @brief Window a snapshot is taken from
+ */
+typedef enum {
+    TOPK_WINDOW_CURRENT,  // Window being filled right now
+    TOPK_WINDOW_PREVIOUS  // Last complete window
+} cserver_topk_window_t;
+
+/**
+ * @brief One tracked key
+ *
+ * Space-Saving overestimates: the true count is between count - error and count.
+ */
+typedef struct {
+    char key[TOPK_KEY_SIZE];
+    unsigned long count;
+    unsigned long error;
+} cserver_topk_item_t;
+
+/**
+ * @brief Initialize the sketches and register the metrics section
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_topk_init(void);
+
+/**
+ * @brief Count one occurrence of a key
+ *
+ * @param kind Which sketch to update
+ * @param key The key to count, empty keys are ignored
+ */
+void cserve_topk_add(cserver_topk_kind_t kind, const char *key);
+
+/**
+ * @brief Copy the heaviest keys of a sketch, sorted by count
+ *
+ * @param kind Which sketch to read
+ * @param window Which window to read
+ * @param items Output array
+ * @param max_items Size of the output array
+ * @return Number of items written
+ */
+size_t cserve_topk_snapshot(cserver_topk_kind_t kind, cserver_topk_window_t window,
+                            cserver_topk_item_t *items, size_t max_items);
+
+/**
+ * @brief Get the name of a sketch, as used in metrics and the admin report
+ *
+ * @param kind The sketch
+ * @return Static name string
+ */
+const char *cserve_topk_name(cserver_topk_kind_t kind);
+
+/**
+ * @brief Render all sketches as a plain text report
+ *
+ * @return Pointer to the report, or NULL if rendering failed
+ *
+ * Note: The returned string must be freed by the caller using free()
+ */
+char *cserve_topk_report(void);
+
+#endif
@@ -5,16 +5,47 @@
  * @author Karan Purohit
  * @date 10/10/25
  */
+
+// Define feature macros before including headers
+// These enable sigaction, pthread_sigmask and strcasestr
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
 #include "cserve.h"
 #include "config.h"
+#include "cserve_access.h"
+#include "cserve_admin.h"
+#include "cserve_alloc.h"
+#include "cserve_arena.h"
+#include "cserve_bloom.h"
+#include "cserve_bundle.h"
+#include "cserve_fcgi.h"
+#include "cserve_cache.h"
+#include "cserve_fs.h"
 #include "cserve_get_handler.h"
+#include "cserve_memory.h"
+#include "cserve_mem.h"
+#include "cserve_meta.h"
+#include "cserve_metrics.h"
 #include "cserve_net.h"
+#include "cserve_policy.h"
+#include "cserve_prefetch.h"
+#include "cserve_prewarm.h"
+#include "cserve_prof.h"
+#include "cserve_query.h"
+#include "cserve_stream.h"
+#include "cserve_topk.h"
 #include "error.h"
+#include <arpa/inet.h>
+#include <errno.h>
 #include <netinet/in.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/socket.h>
+#include <time.h>
 #include <unistd.h>
 
 // defines
@@ -24,19 +55,163 @@
 // globals
 int PORT;
 char DIRECTORY[MAX_DIR_PATH_SIZE];
+static volatile sig_atomic_t shutdown_requested;
+
+/**
+ * @brief SIGINT/SIGTERM handler, asks the accept loop to stop
+ *
+ * @param signum The signal number
+ */
+static void handle_shutdown_signal(int signum) {
+    (void)signum;
+    shutdown_requested = 1;
+}
+
+/**
+ * @brief Block or unblock the shutdown signals in the calling thread
+ *
+ * Background threads are created with the signals blocked so they are always
+ * delivered to the accept loop, where they interrupt accept().
+ *
+ * @param how SIG_BLOCK or SIG_UNBLOCK
+ */
+static void mask_shutdown_signals(int how) {
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGINT);
+    sigaddset(&set, SIGTERM);
+    pthread_sigmask(how, &set, NULL);
+}
+
+/**
+ * @brief Read a request, including a small body, into a buffer
+ *
+ * Keeps reading until the headers are complete and as much of the body as
+ * Content-Length announces has arrived, or the buffer is full.
+ *
+ * @param sock The client socket
+ * @param buffer Buffer to read into, NUL terminated on return
+ * @param size Size of the buffer
+ * @return Number of bytes read, or -1 on error
+ */
+static ssize_t read_request(int sock, char *buffer, size_t size) {
+    size_t len = 0;
+    while (len < size - 1) {
+        ssize_t n = read(sock, buffer + len, size - 1 - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            return -1;
+        }
+        if (n == 0) {
+            break;
+        }
+        len += (size_t)n;
+        buffer[len] = '\0';
+
+        char *header_end = strstr(buffer, "\r\n\r\n");
+        if (header_end == NULL) {
+            continue;
+        }
+        char *length = strcasestr(buffer, "\r\nContent-Length:");
+        if (length == NULL || length > header_end) {
+            break;
+        }
+        size_t body_len = strtoul(length + strlen("\r\nContent-Length:"), NULL, 10);
+        if (len >= (size_t)(header_end + 4 - buffer) + body_len) {
+            break;
+        }
+    }
+    buffer[len] = '\0';
+    return (ssize_t)len;
+}
 
 /**
  * @brief Initialize the server
  *
  * @param port Port number to listen on
  * @param directory Root directory to serve
+ * @param state_file File hot paths are persisted in, empty to disable pre-warming
+ * @param fastcgi_command Command starting a FastCGI worker, empty to disable scripts
+ * @param access_log File to append the access log to, empty to disable
  * @return SUCCESS on success, negative value on error
  */
-int cserve_init(int port, const char *directory) {
+int cserve_init(int port, const char *directory, const char *state_file,
+                const char *fastcgi_command, const char *access_log) {
+    // Threads started below inherit this mask, cserve_start() unblocks the main thread
+    mask_shutdown_signals(SIG_BLOCK);
+
+    // A client hanging up mid-response must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+
     // Initialize the server
     PORT = port;
     // Use snprintf which guarantees null termination
     snprintf(DIRECTORY, MAX_DIR_PATH_SIZE, "%s", directory);
+    // Files are opened relative to a descriptor for the root, never by full path
+    if (cserve_fs_init(DIRECTORY) == FAILURE) {
+        printf("Error: Failed to open root directory: %s\n", DIRECTORY);
+        return FAILURE;
+    }
+    // Size the cache for the container, the arena has room for the largest budget
+    size_t cache_budget = cserve_memory_max_budget();
+    if (cserve_arena_init(cache_budget + cache_budget / 4 + ARENA_INDEX_RESERVE) == FAILURE) {
+        printf("Error: Failed to initialize cache arena\n");
+        return FAILURE;
+    }
+    if (cserve_cache_init(cache_budget) == FAILURE) {
+        printf("Error: Failed to initialize file cache\n");
+        return FAILURE;
+    }
+    if (cserve_memory_init() == FAILURE) {
+        printf("Error: Failed to initialize memory pressure monitor\n");
+        return FAILURE;
+    }
+    if (cserve_topk_init() == FAILURE) {
+        printf("Error: Failed to initialize heavy-hitter tracking\n");
+        return FAILURE;
+    }
+    if (cserve_bloom_init(DIRECTORY) == FAILURE) {
+        printf("Error: Failed to initialize site index\n");
+        return FAILURE;
+    }
+    if (cserve_policy_init() == FAILURE) {
+        printf("Error: Failed to initialize caching policy\n");
+        return FAILURE;
+    }
+    if (cserve_meta_init() == FAILURE) {
+        printf("Error: Failed to initialize file metadata cache\n");
+        return FAILURE;
+    }
+    if (cserve_prefetch_init() == FAILURE) {
+        printf("Error: Failed to initialize prefetch\n");
+        return FAILURE;
+    }
+    if (cserve_prewarm_init(state_file) == FAILURE) {
+        printf("Error: Failed to initialize cache pre-warming\n");
+        return FAILURE;
+    }
+    if (cserve_mem_init() == FAILURE) {
+        printf("Error: Failed to initialize allocator\n");
+        return FAILURE;
+    }
+    if (cserve_alloc_init() == FAILURE) {
+        printf("Error: Failed to initialize allocation accounting\n");
+        return FAILURE;
+    }
+    if (cserve_fcgi_init(DIRECTORY, fastcgi_command) == FAILURE) {
+        printf("Error: Failed to initialize FastCGI workers\n");
+        return FAILURE;
+    }
+    if (cserve_prof_init() == FAILURE) {
+        printf("Error: Failed to initialize profiler\n");
+        return FAILURE;
+    }
+    if (cserve_access_init(access_log) == FAILURE) {
+        printf("Error: Failed to open access log: %s\n", access_log);
+        return FAILURE;
+    }
     return SUCCESS;
 }
 
@@ -47,11 +222,26 @@ int cserve_init(int port, const char *directory) {
  * @return cserver_http_res_t* The response
  */
 cserver_http_res_t *cserve_handle_request(cserver_http_req_t *req) {
+    // Admin endpoints are matched before the method, they are not files
+    if (cserve_admin_is_admin_path(req->path)) {
+        return cserve_admin_handler(req);
+    }
+
+    // Bundles take GET and POST, they are not files either
+    if (cserve_bundle_is_bundle_path(req->path)) {
+        return cserve_bundle_handler(req);
+    }
+
+    // Scripts take GET and POST and are run by the FastCGI workers
+    if (cserve_fcgi_is_script(req->path)) {
+        return cserve_fcgi_handler(req);
+    }
+
     // Handle the request
     cserver_http_method_t method = method_str_to_enum(req->method);
     switch (method) {
     case HTTP_METHOD_GET:
-        return cserve_get_handler(req, DIRECTORY);
+        return cserve_get_handler(req);
     default:
         return create_http_response(HTTP_STATUS_METHOD_NOT_ALLOWED, "text/plain",
                                     "Method Not Allowed");
@@ -150,8 +340,17 @@ int cserve_start() {
     printf("Server listening on port %d...\n", PORT);
     printf("Visit http://localhost:%d in your browser\n", PORT);
 
-    // STEP 6: Main server loop - handle client connections forever
-    while (1) {
+    // No SA_RESTART, so a shutdown signal interrupts the blocking accept()
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_shutdown_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    mask_shutdown_signals(SIG_UNBLOCK);
+
+    // STEP 6: Main server loop - handle client connections until asked to shut down
+    while (!shutdown_requested) {
         printf("Waiting for connections...\n");
 
         // accept() waits for and accepts an incoming connection
@@ -162,37 +361,60 @@ int cserve_start() {
         // (socklen_t*)&addrlen = size of address structure (input/output parameter)
         if ((new_socket = accept(server_fd, (struct sockaddr *)&address, (socklen_t *)&addrlen)) <
             0) {
-            perror("accept");
+            if (errno != EINTR) {
+                perror("accept");
+            }
             continue; // If accept fails, try again with the next connection
         }
 
+        cserve_alloc_request_begin();
+        struct timespec accepted;
+        clock_gettime(CLOCK_MONOTONIC, &accepted);
+
         // STEP 7: Read the HTTP request from the client
         // read() reads data from the socket into our buffer
         // We don't actually parse the HTTP request in this simple server
         // But we need to read it to clear the socket buffer
-        int rv = read(new_socket, buffer, MAX_BUFFER_SIZE);
+        ssize_t rv = read_request(new_socket, buffer, MAX_BUFFER_SIZE);
         if (rv < 0) {
             perror("Socket buffer read failed");
             close(new_socket);
+            cserve_alloc_request_end();
             continue;
         }
         printf("Request received\n");
 
-        cserver_http_req_t *req = parse_http_request(buffer);
+        cserver_http_req_t *req = parse_http_request(buffer, (size_t)rv);
         if (req == NULL) {
             printf("Error: Failed to parse request\n");
             close(new_socket);
+            cserve_alloc_request_end();
             continue;
         }
+        inet_ntop(AF_INET, &address.sin_addr, req->client_addr, sizeof(req->client_addr));
+        req->client_fd = new_socket;
+        // Tracking and cache-busting parameters must not reach anything keyed on the query
+        cserve_query_normalize(req);
+        cserve_metrics_inc(METRIC_REQUESTS_TOTAL);
+        cserve_topk_add(TOPK_PATHS, req->path);
+        cserve_topk_add(TOPK_CLIENTS, req->client_addr);
+        cserve_topk_add(TOPK_USER_AGENTS, req->user_agent);
         print_http_request(req);
 
+        cserve_alloc_set_stage(ALLOC_STAGE_HANDLE);
         cserver_http_res_t *res = cserve_handle_request(req);
         if (res == NULL) {
             printf("Error: Failed to handle request\n");
             close(new_socket);
+            cserve_mem_free(req);
+            cserve_alloc_request_end();
             continue;
         }
 
+        // Chunked framing needs HTTP/1.1, older clients read until the connection closes
+        res->chunked = res->content_length == HTTP_CONTENT_LENGTH_UNKNOWN &&
+                       strcmp(req->version, "HTTP/1.1") == 0;
+        cserve_alloc_set_stage(ALLOC_STAGE_SERIALIZE);
         http_response = http_response_to_string(res);
         printf("Response created\n");
 
@@ -200,28 +422,38 @@ int cserve_start() {
             printf("Error: Failed to convert response to string\n");
             close(new_socket);
             free_http_response(res);
-            free(req);
+            cserve_mem_free(req);
+            cserve_alloc_request_end();
             continue;
         }
 
         // STEP 8: Send our HTTP response back to the client
-        // send() writes data to the socket
-        // strlen(http_response) = number of bytes to send
-        // 0 = flags (no special options)
-        send(new_socket, http_response, strlen(http_response), 0);
-        free(http_response);
+        // The headers are followed by the body straight from its buffers, nothing is copied
+        cserve_alloc_set_stage(ALLOC_STAGE_SEND);
+        cserve_stream_response(new_socket, http_response, strlen(http_response), res);
+        // The socket stays open until now so its TCP_INFO covers the whole response
+        struct timespec sent;
+        clock_gettime(CLOCK_MONOTONIC, &sent);
+        cserve_access_record(new_socket, req, res,
+                             (sent.tv_sec - accepted.tv_sec) * 1000.0 +
+                                 (sent.tv_nsec - accepted.tv_nsec) / 1e6);
+        cserve_mem_free(http_response);
         free_http_response(res);
-        free(req);
+        cserve_mem_free(req);
 
         // STEP 9: Close the connection with this client
         // close() closes the socket file descriptor
         // This ends the connection with this specific client
         // The server continues running and can accept new connections
         close(new_socket);
+        cserve_alloc_request_end();
     }
 
-    // This code will never be reached because we have an infinite loop above
-    // But it's good practice to clean up resources
+    // Persist what was hot so the next start can pre-warm the cache
+    printf("Shutting down\n");
+    cserve_prewarm_save();
+    cserve_fcgi_shutdown();
+    cserve_prof_stop();
     close(server_fd);
     return SUCCESS;
 }
\ No newline at end of file
@@ -0,0 +1,195 @@
+/**
+ * @file cserve_access.c
+ * @brief Access log and per-connection TCP statistics
+ */
+
+// Define feature macros before including headers
+// These enable gmtime_r and flockfile
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_access.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <linux/tcp.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+
+// defines
+#define HISTOGRAM_MAX_BUCKETS 12
+
+// Whether the kernel filled in a tcp_info field, older kernels return a shorter struct
+#define TCP_INFO_HAS(len, field)                                                                  \
+    ((len) >= offsetof(struct tcp_info, field) + sizeof(((struct tcp_info *)0)->field))
+
+/**
+ * @brief A histogram in the metrics output
+ */
+typedef struct {
+    const char *name;
+    const double *bounds; // upper bounds of the buckets, ascending, +Inf is implied
+    size_t num_bounds;
+    unsigned long buckets[HISTOGRAM_MAX_BUCKETS + 1];
+    double sum;
+    unsigned long count;
+} histogram_t;
+
+// Bucket bounds
+static const double server_ms_bounds[] = {0.1, 0.5, 1, 5, 10, 50, 100, 500, 1000, 5000};
+static const double rtt_us_bounds[] = {100, 500, 1000, 5000, 10000, 25000,
+                                       50000, 100000, 250000, 500000, 1000000};
+static const double retrans_bounds[] = {0, 1, 2, 5, 10, 50};
+static const double cwnd_bounds[] = {2, 5, 10, 20, 50, 100, 200, 500, 1000};
+static const double delivery_rate_bounds[] = {1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10};
+
+#define BOUNDS(b) b, sizeof(b) / sizeof(b[0])
+
+// Histograms, updated under the lock
+static histogram_t server_ms_hist = {"cserv_request_server_ms", BOUNDS(server_ms_bounds),
+                                     {0}, 0, 0};
+static histogram_t rtt_hist = {"cserv_tcp_rtt_us", BOUNDS(rtt_us_bounds), {0}, 0, 0};
+static histogram_t rttvar_hist = {"cserv_tcp_rttvar_us", BOUNDS(rtt_us_bounds), {0}, 0, 0};
+static histogram_t retrans_hist = {"cserv_tcp_retransmits", BOUNDS(retrans_bounds), {0}, 0, 0};
+static histogram_t cwnd_hist = {"cserv_tcp_cwnd_segments", BOUNDS(cwnd_bounds), {0}, 0, 0};
+static histogram_t delivery_rate_hist = {"cserv_tcp_delivery_rate_bytes",
+                                         BOUNDS(delivery_rate_bounds), {0}, 0, 0};
+static histogram_t *histograms[] = {&server_ms_hist, &rtt_hist,  &rttvar_hist,
+                                    &retrans_hist,   &cwnd_hist, &delivery_rate_hist};
+
+// globals
+static pthread_mutex_t access_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *access_log;
+static unsigned long connections;
+static unsigned long busy_us;
+static unsigned long rwnd_limited_us;
+static unsigned long sndbuf_limited_us;
+
+/**
+ * @brief Add an observation to a histogram, called with the lock held
+ */
+static void observe(histogram_t *h, double value) {
+    size_t i = 0;
+    while (i < h->num_bounds && value > h->bounds[i]) {
+        i++;
+    }
+    h->buckets[i]++;
+    h->sum += value;
+    h->count++;
+}
+
+/**
+ * @brief Render the histograms
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    pthread_mutex_lock(&access_lock);
+    for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); i++) {
+        const histogram_t *h = histograms[i];
+        // Buckets are cumulative in the output
+        unsigned long cumulative = 0;
+        for (size_t b = 0; b < h->num_bounds; b++) {
+            cumulative += h->buckets[b];
+            cserve_metrics_appendf(buf, "%s_bucket{le=\"%g\"} %lu\n", h->name, h->bounds[b],
+                                   cumulative);
+        }
+        cserve_metrics_appendf(buf, "%s_bucket{le=\"+Inf\"} %lu\n", h->name, h->count);
+        cserve_metrics_appendf(buf, "%s_sum %g\n", h->name, h->sum);
+        cserve_metrics_appendf(buf, "%s_count %lu\n", h->name, h->count);
+    }
+    cserve_metrics_appendf(buf, "cserv_tcp_busy_us_total %lu\n", busy_us);
+    cserve_metrics_appendf(buf, "cserv_tcp_rwnd_limited_us_total %lu\n", rwnd_limited_us);
+    cserve_metrics_appendf(buf, "cserv_tcp_sndbuf_limited_us_total %lu\n", sndbuf_limited_us);
+    pthread_mutex_unlock(&access_lock);
+}
+
+/**
+ * @brief Open the access log and register the histograms
+ */
+int cserve_access_init(const char *log_file) {
+    if (log_file[0] != '\0') {
+        access_log = fopen(log_file, "a");
+        if (access_log == NULL) {
+            perror("Access log");
+            return FAILURE;
+        }
+        // One write per line, so lines from a crashed server are not lost
+        setvbuf(access_log, NULL, _IOLBF, 0);
+    }
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Record a finished request
+ */
+void cserve_access_record(int sock, const cserver_http_req_t *req, const cserver_http_res_t *res,
+                          double server_ms) {
+    pthread_mutex_lock(&access_lock);
+    observe(&server_ms_hist, server_ms);
+    int sampled = connections++ % TCP_INFO_SAMPLE_EVERY == 0;
+    pthread_mutex_unlock(&access_lock);
+
+    // Read after the last send, so the tail of a large response may still be in flight
+    struct tcp_info info;
+    memset(&info, 0, sizeof(info));
+    socklen_t len = sizeof(info);
+    if (sampled && getsockopt(sock, IPPROTO_TCP, TCP_INFO, &info, &len) != 0) {
+        sampled = 0;
+    }
+    // Fields past what the kernel returned are left out rather than reported as 0
+    int has_rate = sampled && TCP_INFO_HAS(len, tcpi_delivery_rate);
+    int has_limited = sampled && TCP_INFO_HAS(len, tcpi_sndbuf_limited);
+    sampled = sampled && TCP_INFO_HAS(len, tcpi_total_retrans);
+    if (sampled) {
+        pthread_mutex_lock(&access_lock);
+        observe(&rtt_hist, info.tcpi_rtt);
+        observe(&rttvar_hist, info.tcpi_rttvar);
+        observe(&retrans_hist, info.tcpi_total_retrans);
+        observe(&cwnd_hist, info.tcpi_snd_cwnd);
+        if (has_rate) {
+            observe(&delivery_rate_hist, (double)info.tcpi_delivery_rate);
+        }
+        if (has_limited) {
+            busy_us += (unsigned long)info.tcpi_busy_time;
+            rwnd_limited_us += (unsigned long)info.tcpi_rwnd_limited;
+            sndbuf_limited_us += (unsigned long)info.tcpi_sndbuf_limited;
+        }
+        pthread_mutex_unlock(&access_lock);
+    }
+
+    if (access_log == NULL) {
+        return;
+    }
+    char when[32];
+    time_t now = time(NULL);
+    struct tm tm;
+    gmtime_r(&now, &tm);
+    strftime(when, sizeof(when), "%d/%b/%Y:%H:%M:%S +0000", &tm);
+    char bytes[32] = "-";
+    if (res->content_length != HTTP_CONTENT_LENGTH_UNKNOWN) {
+        snprintf(bytes, sizeof(bytes), "%zu", res->content_length);
+    }
+
+    // Common log format with the request line as the client sent it, then the timing and TCP fields
+    flockfile(access_log);
+    fprintf(access_log, "%s - - [%s] \"%s %s %s\" %d %s server_ms=%.3f", req->client_addr, when,
+            req->method, req->target, req->version, res->status_code, bytes, server_ms);
+    if (sampled) {
+        fprintf(access_log, " rtt_us=%u rttvar_us=%u retrans=%u cwnd=%u unacked=%u", info.tcpi_rtt,
+                info.tcpi_rttvar, info.tcpi_total_retrans, info.tcpi_snd_cwnd, info.tcpi_unacked);
+    }
+    if (has_rate) {
+        fprintf(access_log, " delivery_rate=%llu", (unsigned long long)info.tcpi_delivery_rate);
+    }
+    if (has_limited) {
+        fprintf(access_log, " busy_us=%llu rwnd_limited_us=%llu sndbuf_limited_us=%llu",
+                (unsigned long long)info.tcpi_busy_time,
+                (unsigned long long)info.tcpi_rwnd_limited,
+                (unsigned long long)info.tcpi_sndbuf_limited);
+    }
+    fputc('\n', access_log);
+    funlockfile(access_log);
+}
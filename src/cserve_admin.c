@@ -0,0 +1,139 @@
+/**
+ * @file cserve_admin.c
+ * @brief Admin endpoints
+ *
+ * Endpoints are listed in a table of path suffixes under ADMIN_PATH_PREFIX,
+ * add new ones there.
+ */
+
+#include "cserve_admin.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "cserve_prof.h"
+#include "cserve_topk.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Admin endpoint handler
+ *
+ * @param req The request to handle
+ * @return cserver_http_res_t* The response
+ */
+typedef cserver_http_res_t *(*admin_handler_t)(cserver_http_req_t *req);
+
+/**
+ * @brief Serve the metrics text
+ */
+static cserver_http_res_t *metrics_handler(cserver_http_req_t *req) {
+    (void)req;
+    char *text = cserve_metrics_render();
+    if (text == NULL) {
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    cserver_http_res_t *response = create_http_response(HTTP_STATUS_OK, "text/plain", text);
+    free(text);
+    return response;
+}
+
+/**
+ * @brief Serve the heavy-hitter report
+ */
+static cserver_http_res_t *top_handler(cserver_http_req_t *req) {
+    (void)req;
+    char *text = cserve_topk_report();
+    if (text == NULL) {
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    cserver_http_res_t *response = create_http_response(HTTP_STATUS_OK, "text/plain", text);
+    free(text);
+    return response;
+}
+
+/**
+ * @brief Serve the profiler's stacks in folded format
+ */
+static cserver_http_res_t *profile_handler(cserver_http_req_t *req) {
+    (void)req;
+    char *text = cserve_prof_report();
+    if (text == NULL) {
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    cserver_http_res_t *response = create_http_response(HTTP_STATUS_OK, "text/plain", text);
+    free(text);
+    return response;
+}
+
+/**
+ * @brief Start the profiler
+ */
+static cserver_http_res_t *profile_start_handler(cserver_http_req_t *req) {
+    (void)req;
+    if (cserve_prof_start() == FAILURE) {
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Profiler already running or failed to start");
+    }
+    return create_http_response(HTTP_STATUS_OK, "text/plain", "Profiler started");
+}
+
+/**
+ * @brief Stop the profiler
+ */
+static cserver_http_res_t *profile_stop_handler(cserver_http_req_t *req) {
+    (void)req;
+    cserve_prof_stop();
+    return create_http_response(HTTP_STATUS_OK, "text/plain", "Profiler stopped");
+}
+
+// Admin endpoints, path relative to ADMIN_PATH_PREFIX
+static const struct {
+    const char *name;
+    admin_handler_t handler;
+} admin_endpoints[] = {
+    {"metrics", metrics_handler},
+    {"top", top_handler},
+    {"profile", profile_handler},
+    {"profile/start", profile_start_handler},
+    {"profile/stop", profile_stop_handler},
+};
+
+/**
+ * @brief Check whether the client connected over loopback
+ *
+ * @param client_addr Textual client address
+ * @return 1 for loopback clients, 0 otherwise
+ */
+static int is_loopback(const char *client_addr) {
+    return strncmp(client_addr, "127.", 4) == 0 || strcmp(client_addr, "::1") == 0;
+}
+
+/**
+ * @brief Check whether a request targets an admin endpoint
+ */
+int cserve_admin_is_admin_path(const char *path) {
+    return strncmp(path, ADMIN_PATH_PREFIX, strlen(ADMIN_PATH_PREFIX)) == 0;
+}
+
+/**
+ * @brief Handle a request for an admin endpoint
+ */
+cserver_http_res_t *cserve_admin_handler(cserver_http_req_t *req) {
+    if (!is_loopback(req->client_addr)) {
+        printf("Error: Admin request from non-loopback client %s\n", req->client_addr);
+        return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
+    }
+
+    const char *name = req->path + strlen(ADMIN_PATH_PREFIX);
+    int num_endpoints = sizeof(admin_endpoints) / sizeof(admin_endpoints[0]);
+    for (int i = 0; i < num_endpoints; i++) {
+        if (strcmp(name, admin_endpoints[i].name) == 0) {
+            return admin_endpoints[i].handler(req);
+        }
+    }
+    return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
+}
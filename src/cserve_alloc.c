@@ -0,0 +1,176 @@
+/**
+ * @file cserve_alloc.c
+ * @brief Allocation accounting
+ */
+
+// Define feature macros before including headers
+// These enable malloc_usable_size
+#define _GNU_SOURCE
+
+#include "cserve_alloc.h"
+#include "error.h"
+
+#ifdef CSERV_ALLOC_STATS
+
+#include "cserve_metrics.h"
+#include <malloc.h>
+#include <string.h>
+
+// The real allocator, resolved by the linker (-Wl,--wrap=malloc etc.)
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+void __real_free(void *ptr);
+
+void *__wrap_malloc(size_t size);
+void *__wrap_calloc(size_t nmemb, size_t size);
+void *__wrap_realloc(void *ptr, size_t size);
+void __wrap_free(void *ptr);
+char *__wrap_strdup(const char *s);
+
+// Names of the stages in the metrics output
+static const char *stage_names[ALLOC_STAGE_COUNT] = {"other", "parse", "handle", "serialize",
+                                                     "send"};
+
+// globals
+static unsigned long calls[ALLOC_STAGE_COUNT];
+static unsigned long bytes[ALLOC_STAGE_COUNT];
+static unsigned long frees[ALLOC_STAGE_COUNT];
+static long live_bytes;
+static unsigned long requests_allocating;
+static unsigned long last_request_calls;
+
+// Stage and allocation count of the request the thread is working on
+static __thread cserver_alloc_stage_t current_stage;
+static __thread unsigned long request_calls;
+
+/**
+ * @brief Charge an allocation to the calling thread's stage
+ */
+static void count_alloc(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    size_t size = malloc_usable_size(ptr);
+    __atomic_add_fetch(&calls[current_stage], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&bytes[current_stage], size, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&live_bytes, (long)size, __ATOMIC_RELAXED);
+    request_calls++;
+}
+
+/**
+ * @brief Charge a free to the calling thread's stage
+ */
+static void count_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    __atomic_add_fetch(&frees[current_stage], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&live_bytes, (long)malloc_usable_size(ptr), __ATOMIC_RELAXED);
+}
+
+void *__wrap_malloc(size_t size) {
+    void *ptr = __real_malloc(size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    void *ptr = __real_calloc(nmemb, size);
+    count_alloc(ptr);
+    return ptr;
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    // Counted as a free of the old block and an allocation of the new one
+    size_t old_size = ptr != NULL ? malloc_usable_size(ptr) : 0;
+    void *new_ptr = __real_realloc(ptr, size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    if (ptr != NULL) {
+        __atomic_add_fetch(&frees[current_stage], 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&live_bytes, (long)old_size, __ATOMIC_RELAXED);
+    }
+    count_alloc(new_ptr);
+    return new_ptr;
+}
+
+void __wrap_free(void *ptr) {
+    count_free(ptr);
+    __real_free(ptr);
+}
+
+char *__wrap_strdup(const char *s) {
+    // libc's strdup allocates internally where the wrapper cannot see it
+    size_t len = strlen(s) + 1;
+    char *copy = __wrap_malloc(len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+/**
+ * @brief Render the allocation counters
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    for (int i = 0; i < ALLOC_STAGE_COUNT; i++) {
+        cserve_metrics_appendf(buf, "cserv_alloc_calls_total{stage=\"%s\"} %lu\n", stage_names[i],
+                               __atomic_load_n(&calls[i], __ATOMIC_RELAXED));
+        cserve_metrics_appendf(buf, "cserv_alloc_bytes_total{stage=\"%s\"} %lu\n", stage_names[i],
+                               __atomic_load_n(&bytes[i], __ATOMIC_RELAXED));
+        cserve_metrics_appendf(buf, "cserv_alloc_frees_total{stage=\"%s\"} %lu\n", stage_names[i],
+                               __atomic_load_n(&frees[i], __ATOMIC_RELAXED));
+    }
+    cserve_metrics_appendf(buf, "cserv_alloc_live_bytes %ld\n",
+                           __atomic_load_n(&live_bytes, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_alloc_requests_allocating_total %lu\n",
+                           __atomic_load_n(&requests_allocating, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_alloc_last_request_calls %lu\n",
+                           __atomic_load_n(&last_request_calls, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Start accounting a request
+ */
+void cserve_alloc_request_begin(void) {
+    request_calls = 0;
+    current_stage = ALLOC_STAGE_PARSE;
+}
+
+/**
+ * @brief Charge the calling thread's allocations to a stage from now on
+ */
+void cserve_alloc_set_stage(cserver_alloc_stage_t stage) {
+    current_stage = stage;
+}
+
+/**
+ * @brief Finish accounting a request
+ */
+void cserve_alloc_request_end(void) {
+    __atomic_store_n(&last_request_calls, request_calls, __ATOMIC_RELAXED);
+    if (request_calls > 0) {
+        __atomic_add_fetch(&requests_allocating, 1, __ATOMIC_RELAXED);
+    }
+    current_stage = ALLOC_STAGE_OTHER;
+}
+
+/**
+ * @brief Register the allocation counters with the metrics output
+ */
+int cserve_alloc_init(void) {
+    return cserve_metrics_register(render_metrics);
+}
+
+#else
+
+/**
+ * @brief Register the allocation counters with the metrics output
+ */
+int cserve_alloc_init(void) {
+    return SUCCESS;
+}
+
+#endif
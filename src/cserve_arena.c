@@ -0,0 +1,448 @@
+/**
+ * @file cserve_arena.c
+ * @brief Huge-page backed memory arena
+ *
+ * Memory is carved from the mapping with a bump pointer and recycled through
+ * per size class free lists. Requests are rounded up to size classes spaced
+ * four per power of two, so rounding wastes at most 25%. Each block starts
+ * with a small header that records its size.
+ *
+ * Freed blocks are merged with free neighbours (a free block keeps its size
+ * in its last word, and the block above it has ARENA_PREV_FREE set), and a
+ * free block reaching the bump pointer goes back to the unused area. A free
+ * block sits on the list of the largest class it can hold. An allocation
+ * takes the first block from its own class or any larger one, and splits off
+ * the rest. Mixed-size cache churn therefore does not leave the arena
+ * fragmented into blocks of the wrong class.
+ */
+
+// Define feature macros before including headers
+// These enable MAP_ANONYMOUS, MAP_HUGETLB and MADV_HUGEPAGE
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_arena.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// defines
+#define HUGE_PAGE_SIZE (2 * _MBYTE)
+#define ARENA_MIN_BLOCK 64
+#define ARENA_NUM_CLASSES 160
+#define ARENA_MAGIC 0xa4e4a4e4U    // block in use
+#define ARENA_FREE 0xf4eeb10cU     // block on a free list
+#define ARENA_RELEASED 0x4e1ea5edU // free block whose pages were given back
+#define ARENA_PREV_FREE ((size_t)1) // flag in the size of a block, the block below it is free
+#define ARENA_SIZE_MASK (~(size_t)15)
+#define SMAPS_LINE_SIZE 256
+
+/**
+ * @brief Header in front of every arena block, keeps blocks 16 byte aligned
+ */
+typedef struct arena_block {
+    size_t size;                   // block size, header included, low bits are flags
+    uint32_t magic;
+    uint32_t free_class;           // list the block is on, these three only while it is free
+    struct arena_block *next_free;
+    struct arena_block *prev_free;
+} arena_block_t;
+
+/**
+ * @brief How the arena is backed
+ */
+typedef enum {
+    ARENA_NONE,    // no arena, everything comes from malloc()
+    ARENA_PLAIN,   // regular pages, the kernel refused huge pages
+    ARENA_THP,     // transparent huge pages via madvise(MADV_HUGEPAGE)
+    ARENA_HUGETLB  // explicit huge pages via MAP_HUGETLB
+} arena_mode_t;
+
+// globals
+static pthread_mutex_t arena_lock = PTHREAD_MUTEX_INITIALIZER;
+static arena_mode_t mode = ARENA_NONE;
+static char *arena_base;
+static size_t arena_size;
+static size_t arena_top;  // bump pointer offset
+static size_t arena_used; // bytes in live blocks, headers included
+static unsigned long fallbacks;
+static unsigned long merges;
+static size_t released_bytes;
+static arena_block_t *free_lists[ARENA_NUM_CLASSES];
+
+// Mode names, indexed by arena_mode_t
+static const char *mode_names[] = {"none", "plain", "thp", "hugetlb"};
+
+/**
+ * @brief Map a block size (header included) to its size class
+ *
+ * @param size Block size in bytes
+ * @param class_size Set to the rounded up size of the class
+ * @return The class index
+ */
+static int size_to_class(size_t size, size_t *class_size) {
+    if (size <= ARENA_MIN_BLOCK) {
+        *class_size = ARENA_MIN_BLOCK;
+        return 0;
+    }
+    // size is in (2^p, 2^(p+1)], split that range in four steps
+    int p = 63 - __builtin_clzll((unsigned long long)(size - 1));
+    size_t step = (size_t)1 << (p - 2);
+    size_t k = (size + step - 1) / step;
+    *class_size = k * step;
+    return 1 + (p - 6) * 4 + (int)(k - 5);
+}
+
+/**
+ * @brief Check whether a pointer lies inside the arena
+ */
+static int in_arena(const void *ptr) {
+    return arena_base != NULL && (const char *)ptr >= arena_base &&
+           (const char *)ptr < arena_base + arena_size;
+}
+
+/**
+ * @brief Size of a block, without the flags
+ */
+static size_t block_size(const arena_block_t *block) {
+    return block->size & ARENA_SIZE_MASK;
+}
+
+/**
+ * @brief The block right above, or NULL if the block ends at the bump pointer
+ */
+static arena_block_t *next_block(const arena_block_t *block) {
+    char *next = (char *)block + block_size(block);
+    return next < arena_base + arena_top ? (arena_block_t *)next : NULL;
+}
+
+/**
+ * @brief Put a free block on its list and tell its neighbour, called with the lock held
+ */
+static void push_free(arena_block_t *block, uint32_t magic) {
+    size_t size = block_size(block);
+    size_t size_class;
+    int c = size_to_class(size, &size_class);
+    if (size_class > size) {
+        c--; // the largest class the block can hold
+    }
+    block->magic = magic;
+    block->free_class = (uint32_t)c;
+    block->prev_free = NULL;
+    block->next_free = free_lists[c];
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block;
+    }
+    free_lists[c] = block;
+
+    // The size at the end lets the block above find this one when it is freed
+    *(size_t *)((char *)block + size - sizeof(size_t)) = size;
+    arena_block_t *next = next_block(block);
+    if (next != NULL) {
+        next->size |= ARENA_PREV_FREE;
+    }
+}
+
+/**
+ * @brief Take a free block off its list, called with the lock held
+ */
+static void remove_free(arena_block_t *block) {
+    if (block->prev_free != NULL) {
+        block->prev_free->next_free = block->next_free;
+    } else {
+        free_lists[block->free_class] = block->next_free;
+    }
+    if (block->next_free != NULL) {
+        block->next_free->prev_free = block->prev_free;
+    }
+    arena_block_t *next = next_block(block);
+    if (next != NULL) {
+        next->size &= ~ARENA_PREV_FREE;
+    }
+}
+
+/**
+ * @brief Find a free block of at least a class size, splitting off the rest
+ *
+ * Called with the lock held.
+ *
+ * @return The block, or NULL if no list has one
+ */
+static arena_block_t *take_free(int size_class, size_t class_size) {
+    for (int c = size_class; c < ARENA_NUM_CLASSES; c++) {
+        arena_block_t *block = free_lists[c];
+        if (block == NULL) {
+            continue;
+        }
+        remove_free(block);
+        size_t size = block_size(block);
+        if (size - class_size >= ARENA_MIN_BLOCK) {
+            arena_block_t *rest = (arena_block_t *)((char *)block + class_size);
+            rest->size = size - class_size;
+            block->size = class_size | (block->size & ARENA_PREV_FREE);
+            push_free(rest, ARENA_FREE);
+        }
+        return block;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Map the arena, trying explicit huge pages first
+ *
+ * @param size Arena size, a multiple of HUGE_PAGE_SIZE
+ * @return SUCCESS if anything was mapped, FAILURE otherwise
+ */
+static int map_arena(size_t size) {
+#ifdef MAP_HUGETLB
+    // Only succeeds if the admin reserved enough pages in vm.nr_hugepages
+    void *ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB,
+                     -1, 0);
+    if (ptr != MAP_FAILED) {
+        arena_base = ptr;
+        arena_size = size;
+        mode = ARENA_HUGETLB;
+        return SUCCESS;
+    }
+#endif
+
+    // Over-map by one huge page so the arena can start on a huge page boundary
+    char *raw = mmap(NULL, size + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (raw == MAP_FAILED) {
+        perror("mmap");
+        return FAILURE;
+    }
+    char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+    if (aligned > raw) {
+        munmap(raw, aligned - raw);
+    }
+    size_t tail = (raw + size + HUGE_PAGE_SIZE) - (aligned + size);
+    if (tail > 0) {
+        munmap(aligned + size, tail);
+    }
+    arena_base = aligned;
+    arena_size = size;
+    mode = ARENA_PLAIN;
+
+#ifdef MADV_HUGEPAGE
+    if (madvise(arena_base, arena_size, MADV_HUGEPAGE) == 0) {
+        mode = ARENA_THP;
+    }
+#endif
+    return SUCCESS;
+}
+
+/**
+ * @brief Measure how much of the arena is resident and how much of that is huge pages
+ *
+ * Reads the arena's entry in /proc/self/smaps.
+ */
+static void measure_coverage(size_t *rss, size_t *huge) {
+    *rss = 0;
+    *huge = 0;
+    if (arena_base == NULL) {
+        return;
+    }
+
+    FILE *smaps = fopen("/proc/self/smaps", "r");
+    if (smaps == NULL) {
+        return;
+    }
+    char line[SMAPS_LINE_SIZE];
+    int in_mapping = 0;
+    while (fgets(line, sizeof(line), smaps) != NULL) {
+        unsigned long start, end;
+        size_t kb;
+        if (sscanf(line, "%lx-%lx ", &start, &end) == 2) {
+            in_mapping = (char *)start <= arena_base && arena_base < (char *)end;
+        } else if (in_mapping && sscanf(line, "Rss: %zu kB", &kb) == 1) {
+            *rss += kb * _KBYTE;
+        } else if (in_mapping && (sscanf(line, "AnonHugePages: %zu kB", &kb) == 1 ||
+                                  sscanf(line, "Private_Hugetlb: %zu kB", &kb) == 1)) {
+            *huge += kb * _KBYTE;
+        }
+    }
+    fclose(smaps);
+
+    // hugetlb pages are not counted in Rss
+    if (mode == ARENA_HUGETLB) {
+        *rss = *huge;
+    }
+}
+
+/**
+ * @brief Render the arena section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    size_t rss, huge;
+    measure_coverage(&rss, &huge);
+
+    pthread_mutex_lock(&arena_lock);
+    size_t used = arena_used;
+    size_t top = arena_top;
+    unsigned long malloc_fallbacks = fallbacks;
+    unsigned long merged = merges;
+    pthread_mutex_unlock(&arena_lock);
+
+    cserve_metrics_appendf(buf, "cserv_arena_mode{mode=\"%s\"} 1\n", mode_names[mode]);
+    cserve_metrics_appendf(buf, "cserv_arena_size_bytes %zu\n", arena_size);
+    cserve_metrics_appendf(buf, "cserv_arena_reserved_bytes %zu\n", top);
+    cserve_metrics_appendf(buf, "cserv_arena_used_bytes %zu\n", used);
+    cserve_metrics_appendf(buf, "cserv_arena_resident_bytes %zu\n", rss);
+    cserve_metrics_appendf(buf, "cserv_arena_hugepage_bytes %zu\n", huge);
+    cserve_metrics_appendf(buf, "cserv_arena_hugepage_coverage_percent %zu\n",
+                           rss > 0 ? huge * 100 / rss : 0);
+    cserve_metrics_appendf(buf, "cserv_arena_free_bytes %zu\n", top - used);
+    cserve_metrics_appendf(buf, "cserv_arena_merges_total %lu\n", merged);
+    cserve_metrics_appendf(buf, "cserv_arena_malloc_fallbacks_total %lu\n", malloc_fallbacks);
+    cserve_metrics_appendf(buf, "cserv_arena_released_bytes_total %zu\n",
+                           __atomic_load_n(&released_bytes, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Reserve the arena
+ */
+int cserve_arena_init(size_t size) {
+    size = (size + HUGE_PAGE_SIZE - 1) & ~(size_t)(HUGE_PAGE_SIZE - 1);
+    if (map_arena(size) == FAILURE) {
+        printf("Warning: Arena disabled, allocating from malloc\n");
+    } else {
+        printf("Arena: %zu MB, %s pages\n", size / _MBYTE, mode_names[mode]);
+    }
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Allocate memory from the arena, falling back to malloc()
+ */
+void *cserve_arena_alloc(size_t size) {
+    size_t class_size;
+    size_t needed = size + sizeof(arena_block_t);
+    if (needed < size) {
+        return NULL; // overflow
+    }
+    int size_class = size_to_class(needed, &class_size);
+
+    // Objects too large for the cache are transient, keep them out of the arena
+    if (arena_base != NULL && size <= MAX_CACHE_OBJECT_SIZE + 1) {
+        pthread_mutex_lock(&arena_lock);
+        arena_block_t *block = take_free(size_class, class_size);
+        if (block == NULL && arena_size - arena_top >= class_size) {
+            // The block below the bump pointer is never free, it would have been merged
+            block = (arena_block_t *)(arena_base + arena_top);
+            block->size = class_size;
+            arena_top += class_size;
+        }
+        if (block != NULL) {
+            arena_used += block_size(block);
+            block->magic = ARENA_MAGIC;
+            pthread_mutex_unlock(&arena_lock);
+            return block + 1;
+        }
+        fallbacks++;
+        pthread_mutex_unlock(&arena_lock);
+    }
+    return malloc(size);
+}
+
+/**
+ * @brief Allocate zeroed memory from the arena, falling back to calloc()
+ */
+void *cserve_arena_calloc(size_t count, size_t size) {
+    if (size != 0 && count > (size_t)-1 / size) {
+        return NULL; // overflow
+    }
+    void *ptr = cserve_arena_alloc(count * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Free memory from cserve_arena_alloc() or cserve_arena_calloc()
+ */
+void cserve_arena_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    if (!in_arena(ptr)) {
+        free(ptr);
+        return;
+    }
+
+    arena_block_t *block = (arena_block_t *)ptr - 1;
+    if (block->magic != ARENA_MAGIC) {
+        printf("Error: Invalid arena free of %p\n", ptr);
+        return;
+    }
+    pthread_mutex_lock(&arena_lock);
+    size_t size = block_size(block);
+    arena_used -= size;
+    block->magic = 0;
+
+    // Merge with free neighbours
+    arena_block_t *next = next_block(block);
+    if (next != NULL && (next->magic == ARENA_FREE || next->magic == ARENA_RELEASED)) {
+        remove_free(next);
+        size += block_size(next);
+        merges++;
+    }
+    if (block->size & ARENA_PREV_FREE) {
+        size_t prev_size = *((size_t *)block - 1);
+        arena_block_t *prev = (arena_block_t *)((char *)block - prev_size);
+        remove_free(prev);
+        size += prev_size;
+        block = prev;
+        merges++;
+    }
+    block->size = size; // the block below a free block is never free
+
+    if ((char *)block + size == arena_base + arena_top) {
+        // Back to the bump pointer area
+        arena_top -= size;
+    } else {
+        push_free(block, ARENA_FREE);
+    }
+    pthread_mutex_unlock(&arena_lock);
+}
+
+/**
+ * @brief Hand the pages of free arena blocks back to the kernel
+ *
+ * Only whole pages between the block header and the size at its end are
+ * released, so the free list links stay intact. A block is marked released
+ * only once that worked, a failed one is tried again next time.
+ */
+size_t cserve_arena_release_free(void) {
+    size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+    size_t total = 0;
+
+    pthread_mutex_lock(&arena_lock);
+    for (int i = 0; i < ARENA_NUM_CLASSES; i++) {
+        for (arena_block_t *block = free_lists[i]; block != NULL; block = block->next_free) {
+            if (block->magic == ARENA_RELEASED) {
+                continue;
+            }
+            uintptr_t start = ((uintptr_t)(block + 1) + page_size - 1) & ~(uintptr_t)(page_size - 1);
+            uintptr_t end = ((uintptr_t)block + block_size(block) - sizeof(size_t)) &
+                            ~(uintptr_t)(page_size - 1);
+            if (end > start && madvise((void *)start, end - start, MADV_DONTNEED) == 0) {
+                total += end - start;
+                block->magic = ARENA_RELEASED;
+            }
+        }
+    }
+    pthread_mutex_unlock(&arena_lock);
+
+    __atomic_add_fetch(&released_bytes, total, __ATOMIC_RELAXED);
+    return total;
+}
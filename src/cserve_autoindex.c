@@ -0,0 +1,256 @@
+/**
+ * @file cserve_autoindex.c
+ * @brief Cached directory listings
+ */
+
+// Define feature macros before including headers
+// These enable fdopendir, fstatat and d_type
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_autoindex.h"
+#include "cserve_arena.h"
+#include "cserve_cache.h"
+#include "cserve_fs.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+// defines
+#define LISTING_BUFFER_SIZE 4096
+
+/**
+ * @brief One directory entry shown in a listing
+ */
+typedef struct {
+    char name[256];
+    int is_dir;
+    size_t size;
+    time_t mtime;
+} listing_entry_t;
+
+/**
+ * @brief Check whether a directory entry should be listed
+ *
+ * Hidden entries are left out, and so are names the GET handler would
+ * reject anyway. What remains needs no HTML or URL escaping.
+ */
+static int is_listable(const char *name) {
+    if (name[0] == '.') {
+        return 0;
+    }
+    for (const char *p = name; *p; p++) {
+        if (*p == '_' || *p == '.' || *p == '-' || (*p >= 'a' && *p <= 'z') ||
+            (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9')) {
+            continue;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * @brief Sort directories first, then by name
+ */
+static int compare_entries(const void *a, const void *b) {
+    const listing_entry_t *ea = a;
+    const listing_entry_t *eb = b;
+    if (ea->is_dir != eb->is_dir) {
+        return eb->is_dir - ea->is_dir;
+    }
+    return strcmp(ea->name, eb->name);
+}
+
+/**
+ * @brief Read the listable entries of a directory
+ *
+ * @param path Request path of the directory
+ * @param entries Set to a malloc()ed array of entries
+ * @param count Set to the number of entries
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int read_entries(const char *path, listing_entry_t **entries, size_t *count) {
+    int fd = cserve_fs_open(path, O_RDONLY | O_DIRECTORY);
+    if (fd < 0) {
+        printf("Error: Failed to open directory: %s\n", path);
+        return FAILURE;
+    }
+    DIR *dir = fdopendir(fd);
+    if (dir == NULL) {
+        close(fd);
+        printf("Error: Failed to read directory: %s\n", path);
+        return FAILURE;
+    }
+
+    listing_entry_t *list = NULL;
+    size_t len = 0;
+    size_t cap = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (!is_listable(de->d_name) || strlen(de->d_name) >= sizeof(list->name)) {
+            continue;
+        }
+        // Symlinks are shown as themselves, following them could leave the root
+        struct stat st;
+        if (fstatat(dirfd(dir), de->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+            continue;
+        }
+        if (len == cap) {
+            size_t new_cap = cap == 0 ? 64 : cap * 2;
+            listing_entry_t *new_list = realloc(list, new_cap * sizeof(listing_entry_t));
+            if (new_list == NULL) {
+                free(list);
+                closedir(dir);
+                printf("Error: Memory allocation failed for directory listing\n");
+                return FAILURE;
+            }
+            list = new_list;
+            cap = new_cap;
+        }
+        snprintf(list[len].name, sizeof(list[len].name), "%s", de->d_name);
+        list[len].is_dir = S_ISDIR(st.st_mode);
+        list[len].size = (size_t)st.st_size;
+        list[len].mtime = st.st_mtime;
+        len++;
+    }
+    closedir(dir);
+
+    if (len > 0) {
+        qsort(list, len, sizeof(listing_entry_t), compare_entries);
+    }
+    *entries = list;
+    *count = len;
+    return SUCCESS;
+}
+
+/**
+ * @brief Render the listing page, used as the cache loader
+ *
+ * @param key The cache key, unused
+ * @param ctx The request path of the directory
+ * @param data Set to a cserve_arena_alloc()ed, NUL terminated buffer holding the page
+ * @param size Set to the page size in bytes
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int render_listing(const char *key, void *ctx, char **data, size_t *size) {
+    (void)key;
+    const char *path = ctx;
+
+    listing_entry_t *entries;
+    size_t count;
+    if (read_entries(path, &entries, &count) != SUCCESS) {
+        return FAILURE;
+    }
+
+    cserver_metrics_buf_t buf;
+    buf.len = 0;
+    buf.cap = LISTING_BUFFER_SIZE;
+    buf.data = malloc(buf.cap);
+    if (buf.data == NULL) {
+        free(entries);
+        printf("Error: Memory allocation failed for directory listing\n");
+        return FAILURE;
+    }
+    buf.data[0] = '\0';
+
+    // The path went through validate_path(), it needs no escaping either
+    cserve_metrics_appendf(&buf,
+                           "<!DOCTYPE html>\n<html>\n<head><title>Index of %s</title></head>\n"
+                           "<body>\n<h1>Index of %s</h1>\n<pre>\n",
+                           path, path);
+    if (strcmp(path, "/") != 0) {
+        cserve_metrics_appendf(&buf, "<a href=\"../\">../</a>\n");
+    }
+    for (size_t i = 0; i < count; i++) {
+        char modified[32];
+        struct tm tm;
+        gmtime_r(&entries[i].mtime, &tm);
+        strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm);
+        const char *slash = entries[i].is_dir ? "/" : "";
+        int pad = 50 - (int)strlen(entries[i].name) - (int)strlen(slash);
+        if (entries[i].is_dir) {
+            cserve_metrics_appendf(&buf, "<a href=\"%s/\">%s/</a>%*s %s %12s\n", entries[i].name,
+                                   entries[i].name, pad > 0 ? pad : 1, "", modified, "-");
+        } else {
+            cserve_metrics_appendf(&buf, "<a href=\"%s\">%s</a>%*s %s %12zu\n", entries[i].name,
+                                   entries[i].name, pad > 0 ? pad : 1, "", modified,
+                                   entries[i].size);
+        }
+    }
+    cserve_metrics_appendf(&buf, "</pre>\n</body>\n</html>\n");
+    free(entries);
+
+    char *page = cserve_arena_alloc(buf.len + 1);
+    if (page == NULL) {
+        free(buf.data);
+        printf("Error: Memory allocation failed for directory listing\n");
+        return FAILURE;
+    }
+    memcpy(page, buf.data, buf.len + 1);
+    free(buf.data);
+
+    *data = page;
+    *size = buf.len;
+    return SUCCESS;
+}
+
+/**
+ * @brief Drop the cache reference held by a listing buffer
+ */
+static void release_cache_entry(void *ctx) {
+    cserve_cache_release(ctx);
+}
+
+/**
+ * @brief Free an uncached listing held by a listing buffer
+ */
+static void release_loaded(void *ctx) {
+    cserve_arena_free(ctx);
+}
+
+/**
+ * @brief Create a response listing a directory
+ */
+cserver_http_res_t *cserve_autoindex_response(const char *path, const struct stat *st) {
+    // A directory changed a moment ago is not cached yet, the listing is rendered directly
+    cserver_cache_result_t result;
+    cserver_cache_entry_t *entry = cserve_cache_acquire(path, &st->st_mtim, CACHE_SIZE_UNKNOWN,
+                                                        render_listing, (void *)path, &result);
+    if (entry == NULL && result != CACHE_RESULT_FALLBACK) {
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    cserver_buf_t *buf;
+    if (entry != NULL) {
+        buf = cserve_buf_wrap(entry->data, entry->size, release_cache_entry, entry);
+    } else {
+        char *loaded;
+        size_t size;
+        if (render_listing(path, (void *)path, &loaded, &size) != SUCCESS) {
+            return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                        "Internal Server Error");
+        }
+        buf = cserve_buf_wrap(loaded, size, release_loaded, loaded);
+    }
+
+    // The response shares the cached listing, it is not copied
+    cserver_http_res_t *response = NULL;
+    if (buf != NULL) {
+        response = create_http_response(HTTP_STATUS_OK, "text/html", NULL);
+    }
+    if (response == NULL || http_response_append(response, buf, 0, buf->size) != SUCCESS) {
+        free_http_response(response);
+        cserve_buf_unref(buf);
+        printf("Error: Failed to create HTTP response\n");
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    cserve_buf_unref(buf);
+    return response;
+}
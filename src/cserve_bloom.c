@@ -0,0 +1,386 @@
+/**
+ * @file cserve_bloom.c
+ * @brief Site index Bloom filter for rejecting nonexistent paths
+ *
+ * The index is built by walking the served directory with nftw(). Every
+ * directory gets an inotify watch; a background thread blocks on the
+ * inotify descriptor and rebuilds the filter after a change. While a
+ * rebuild is pending the filter is marked dirty and lookups bypass it.
+ *
+ * The watcher marks the filter dirty before it reads the events, and a
+ * negative lookup looks at the inotify queue before it trusts the
+ * filter. Events are queued by the syscall that creates the file, so a
+ * path that exists is never reported missing. The watcher not having
+ * woken up yet does not change that.
+ */
+
+// Define feature macros before including headers
+// These enable nftw, inotify and poll
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_bloom.h"
+#include "config.h"
+#include "cserve_arena.h"
+#include "cserve_metrics.h"
+#include "cserve_prof.h"
+#include "error.h"
+#include <errno.h>
+#include <ftw.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+// defines
+#define BLOOM_HASHES 7
+#define BLOOM_BITS_PER_PATH 10 // ~1% false positive rate with 7 hashes
+#define BLOOM_MIN_BITS 1024
+#define BLOOM_WATCH_MASK                                                                           \
+    (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF |        \
+     IN_ONLYDIR)
+#define BLOOM_EVENT_BUFFER_SIZE (4 * _KBYTE)
+#define BLOOM_NFTW_FDS 16
+
+/**
+ * @brief A built filter, immutable once published
+ */
+typedef struct {
+    uint64_t *bits;
+    uint64_t num_bits;
+    size_t num_paths;
+} bloom_filter_t;
+
+/**
+ * @brief Pair of hashes of one path, used for double hashing
+ */
+typedef struct {
+    uint64_t h1;
+    uint64_t h2;
+} path_hash_t;
+
+// globals
+static char root[MAX_DIR_PATH_SIZE];
+static size_t root_len;
+static int inotify_fd = -1;
+static int enabled;
+static int dirty;
+static unsigned long rebuilds;
+static unsigned long generation; // bumped whenever the watcher sees a change
+static pthread_rwlock_t filter_lock = PTHREAD_RWLOCK_INITIALIZER;
+static bloom_filter_t *filter;
+
+// Walk state, only touched by whoever is rebuilding (init or the watcher thread)
+static path_hash_t *walk_hashes;
+static size_t walk_count;
+static size_t walk_cap;
+static int walk_failed;
+
+/**
+ * @brief Hash a request path into two independent 64 bit hashes
+ *
+ * Repeated and trailing slashes are skipped so "/docs/", "/docs" and
+ * "//docs" all hash the same way, matching how the filesystem resolves them.
+ */
+static path_hash_t hash_path(const char *path) {
+    path_hash_t hash = {14695981039346656037ULL, 5381};
+    char prev = '\0';
+    for (const char *p = path; *p; p++) {
+        if (*p == '/' && (prev == '/' || p[1] == '\0')) {
+            continue;
+        }
+        prev = *p;
+        hash.h1 ^= (unsigned char)*p;
+        hash.h1 *= 1099511628211ULL;
+        hash.h2 = hash.h2 * 33 + (unsigned char)*p;
+    }
+    // Finalize h2 so it is not correlated with h1
+    hash.h2 ^= hash.h2 >> 33;
+    hash.h2 *= 0xff51afd7ed558ccdULL;
+    hash.h2 ^= hash.h2 >> 33;
+    hash.h2 |= 1; // must be odd so the probe sequence covers the table
+    return hash;
+}
+
+/**
+ * @brief nftw() callback, records one path and watches directories
+ */
+static int walk_entry(const char *fpath, const struct stat *sb, int typeflag, struct FTW *ftwbuf) {
+    (void)sb;
+    (void)ftwbuf;
+
+    if (typeflag == FTW_D && inotify_fd >= 0) {
+        if (inotify_add_watch(inotify_fd, fpath, BLOOM_WATCH_MASK) < 0) {
+            perror("inotify_add_watch");
+            walk_failed = 1;
+            return FTW_STOP;
+        }
+    }
+
+    if (walk_count == walk_cap) {
+        size_t new_cap = walk_cap == 0 ? 1024 : walk_cap * 2;
+        path_hash_t *new_hashes = realloc(walk_hashes, new_cap * sizeof(path_hash_t));
+        if (new_hashes == NULL) {
+            printf("Error: Memory allocation failed for site index\n");
+            walk_failed = 1;
+            return FTW_STOP;
+        }
+        walk_hashes = new_hashes;
+        walk_cap = new_cap;
+    }
+
+    // Store the path relative to the root, the root itself becomes "/"
+    const char *rel = fpath + root_len;
+    walk_hashes[walk_count++] = hash_path(*rel == '\0' ? "/" : rel);
+    return FTW_CONTINUE;
+}
+
+/**
+ * @brief Walk the directory and build a new filter
+ *
+ * @return The new filter, or NULL if the walk failed
+ */
+static bloom_filter_t *build_filter(void) {
+    walk_count = 0;
+    walk_failed = 0;
+    if (nftw(root_len == 0 ? "/" : root, walk_entry, BLOOM_NFTW_FDS, FTW_ACTIONRETVAL) != 0 ||
+        walk_failed) {
+        printf("Error: Failed to index directory: %s\n", root);
+        return NULL;
+    }
+
+    bloom_filter_t *new_filter = malloc(sizeof(bloom_filter_t));
+    if (new_filter == NULL) {
+        printf("Error: Memory allocation failed for site index\n");
+        return NULL;
+    }
+    uint64_t num_bits = (uint64_t)walk_count * BLOOM_BITS_PER_PATH;
+    if (num_bits < BLOOM_MIN_BITS) {
+        num_bits = BLOOM_MIN_BITS;
+    }
+    num_bits = (num_bits + 63) & ~(uint64_t)63;
+    new_filter->bits = cserve_arena_calloc(num_bits / 64, sizeof(uint64_t));
+    if (new_filter->bits == NULL) {
+        free(new_filter);
+        printf("Error: Memory allocation failed for site index\n");
+        return NULL;
+    }
+    new_filter->num_bits = num_bits;
+    new_filter->num_paths = walk_count;
+
+    for (size_t i = 0; i < walk_count; i++) {
+        for (int k = 0; k < BLOOM_HASHES; k++) {
+            uint64_t bit = (walk_hashes[i].h1 + k * walk_hashes[i].h2) % num_bits;
+            new_filter->bits[bit / 64] |= (uint64_t)1 << (bit % 64);
+        }
+    }
+    return new_filter;
+}
+
+/**
+ * @brief Free a filter
+ */
+static void free_filter(bloom_filter_t *old) {
+    if (old != NULL) {
+        cserve_arena_free(old->bits);
+        free(old);
+    }
+}
+
+/**
+ * @brief Rebuild the filter and publish it
+ *
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int rebuild(void) {
+    bloom_filter_t *new_filter = build_filter();
+    if (new_filter == NULL) {
+        return FAILURE;
+    }
+
+    pthread_rwlock_wrlock(&filter_lock);
+    bloom_filter_t *old = filter;
+    filter = new_filter;
+    pthread_rwlock_unlock(&filter_lock);
+
+    free_filter(old);
+    __atomic_add_fetch(&rebuilds, 1, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/**
+ * @brief Read and discard all queued inotify events
+ *
+ * @param timeout_ms How long to wait for the first event, -1 to block
+ * @return Number of bytes of events read, or -1 on error
+ */
+static ssize_t drain_events(int timeout_ms) {
+    char events[BLOOM_EVENT_BUFFER_SIZE];
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    ssize_t total = 0;
+
+    while (poll(&pfd, 1, timeout_ms) > 0) {
+        // Bypass the filter until the new one is published, set before the queue is emptied
+        // so lookups always see either the pending events or the dirty flag
+        __atomic_store_n(&dirty, 1, __ATOMIC_SEQ_CST);
+        ssize_t n = read(inotify_fd, events, sizeof(events));
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        total += n;
+        timeout_ms = 0; // only block for the first batch
+    }
+    if (total > 0) {
+        __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    }
+    return total;
+}
+
+/**
+ * @brief Background thread that rebuilds the filter on directory changes
+ */
+static void *watch_thread(void *arg) {
+    (void)arg;
+    cserve_prof_register_thread();
+    ssize_t changed = 0;
+    while (changed >= 0) {
+        // Marks the filter dirty as soon as there is something to read
+        changed = drain_events(-1);
+
+        // Rebuild until a walk completes with nothing changing during it. Events consumed
+        // after a walk must lead to another walk, nothing else will clear the dirty flag
+        while (changed > 0) {
+            // Let a burst of changes (deploys, rsync) settle before walking
+            do {
+                usleep(BLOOM_REBUILD_DELAY_MS * 1000);
+            } while ((changed = drain_events(0)) > 0);
+
+            if (changed < 0 || rebuild() == FAILURE) {
+                changed = -1;
+                break;
+            }
+            changed = drain_events(0);
+            if (changed == 0) {
+                __atomic_store_n(&dirty, 0, __ATOMIC_SEQ_CST);
+            }
+        }
+    }
+
+    printf("Error: Site index watcher stopped, disabling the filter\n");
+    __atomic_store_n(&enabled, 0, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/**
+ * @brief Render the site index section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    size_t paths = 0;
+    uint64_t bits = 0;
+    pthread_rwlock_rdlock(&filter_lock);
+    if (filter != NULL) {
+        paths = filter->num_paths;
+        bits = filter->num_bits;
+    }
+    pthread_rwlock_unlock(&filter_lock);
+
+    cserve_metrics_appendf(buf, "cserv_bloom_enabled %d\n",
+                           __atomic_load_n(&enabled, __ATOMIC_RELAXED) &&
+                               !__atomic_load_n(&dirty, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_bloom_paths %zu\n", paths);
+    cserve_metrics_appendf(buf, "cserv_bloom_bits %llu\n", (unsigned long long)bits);
+    cserve_metrics_appendf(buf, "cserv_bloom_rebuilds_total %lu\n",
+                           __atomic_load_n(&rebuilds, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Build the site index and start watching the directory for changes
+ */
+int cserve_bloom_init(const char *root_dir) {
+    snprintf(root, sizeof(root), "%s", root_dir);
+    root_len = strlen(root);
+    // Drop trailing slashes so relative paths always start with '/'
+    while (root_len > 0 && root[root_len - 1] == '/') {
+        root[--root_len] = '\0';
+    }
+
+    if (cserve_metrics_register(render_metrics) == FAILURE) {
+        return FAILURE;
+    }
+
+    inotify_fd = inotify_init1(IN_CLOEXEC);
+    if (inotify_fd < 0) {
+        perror("inotify_init1");
+        printf("Warning: Site index disabled, cannot watch %s\n", root_dir);
+        return SUCCESS;
+    }
+
+    if (rebuild() == FAILURE) {
+        printf("Warning: Site index disabled, cannot index %s\n", root_dir);
+        close(inotify_fd);
+        inotify_fd = -1;
+        return SUCCESS;
+    }
+
+    printf("Site index: %zu paths\n", filter->num_paths);
+
+    enabled = 1;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, watch_thread, NULL) != 0) {
+        printf("Warning: Site index disabled, cannot start watcher thread\n");
+        enabled = 0;
+        return SUCCESS;
+    }
+    pthread_detach(thread);
+    return SUCCESS;
+}
+
+/**
+ * @brief Check whether a path may exist under the served directory
+ */
+int cserve_bloom_check(const char *path) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE) || __atomic_load_n(&dirty, __ATOMIC_ACQUIRE)) {
+        return SUCCESS;
+    }
+
+    path_hash_t hash = hash_path(path);
+    int rv = SUCCESS;
+    pthread_rwlock_rdlock(&filter_lock);
+    for (int k = 0; k < BLOOM_HASHES; k++) {
+        uint64_t bit = (hash.h1 + k * hash.h2) % filter->num_bits;
+        if ((filter->bits[bit / 64] & ((uint64_t)1 << (bit % 64))) == 0) {
+            rv = FAILURE;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&filter_lock);
+
+    // A change the watcher has not picked up yet may have created the path
+    if (rv == FAILURE) {
+        int queued = 0;
+        if (ioctl(inotify_fd, FIONREAD, &queued) != 0 || queued > 0 ||
+            __atomic_load_n(&dirty, __ATOMIC_SEQ_CST)) {
+            return SUCCESS;
+        }
+    }
+    return rv;
+}
+
+/**
+ * @brief Get a counter that changes whenever an entry is added or removed
+ */
+int cserve_bloom_generation(unsigned long *gen) {
+    if (!__atomic_load_n(&enabled, __ATOMIC_ACQUIRE)) {
+        return FAILURE;
+    }
+    *gen = __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+    return SUCCESS;
+}
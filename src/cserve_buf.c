@@ -0,0 +1,107 @@
+/**
+ * @file cserve_buf.c
+ * @brief Reference counted body buffers
+ */
+
+#include "cserve_buf.h"
+#include "cserve_mem.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+/**
+ * @brief Allocate a buffer header with one reference
+ */
+static cserver_buf_t *new_buf(size_t extra) {
+    cserver_buf_t *buf = cserve_mem_alloc(sizeof(cserver_buf_t) + extra);
+    if (buf == NULL) {
+        printf("Error: Memory allocation failed for body buffer\n");
+        return NULL;
+    }
+    buf->data = NULL;
+    buf->fd = -1;
+    buf->size = 0;
+    buf->refs = 1;
+    buf->destroy = NULL;
+    buf->ctx = NULL;
+    return buf;
+}
+
+/**
+ * @brief Close the file of a file buffer
+ */
+static void close_file(void *ctx) {
+    close(((cserver_buf_t *)ctx)->fd);
+}
+
+/**
+ * @brief Allocate a heap buffer
+ *
+ * The bytes follow the header in the same allocation.
+ */
+cserver_buf_t *cserve_buf_alloc(size_t size, char **data) {
+    cserver_buf_t *buf = new_buf(size + 1);
+    if (buf == NULL) {
+        return NULL;
+    }
+    *data = (char *)(buf + 1);
+    buf->data = *data;
+    buf->size = size;
+    return buf;
+}
+
+/**
+ * @brief Wrap memory owned by something else
+ */
+cserver_buf_t *cserve_buf_wrap(const char *data, size_t size, void (*destroy)(void *ctx),
+                               void *ctx) {
+    cserver_buf_t *buf = new_buf(0);
+    if (buf == NULL) {
+        if (destroy != NULL) {
+            destroy(ctx);
+        }
+        return NULL;
+    }
+    buf->data = data;
+    buf->size = size;
+    buf->destroy = destroy;
+    buf->ctx = ctx;
+    return buf;
+}
+
+/**
+ * @brief Wrap an open file
+ */
+cserver_buf_t *cserve_buf_file(int fd, size_t size) {
+    cserver_buf_t *buf = new_buf(0);
+    if (buf == NULL) {
+        close(fd);
+        return NULL;
+    }
+    buf->fd = fd;
+    buf->size = size;
+    buf->destroy = close_file;
+    buf->ctx = buf;
+    return buf;
+}
+
+/**
+ * @brief Take another reference
+ */
+cserver_buf_t *cserve_buf_ref(cserver_buf_t *buf) {
+    __atomic_add_fetch(&buf->refs, 1, __ATOMIC_RELAXED);
+    return buf;
+}
+
+/**
+ * @brief Drop a reference, destroying the buffer if it was the last
+ */
+void cserve_buf_unref(cserver_buf_t *buf) {
+    if (buf == NULL || __atomic_sub_fetch(&buf->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+        return;
+    }
+    if (buf->destroy != NULL) {
+        buf->destroy(buf->ctx);
+    }
+    cserve_mem_free(buf);
+}
@@ -0,0 +1,316 @@
+/**
+ * @file cserve_bundle.c
+ * @brief Multi-file bundle endpoint
+ */
+
+// Define feature macros before including headers
+// These enable strtok_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_bundle.h"
+#include "config.h"
+#include "cserve_bloom.h"
+#include "cserve_fcgi.h"
+#include "cserve_fs.h"
+#include "cserve_get_handler.h"
+#include "cserve_mem.h"
+#include "cserve_metrics.h"
+#include "cserve_policy.h"
+#include "error.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// defines
+#define BUNDLE_HEADERS_BUFFER_SIZE 2048
+
+/**
+ * @brief One file of a bundle
+ */
+typedef struct {
+    char path[512];
+    struct stat st;
+} bundle_part_t;
+
+/**
+ * @brief Value of a hex digit, -1 if it is not one
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    if (c >= 'A' && c <= 'F') {
+        return c - 'A' + 10;
+    }
+    return -1;
+}
+
+/**
+ * @brief Decode %XX escapes in place, forms send '/' as %2F
+ */
+static void percent_decode(char *str) {
+    char *out = str;
+    for (char *in = str; *in; in++) {
+        if (*in == '%' && hex_value(in[1]) >= 0 && hex_value(in[2]) >= 0) {
+            *out++ = (char)(hex_value(in[1]) * 16 + hex_value(in[2]));
+            in += 2;
+        } else {
+            *out++ = *in;
+        }
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Split a file list into parts
+ *
+ * @param list Paths separated by ',', '&' or newlines, each optionally prefixed with "name="
+ * @param parts Filled with the paths
+ * @param count Set to the number of paths
+ * @return SUCCESS on success, FAILURE if there are too many paths or one is too long
+ */
+static int parse_list(const char *list, bundle_part_t *parts, size_t *count) {
+    char *copy = cserve_mem_strdup(list);
+    if (copy == NULL) {
+        printf("Error: Memory allocation failed for bundle list\n");
+        return FAILURE;
+    }
+
+    int rv = SUCCESS;
+    *count = 0;
+    char *saveptr;
+    for (char *token = strtok_r(copy, ",&\r\n", &saveptr); token != NULL;
+         token = strtok_r(NULL, ",&\r\n", &saveptr)) {
+        char *value = strchr(token, '=');
+        value = value != NULL ? value + 1 : token;
+        percent_decode(value);
+        if (*value == '\0') {
+            continue;
+        }
+        if (*count == BUNDLE_MAX_PARTS || strlen(value) >= sizeof(parts->path)) {
+            rv = FAILURE;
+            break;
+        }
+        strcpy(parts[(*count)++].path, value);
+    }
+    cserve_mem_free(copy);
+    return rv;
+}
+
+/**
+ * @brief Order parts by path
+ */
+static int compare_parts(const void *a, const void *b) {
+    return strcmp(((const bundle_part_t *)a)->path, ((const bundle_part_t *)b)->path);
+}
+
+/**
+ * @brief Hash the sorted part list together with each file's version
+ *
+ * Two requests hash the same only if they name the same files and none of
+ * them changed in between, which is what makes the hash usable as an ETag.
+ */
+static unsigned long long hash_parts(const bundle_part_t *parts, size_t count) {
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < count; i++) {
+        unsigned long long version[3] = {(unsigned long long)parts[i].st.st_mtim.tv_sec,
+                                         (unsigned long long)parts[i].st.st_mtim.tv_nsec,
+                                         (unsigned long long)parts[i].st.st_size};
+        const unsigned char *bytes = (const unsigned char *)parts[i].path;
+        size_t len = strlen(parts[i].path) + 1; // include the NUL as a separator
+        for (size_t j = 0; j < len; j++) {
+            hash = (hash ^ bytes[j]) * 1099511628211ULL;
+        }
+        bytes = (const unsigned char *)version;
+        for (size_t j = 0; j < sizeof(version); j++) {
+            hash = (hash ^ bytes[j]) * 1099511628211ULL;
+        }
+    }
+    return hash;
+}
+
+/**
+ * @brief Drop the buffer references of the first count file segments
+ */
+static void release_files(cserver_http_segment_t *files, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        cserve_buf_unref(files[i].buf);
+    }
+}
+
+/**
+ * @brief Check and stat every part
+ *
+ * @return NULL if all parts can be served, otherwise the error response
+ */
+static cserver_http_res_t *stat_parts(bundle_part_t *parts, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (validate_path(parts[i].path) == FAILURE) {
+            printf("Error: Invalid bundle path: %s\n", parts[i].path);
+            return create_http_response(HTTP_STATUS_BAD_REQUEST, "text/plain", "Bad Request");
+        }
+        if (cserve_fcgi_is_private(parts[i].path)) {
+            printf("Error: Bundle part not servable as a file: %s\n", parts[i].path);
+            return create_http_response(HTTP_STATUS_FORBIDDEN, "text/plain", "Forbidden");
+        }
+        if (cserve_bloom_check(parts[i].path) == FAILURE ||
+            cserve_fs_stat(parts[i].path, &parts[i].st) != SUCCESS ||
+            !S_ISREG(parts[i].st.st_mode)) {
+            printf("Error: Bundle part not found: %s\n", parts[i].path);
+            return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Check whether a request targets the bundle endpoint
+ */
+int cserve_bundle_is_bundle_path(const char *path) {
+    return strcmp(path, BUNDLE_PATH) == 0;
+}
+
+/**
+ * @brief Handle a bundle request
+ */
+cserver_http_res_t *cserve_bundle_handler(cserver_http_req_t *req) {
+    const char *list;
+    switch (method_str_to_enum(req->method)) {
+    case HTTP_METHOD_GET:
+        list = req->query;
+        break;
+    case HTTP_METHOD_POST:
+        list = req->body;
+        break;
+    default:
+        return create_http_response(HTTP_STATUS_METHOD_NOT_ALLOWED, "text/plain",
+                                    "Method Not Allowed");
+    }
+
+    bundle_part_t *parts = cserve_mem_calloc(BUNDLE_MAX_PARTS, sizeof(bundle_part_t));
+    if (parts == NULL) {
+        printf("Error: Memory allocation failed for bundle\n");
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+    size_t count;
+    if (parse_list(list, parts, &count) != SUCCESS || count == 0) {
+        cserve_mem_free(parts);
+        return create_http_response(HTTP_STATUS_BAD_REQUEST, "text/plain", "Bad Request");
+    }
+
+    // Sort and drop duplicates so every ordering of a list is the same bundle
+    qsort(parts, count, sizeof(bundle_part_t), compare_parts);
+    size_t unique = 1;
+    for (size_t i = 1; i < count; i++) {
+        if (strcmp(parts[i].path, parts[unique - 1].path) != 0) {
+            parts[unique++] = parts[i];
+        }
+    }
+    count = unique;
+
+    cserver_http_res_t *error = stat_parts(parts, count);
+    if (error != NULL) {
+        cserve_mem_free(parts);
+        return error;
+    }
+
+    const char *paths[BUNDLE_MAX_PARTS];
+    for (size_t i = 0; i < count; i++) {
+        paths[i] = parts[i].path;
+    }
+    unsigned long long hash = hash_parts(parts, count);
+    char etag[48];
+    snprintf(etag, sizeof(etag), "\"b-%016llx\"", hash);
+
+    // The client already has this exact bundle
+    if (req->if_none_match[0] != '\0' && strstr(req->if_none_match, etag) != NULL) {
+        cserver_http_res_t *response =
+            create_http_response(HTTP_STATUS_NOT_MODIFIED, "text/plain", NULL);
+        if (response != NULL) {
+            snprintf(response->etag, sizeof(response->etag), "%s", etag);
+            cserve_policy_apply_all(response, paths, count);
+        }
+        cserve_mem_free(parts);
+        return response;
+    }
+
+    // The files are loaded first so their part headers can announce the lengths
+    cserver_http_segment_t files[BUNDLE_MAX_PARTS];
+    for (size_t i = 0; i < count; i++) {
+        if (cserve_get_file_segment(parts[i].path, &parts[i].st, &files[i]) != SUCCESS) {
+            printf("Error: Failed to load bundle part: %s\n", parts[i].path);
+            release_files(files, i);
+            cserve_mem_free(parts);
+            return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                        "Internal Server Error");
+        }
+    }
+
+    // All part headers live in one buffer, the body alternates between slices of it and the files
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "cserv-%016llx", hash);
+    cserver_metrics_buf_t text;
+    text.len = 0;
+    text.cap = BUNDLE_HEADERS_BUFFER_SIZE;
+    text.data = malloc(text.cap);
+    size_t offsets[BUNDLE_MAX_PARTS + 1];
+    // A dropped part header would leave the offsets describing a broken body
+    int fit = text.data != NULL ? SUCCESS : FAILURE;
+    for (size_t i = 0; fit == SUCCESS && i <= count; i++) {
+        offsets[i] = text.len;
+        if (i == count) {
+            fit = cserve_metrics_appendf(&text, "\r\n--%s--\r\n", boundary);
+        } else {
+            fit = cserve_metrics_appendf(
+                &text,
+                "%s--%s\r\nContent-Type: %s\r\nContent-Location: %s\r\n"
+                "Content-Length: %zu\r\n\r\n",
+                i > 0 ? "\r\n" : "", boundary, cserve_get_content_type(parts[i].path),
+                parts[i].path, files[i].length);
+        }
+    }
+    if (fit != SUCCESS) {
+        free(text.data);
+        text.data = NULL;
+    }
+    cserver_buf_t *headers = NULL;
+    if (text.data != NULL) {
+        headers = cserve_buf_wrap(text.data, text.len, free, text.data);
+    }
+    cserver_http_res_t *response = NULL;
+    if (headers != NULL) {
+        char content_type[64];
+        snprintf(content_type, sizeof(content_type), "multipart/mixed; boundary=%s", boundary);
+        response = create_http_response(HTTP_STATUS_OK, content_type, NULL);
+    }
+    int rv = response != NULL ? SUCCESS : FAILURE;
+    for (size_t i = 0; rv == SUCCESS && i <= count; i++) {
+        size_t part_end = i == count ? text.len : offsets[i + 1];
+        rv = http_response_append(response, headers, offsets[i], part_end - offsets[i]);
+        if (rv == SUCCESS && i < count) {
+            rv = http_response_append(response, files[i].buf, files[i].offset, files[i].length);
+        }
+    }
+    release_files(files, count);
+    cserve_buf_unref(headers);
+    if (rv != SUCCESS) {
+        free_http_response(response);
+        cserve_mem_free(parts);
+        printf("Error: Failed to create bundle response\n");
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+
+    snprintf(response->etag, sizeof(response->etag), "%s", etag);
+    cserve_policy_apply_all(response, paths, count);
+
+    cserve_metrics_inc(METRIC_BUNDLES_SERVED);
+    cserve_metrics_add(METRIC_BUNDLE_PARTS, count);
+    cserve_mem_free(parts);
+    return response;
+}
@@ -0,0 +1,400 @@
+/**
+ * @file cserve_cache.c
+ * @brief In-memory file cache with request coalescing
+ *
+ * A fixed size hash table of reference counted entries plus an LRU list
+ * used to stay within the byte budget. All state is protected by one mutex;
+ * loaders run without the lock held so a slow read never blocks hits on
+ * other keys.
+ */
+
+// Define feature macros before including headers
+// These enable pthread_cond_timedwait and clock_gettime
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_cache.h"
+#include "config.h"
+#include "cserve_arena.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// defines
+#define CACHE_BUCKETS 1024
+
+// globals
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cache_cond = PTHREAD_COND_INITIALIZER;
+static cserver_cache_entry_t *buckets[CACHE_BUCKETS];
+static cserver_cache_entry_t *lru_head; // most recently used
+static cserver_cache_entry_t *lru_tail; // least recently used
+static cserver_cache_stats_t stats;
+
+// Eviction reason names, indexed by cserver_cache_evict_reason_t
+static const char *evict_reason_names[CACHE_EVICT_REASON_COUNT] = {
+    "capacity",
+    "pressure",
+    "stale",
+    "invalidate",
+};
+
+/**
+ * @brief FNV-1a hash of a cache key
+ *
+ * @param key The key to hash
+ * @return The hash value
+ */
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 2166136261UL;
+    while (*key) {
+        hash ^= (unsigned char)*key++;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Find a linked entry by key, cache lock must be held
+ */
+static cserver_cache_entry_t *lookup(const char *key, unsigned long hash) {
+    cserver_cache_entry_t *entry = buckets[hash % CACHE_BUCKETS];
+    while (entry != NULL) {
+        if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+            return entry;
+        }
+        entry = entry->hash_next;
+    }
+    return NULL;
+}
+
+/**
+ * @brief Remove an entry from the LRU list, cache lock must be held
+ */
+static void lru_remove(cserver_cache_entry_t *entry) {
+    if (entry->lru_prev != NULL) {
+        entry->lru_prev->lru_next = entry->lru_next;
+    } else if (lru_head == entry) {
+        lru_head = entry->lru_next;
+    }
+    if (entry->lru_next != NULL) {
+        entry->lru_next->lru_prev = entry->lru_prev;
+    } else if (lru_tail == entry) {
+        lru_tail = entry->lru_prev;
+    }
+    entry->lru_prev = NULL;
+    entry->lru_next = NULL;
+}
+
+/**
+ * @brief Move an entry to the front of the LRU list, cache lock must be held
+ */
+static void lru_touch(cserver_cache_entry_t *entry) {
+    lru_remove(entry);
+    entry->lru_next = lru_head;
+    if (lru_head != NULL) {
+        lru_head->lru_prev = entry;
+    }
+    lru_head = entry;
+    if (lru_tail == NULL) {
+        lru_tail = entry;
+    }
+}
+
+/**
+ * @brief Free an entry and its data, cache lock must be held
+ */
+static void free_entry(cserver_cache_entry_t *entry) {
+    cserve_arena_free(entry->data);
+    cserve_arena_free(entry);
+}
+
+/**
+ * @brief Take an entry out of the table and LRU list, cache lock must be held
+ *
+ * The entry itself is freed once the last reference is released.
+ */
+static void unlink_entry(cserver_cache_entry_t *entry) {
+    if (!entry->linked) {
+        return;
+    }
+    cserver_cache_entry_t **slot = &buckets[entry->hash % CACHE_BUCKETS];
+    while (*slot != NULL && *slot != entry) {
+        slot = &(*slot)->hash_next;
+    }
+    if (*slot == entry) {
+        *slot = entry->hash_next;
+    }
+    entry->hash_next = NULL;
+    lru_remove(entry);
+    entry->linked = 0;
+    stats.entries--;
+    if (entry->state == CACHE_ENTRY_READY) {
+        stats.bytes -= entry->size;
+    }
+    if (entry->refcount == 0) {
+        free_entry(entry);
+    }
+}
+
+/**
+ * @brief Evict least recently used entries until we fit the budget, cache lock must be held
+ *
+ * @param reason Reason recorded for the evicted entries
+ */
+static void evict_to_budget(cserver_cache_evict_reason_t reason) {
+    cserver_cache_entry_t *entry = lru_tail;
+    while (stats.bytes > stats.budget && entry != NULL) {
+        cserver_cache_entry_t *prev = entry->lru_prev;
+        unlink_entry(entry);
+        stats.evictions[reason]++;
+        entry = prev;
+    }
+}
+
+/**
+ * @brief Render the cache section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    cserver_cache_stats_t snapshot;
+    cserve_cache_get_stats(&snapshot);
+    cserve_metrics_appendf(buf, "cserv_cache_hits_total %lu\n", snapshot.hits);
+    cserve_metrics_appendf(buf, "cserv_cache_misses_total %lu\n", snapshot.misses);
+    cserve_metrics_appendf(buf, "cserv_cache_coalesced_total %lu\n", snapshot.coalesced);
+    cserve_metrics_appendf(buf, "cserv_cache_fallbacks_total %lu\n", snapshot.fallbacks);
+    for (int i = 0; i < CACHE_EVICT_REASON_COUNT; i++) {
+        cserve_metrics_appendf(buf, "cserv_cache_evictions_total{reason=\"%s\"} %lu\n",
+                               evict_reason_names[i], snapshot.evictions[i]);
+    }
+    cserve_metrics_appendf(buf, "cserv_cache_entries %zu\n", snapshot.entries);
+    cserve_metrics_appendf(buf, "cserv_cache_bytes %zu\n", snapshot.bytes);
+    cserve_metrics_appendf(buf, "cserv_cache_budget_bytes %zu\n", snapshot.budget);
+}
+
+/**
+ * @brief Initialize the cache
+ *
+ * @param budget Maximum number of bytes of object data to keep cached
+ * @return SUCCESS on success, FAILURE on error
+ */
+int cserve_cache_init(size_t budget) {
+    pthread_mutex_lock(&cache_lock);
+    memset(&stats, 0, sizeof(stats));
+    stats.budget = budget;
+    pthread_mutex_unlock(&cache_lock);
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Wait for an in-flight entry to finish loading, cache lock must be held
+ *
+ * @param entry The entry being loaded by another caller
+ * @return SUCCESS if the entry became ready, FAILURE on load failure or timeout
+ */
+static int wait_for_entry(cserver_cache_entry_t *entry) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += CACHE_WAIT_TIMEOUT_MS / 1000;
+    deadline.tv_nsec += (long)(CACHE_WAIT_TIMEOUT_MS % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (entry->state == CACHE_ENTRY_LOADING) {
+        if (pthread_cond_timedwait(&cache_cond, &cache_lock, &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+    return entry->state == CACHE_ENTRY_READY ? SUCCESS : FAILURE;
+}
+
+/**
+ * @brief Look up an object, loading it on a miss
+ *
+ * Only the first caller to miss on a key runs the loader. Later callers take
+ * a reference on the in-flight entry and wait for it, so a burst of requests
+ * for a cold file costs a single open and read.
+ */
+cserver_cache_entry_t *cserve_cache_acquire(const char *key, const struct timespec *mtime,
+                                            size_t size,
+                                            cserver_cache_loader_t loader, void *ctx,
+                                            cserver_cache_result_t *result) {
+    cserver_cache_result_t ignored;
+    if (result == NULL) {
+        result = &ignored;
+    }
+
+    unsigned long hash = hash_key(key);
+
+    pthread_mutex_lock(&cache_lock);
+
+    // Too recently modified to trust the mtime, a change in the same tick would go unnoticed
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    if (now.tv_sec - mtime->tv_sec < CACHE_RACY_SECONDS ||
+        (now.tv_sec - mtime->tv_sec == CACHE_RACY_SECONDS && now.tv_nsec < mtime->tv_nsec)) {
+        stats.fallbacks++;
+        pthread_mutex_unlock(&cache_lock);
+        *result = CACHE_RESULT_FALLBACK;
+        return NULL;
+    }
+
+    cserver_cache_entry_t *entry = lookup(key, hash);
+    if (entry != NULL && (entry->mtime.tv_sec != mtime->tv_sec ||
+                          entry->mtime.tv_nsec != mtime->tv_nsec ||
+                          (size != CACHE_SIZE_UNKNOWN && entry->size != size))) {
+        if (entry->state == CACHE_ENTRY_LOADING) {
+            // Someone is loading a different version, don't wait on it
+            stats.fallbacks++;
+            pthread_mutex_unlock(&cache_lock);
+            *result = CACHE_RESULT_FALLBACK;
+            return NULL;
+        }
+        // The file changed on disk, drop the stale copy
+        unlink_entry(entry);
+        stats.evictions[CACHE_EVICT_STALE]++;
+        entry = NULL;
+    }
+
+    if (entry != NULL && entry->state == CACHE_ENTRY_READY) {
+        entry->refcount++;
+        entry->hits++;
+        lru_touch(entry);
+        stats.hits++;
+        pthread_mutex_unlock(&cache_lock);
+        *result = CACHE_RESULT_HIT;
+        return entry;
+    }
+
+    if (entry != NULL) {
+        // In-flight load, wait for it instead of hitting the disk again
+        entry->refcount++;
+        if (wait_for_entry(entry) == SUCCESS) {
+            entry->hits++;
+            stats.coalesced++;
+            pthread_mutex_unlock(&cache_lock);
+            *result = CACHE_RESULT_COALESCED;
+            return entry;
+        }
+        entry->refcount--;
+        if (entry->refcount == 0 && !entry->linked) {
+            free_entry(entry);
+        }
+        stats.fallbacks++;
+        pthread_mutex_unlock(&cache_lock);
+        *result = CACHE_RESULT_FALLBACK;
+        return NULL;
+    }
+
+    // Miss: insert a loading placeholder so concurrent callers coalesce on it
+    size_t key_len = strlen(key);
+    entry = cserve_arena_calloc(1, sizeof(cserver_cache_entry_t) + key_len + 1);
+    if (entry == NULL) {
+        pthread_mutex_unlock(&cache_lock);
+        printf("Error: Memory allocation failed for cache entry\n");
+        *result = CACHE_RESULT_ERROR;
+        return NULL;
+    }
+    memcpy(entry->key, key, key_len + 1);
+    entry->hash = hash;
+    entry->mtime = *mtime;
+    entry->size = size == CACHE_SIZE_UNKNOWN ? 0 : size;
+    entry->state = CACHE_ENTRY_LOADING;
+    entry->refcount = 1;
+    entry->linked = 1;
+    entry->hash_next = buckets[hash % CACHE_BUCKETS];
+    buckets[hash % CACHE_BUCKETS] = entry;
+    stats.entries++;
+    stats.misses++;
+    pthread_mutex_unlock(&cache_lock);
+
+    char *data = NULL;
+    size_t data_size = 0;
+    int rv = loader(key, ctx, &data, &data_size);
+
+    pthread_mutex_lock(&cache_lock);
+    if (rv != SUCCESS) {
+        entry->state = CACHE_ENTRY_FAILED;
+        unlink_entry(entry);
+        entry->refcount--;
+        if (entry->refcount == 0) {
+            free_entry(entry);
+        }
+        pthread_cond_broadcast(&cache_cond);
+        pthread_mutex_unlock(&cache_lock);
+        *result = CACHE_RESULT_ERROR;
+        return NULL;
+    }
+
+    if (data_size > MAX_CACHE_OBJECT_SIZE || data_size > stats.budget) {
+        // Too big to keep around, waiters still share this one copy
+        unlink_entry(entry);
+    }
+    entry->data = data;
+    entry->size = data_size;
+    entry->state = CACHE_ENTRY_READY;
+    pthread_cond_broadcast(&cache_cond);
+
+    if (entry->linked) {
+        stats.bytes += data_size;
+        lru_touch(entry);
+        evict_to_budget(CACHE_EVICT_CAPACITY);
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    *result = CACHE_RESULT_MISS;
+    return entry;
+}
+
+/**
+ * @brief Drop a reference obtained from cserve_cache_acquire()
+ */
+void cserve_cache_release(cserver_cache_entry_t *entry) {
+    if (entry == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&cache_lock);
+    entry->refcount--;
+    if (entry->refcount == 0 && !entry->linked) {
+        free_entry(entry);
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Remove a key from the cache
+ */
+void cserve_cache_invalidate(const char *key) {
+    unsigned long hash = hash_key(key);
+    pthread_mutex_lock(&cache_lock);
+    cserver_cache_entry_t *entry = lookup(key, hash);
+    if (entry != NULL && entry->state == CACHE_ENTRY_READY) {
+        unlink_entry(entry);
+        stats.evictions[CACHE_EVICT_INVALIDATE]++;
+    }
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Change the cache budget
+ */
+void cserve_cache_set_budget(size_t budget, cserver_cache_evict_reason_t reason) {
+    pthread_mutex_lock(&cache_lock);
+    stats.budget = budget;
+    evict_to_budget(reason);
+    pthread_mutex_unlock(&cache_lock);
+}
+
+/**
+ * @brief Get a snapshot of the cache counters
+ */
+void cserve_cache_get_stats(cserver_cache_stats_t *out) {
+    pthread_mutex_lock(&cache_lock);
+    *out = stats;
+    pthread_mutex_unlock(&cache_lock);
+}
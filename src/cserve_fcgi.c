@@ -0,0 +1,690 @@
+/**
+ * @file cserve_fcgi.c
+ * @brief FastCGI worker pool for dynamic scripts
+ */
+
+// Define feature macros before including headers
+// These enable kill, sigprocmask and Unix domain sockets
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_fcgi.h"
+#include "config.h"
+#include "cserve_bloom.h"
+#include "cserve_fs.h"
+#include "cserve_get_handler.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+// defines
+#define FCGI_VERSION_1 1
+#define FCGI_BEGIN_REQUEST 1
+#define FCGI_END_REQUEST 3
+#define FCGI_PARAMS 4
+#define FCGI_STDIN 5
+#define FCGI_STDOUT 6
+#define FCGI_STDERR 7
+#define FCGI_RESPONDER 1
+#define FCGI_KEEP_CONN 1
+#define FCGI_REQUEST_ID 1
+#define FCGI_HEADER_SIZE 8
+#define FCGI_MAX_CONTENT 65535
+#define FCGI_MAX_PADDING 255
+#define FCGI_PARAMS_SIZE 8192
+#define FCGI_HEAD_SIZE 8192
+#define FCGI_BACKLOG 16
+#define FCGI_MAX_HEADERS 32
+
+/**
+ * @brief One worker process and the connection to it
+ */
+typedef struct {
+    pid_t pid;                // -1 if not running
+    char socket_path[108];    // sizeof(sun_path)
+    int conn;                 // persistent connection, -1 if not connected
+    int busy;                 // checked out by a request
+    int received;             // got a record for the current request
+    int ended;                // got FCGI_END_REQUEST for the current request
+    const char *pending;      // body bytes not handed to the client yet
+    size_t pending_len;
+    char head[FCGI_HEAD_SIZE]; // script headers, followed by the first body bytes
+    unsigned char record[FCGI_HEADER_SIZE + FCGI_MAX_CONTENT + FCGI_MAX_PADDING];
+} fcgi_worker_t;
+
+// globals
+static fcgi_worker_t workers[FCGI_WORKERS];
+static pthread_mutex_t workers_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t next_worker;
+static char root[MAX_DIR_PATH_SIZE];
+static char exec_command[MAX_DIR_PATH_SIZE + 8];
+static char socket_dir[64]; // only we can reach it, empty if not created
+static int enabled;
+
+/**
+ * @brief Start a worker listening on its own Unix socket
+ *
+ * The socket is created and listening before the worker starts, so
+ * connections made while it is still starting up wait in the backlog.
+ */
+static int spawn_worker(fcgi_worker_t *w) {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", w->socket_path);
+    unlink(w->socket_path);
+
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        perror("FastCGI socket");
+        return FAILURE;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, FCGI_BACKLOG) < 0) {
+        perror("FastCGI bind");
+        close(listen_fd);
+        return FAILURE;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("FastCGI fork");
+        close(listen_fd);
+        return FAILURE;
+    }
+    if (pid == 0) {
+        // FastCGI applications accept on fd 0, everything else but stdout/stderr is ours
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        signal(SIGPIPE, SIG_DFL);
+        dup2(listen_fd, 0);
+        long max_fd = sysconf(_SC_OPEN_MAX);
+        for (int fd = 3; fd < (max_fd > 0 ? max_fd : 1024); fd++) {
+            close(fd);
+        }
+        execl("/bin/sh", "sh", "-c", exec_command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(listen_fd);
+    w->pid = pid;
+    w->conn = -1;
+    return SUCCESS;
+}
+
+/**
+ * @brief Make sure a worker is running and connected
+ */
+static int connect_worker(fcgi_worker_t *w) {
+    if (w->conn >= 0) {
+        return SUCCESS;
+    }
+
+    // Start the worker again if it went away
+    if (w->pid < 0 || waitpid(w->pid, NULL, WNOHANG) == w->pid) {
+        w->pid = -1;
+        cserve_metrics_inc(METRIC_FCGI_RESPAWNS);
+        if (spawn_worker(w) != SUCCESS) {
+            return FAILURE;
+        }
+    }
+
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", w->socket_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("FastCGI socket");
+        return FAILURE;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror("FastCGI connect");
+        close(fd);
+        return FAILURE;
+    }
+    // A hung script must not hang the server forever
+    struct timeval timeout = {FCGI_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    w->conn = fd;
+    return SUCCESS;
+}
+
+/**
+ * @brief Drop the connection to a worker
+ */
+static void disconnect_worker(fcgi_worker_t *w) {
+    if (w->conn >= 0) {
+        close(w->conn);
+        w->conn = -1;
+    }
+}
+
+/**
+ * @brief Write a buffer completely
+ */
+static int write_all(int fd, const void *data, size_t len) {
+    const char *p = data;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FAILURE;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Read a buffer completely
+ */
+static int read_all(int fd, void *data, size_t len) {
+    char *p = data;
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return FAILURE;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Send one record, content must fit a single record
+ */
+static int write_record(int fd, int type, const void *content, size_t len) {
+    unsigned char header[FCGI_HEADER_SIZE] = {
+        FCGI_VERSION_1, (unsigned char)type,        0, FCGI_REQUEST_ID, (unsigned char)(len >> 8),
+        (unsigned char)(len & 0xff), 0, 0};
+    if (write_all(fd, header, sizeof(header)) != SUCCESS) {
+        return FAILURE;
+    }
+    return len > 0 ? write_all(fd, content, len) : SUCCESS;
+}
+
+/**
+ * @brief Append one name-value pair to a params buffer
+ *
+ * Lengths below 128 take one byte, longer ones four with the top bit set.
+ */
+static void add_param(unsigned char *buf, size_t *len, const char *name, const char *value) {
+    size_t lengths[2] = {strlen(name), strlen(value)};
+    if (*len + 8 + lengths[0] + lengths[1] > FCGI_PARAMS_SIZE) {
+        printf("Error: FastCGI params too long, dropping %s\n", name);
+        return;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (lengths[i] < 128) {
+            buf[(*len)++] = (unsigned char)lengths[i];
+        } else {
+            buf[(*len)++] = (unsigned char)((lengths[i] >> 24) | 0x80);
+            buf[(*len)++] = (unsigned char)(lengths[i] >> 16);
+            buf[(*len)++] = (unsigned char)(lengths[i] >> 8);
+            buf[(*len)++] = (unsigned char)lengths[i];
+        }
+    }
+    memcpy(buf + *len, name, lengths[0]);
+    *len += lengths[0];
+    memcpy(buf + *len, value, lengths[1]);
+    *len += lengths[1];
+}
+
+/**
+ * @brief Send a request, its CGI environment and its body to a worker
+ */
+static int send_request(fcgi_worker_t *w, cserver_http_req_t *req) {
+    unsigned char begin[8] = {0, FCGI_RESPONDER, FCGI_KEEP_CONN, 0, 0, 0, 0, 0};
+    if (write_record(w->conn, FCGI_BEGIN_REQUEST, begin, sizeof(begin)) != SUCCESS) {
+        return FAILURE;
+    }
+
+    char script[MAX_DIR_PATH_SIZE + sizeof(req->path)];
+    snprintf(script, sizeof(script), "%s%s", root, req->path);
+    char uri[sizeof(req->path) + sizeof(req->query) + 1];
+    snprintf(uri, sizeof(uri), "%s%s%s", req->path, req->query[0] ? "?" : "", req->query);
+    // The handler made sure the whole body arrived
+    char content_length[32];
+    size_t body_len = req->body_len;
+    snprintf(content_length, sizeof(content_length), "%zu", body_len);
+
+    unsigned char params[FCGI_PARAMS_SIZE];
+    size_t len = 0;
+    add_param(params, &len, "GATEWAY_INTERFACE", "CGI/1.1");
+    add_param(params, &len, "SERVER_SOFTWARE", "CServer/1.0");
+    add_param(params, &len, "SERVER_PROTOCOL", req->version);
+    add_param(params, &len, "REQUEST_METHOD", req->method);
+    add_param(params, &len, "REQUEST_URI", uri);
+    add_param(params, &len, "SCRIPT_NAME", req->path);
+    add_param(params, &len, "SCRIPT_FILENAME", script);
+    add_param(params, &len, "DOCUMENT_ROOT", root);
+    add_param(params, &len, "QUERY_STRING", req->query);
+    add_param(params, &len, "REMOTE_ADDR", req->client_addr);
+    add_param(params, &len, "CONTENT_LENGTH", body_len > 0 ? content_length : "");
+    add_param(params, &len, "CONTENT_TYPE", req->content_type);
+    add_param(params, &len, "HTTP_HOST", req->host);
+    add_param(params, &len, "HTTP_USER_AGENT", req->user_agent);
+    add_param(params, &len, "HTTP_ACCEPT", req->accept);
+    // php-cgi refuses to run scripts without it
+    add_param(params, &len, "REDIRECT_STATUS", "200");
+
+    // An empty record ends each stream
+    if (write_record(w->conn, FCGI_PARAMS, params, len) != SUCCESS ||
+        write_record(w->conn, FCGI_PARAMS, NULL, 0) != SUCCESS ||
+        (body_len > 0 && write_record(w->conn, FCGI_STDIN, req->body, body_len) != SUCCESS) ||
+        write_record(w->conn, FCGI_STDIN, NULL, 0) != SUCCESS) {
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Read records until there is script output or the request ended
+ *
+ * @param w The worker
+ * @param data Set to the output, valid until the next call
+ * @param len Set to its length, 0 once the request ended
+ * @return SUCCESS on success, FAILURE if the connection failed
+ */
+static int next_output(fcgi_worker_t *w, const char **data, size_t *len) {
+    *len = 0;
+    while (!w->ended) {
+        unsigned char *header = w->record;
+        if (read_all(w->conn, header, FCGI_HEADER_SIZE) != SUCCESS) {
+            return FAILURE;
+        }
+        size_t content_len = (size_t)header[4] << 8 | header[5];
+        unsigned char *content = w->record + FCGI_HEADER_SIZE;
+        if (read_all(w->conn, content, content_len + header[6]) != SUCCESS) {
+            return FAILURE;
+        }
+        w->received = 1;
+
+        switch (header[1]) {
+        case FCGI_STDOUT:
+            if (content_len > 0) {
+                *data = (const char *)content;
+                *len = content_len;
+                return SUCCESS;
+            }
+            break;
+        case FCGI_STDERR:
+            printf("FastCGI: %.*s\n", (int)content_len, (const char *)content);
+            break;
+        case FCGI_END_REQUEST:
+            w->ended = 1;
+            break;
+        default:
+            break;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Read the script's header block into w->head
+ *
+ * @return Length of the header block including the blank line, 0 on error
+ */
+static size_t read_head(fcgi_worker_t *w) {
+    size_t len = 0;
+    while (1) {
+        const char *data;
+        size_t data_len;
+        if (next_output(w, &data, &data_len) != SUCCESS || data_len == 0) {
+            return 0;
+        }
+        if (len + data_len >= sizeof(w->head)) {
+            printf("Error: FastCGI response headers too long\n");
+            return 0;
+        }
+        memcpy(w->head + len, data, data_len);
+        len += data_len;
+        w->head[len] = '\0';
+
+        // Scripts end their headers with either CRLF CRLF or LF LF
+        char *end = strstr(w->head, "\r\n\r\n");
+        size_t end_len = 4;
+        char *lf_end = strstr(w->head, "\n\n");
+        if (end == NULL || (lf_end != NULL && lf_end < end)) {
+            end = lf_end;
+            end_len = 2;
+        }
+        if (end != NULL) {
+            size_t head_len = (size_t)(end - w->head) + end_len;
+            w->pending = w->head + head_len;
+            w->pending_len = len - head_len;
+            return head_len;
+        }
+    }
+}
+
+/**
+ * @brief Hand out the next part of the script's output
+ */
+static ssize_t produce_body(void *ctx, char *buf, size_t size) {
+    fcgi_worker_t *w = ctx;
+    while (w->pending_len == 0) {
+        if (w->ended) {
+            return 0;
+        }
+        if (next_output(w, &w->pending, &w->pending_len) != SUCCESS) {
+            printf("Error: FastCGI worker connection failed\n");
+            cserve_metrics_inc(METRIC_FCGI_ERRORS);
+            return -1;
+        }
+    }
+    size_t n = w->pending_len < size ? w->pending_len : size;
+    memcpy(buf, w->pending, n);
+    w->pending += n;
+    w->pending_len -= n;
+    return (ssize_t)n;
+}
+
+/**
+ * @brief Return a worker to the pool
+ *
+ * A connection whose request did not run to the end still has records in
+ * flight, so it is dropped rather than reused.
+ */
+static void release_worker(void *ctx) {
+    fcgi_worker_t *w = ctx;
+    if (!w->ended) {
+        disconnect_worker(w);
+    }
+    pthread_mutex_lock(&workers_lock);
+    w->busy = 0;
+    pthread_mutex_unlock(&workers_lock);
+}
+
+/**
+ * @brief Check out an idle worker, round robin
+ */
+static fcgi_worker_t *checkout_worker(void) {
+    fcgi_worker_t *w = NULL;
+    pthread_mutex_lock(&workers_lock);
+    for (size_t i = 0; w == NULL && i < FCGI_WORKERS; i++) {
+        fcgi_worker_t *candidate = &workers[(next_worker + i) % FCGI_WORKERS];
+        if (!candidate->busy) {
+            w = candidate;
+            w->busy = 1;
+            next_worker = (next_worker + i + 1) % FCGI_WORKERS;
+        }
+    }
+    pthread_mutex_unlock(&workers_lock);
+    if (w != NULL) {
+        w->received = 0;
+        w->ended = 0;
+        w->pending_len = 0;
+    }
+    return w;
+}
+
+/**
+ * @brief Check whether a script header belongs to the connection rather than the body
+ */
+static int is_hop_by_hop(const char *name) {
+    static const char *const hop_by_hop[] = {"Connection", "Keep-Alive", "Proxy-Connection", "TE",
+                                             "Transfer-Encoding", "Trailer", "Upgrade"};
+    for (size_t i = 0; i < sizeof(hop_by_hop) / sizeof(hop_by_hop[0]); i++) {
+        if (strcasecmp(name, hop_by_hop[i]) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Turn the script's header block into a response
+ *
+ * Status, Content-Type, Location and Content-Length set the matching response
+ * fields. Framing and hop-by-hop headers are the server's business and are
+ * dropped, every other header is passed through as it is.
+ */
+static cserver_http_res_t *create_script_response(fcgi_worker_t *w, size_t head_len) {
+    int status = HTTP_STATUS_OK;
+    const char *reason = NULL;
+    const char *content_type = "text/html";
+    const char *location = "";
+    size_t content_length = HTTP_CONTENT_LENGTH_UNKNOWN;
+    const char *names[FCGI_MAX_HEADERS];
+    const char *values[FCGI_MAX_HEADERS];
+    size_t count = 0;
+
+    // Split into NUL terminated lines, the blank line ending the block stays out of the body
+    char *end = w->head + head_len;
+    for (char *p = w->head; p < end; p++) {
+        if (*p == '\r' || *p == '\n') {
+            *p = '\0';
+        }
+    }
+    for (char *line = w->head; line < end; line += strlen(line) + 1) {
+        char *value = strchr(line, ':');
+        if (value == NULL) {
+            continue;
+        }
+        *value++ = '\0';
+        value += strspn(value, " \t");
+        if (strcasecmp(line, "Status") == 0) {
+            status = atoi(value);
+            reason = strchr(value, ' ');
+        } else if (strcasecmp(line, "Content-Type") == 0) {
+            content_type = value;
+        } else if (strcasecmp(line, "Location") == 0) {
+            location = value;
+        } else if (strcasecmp(line, "Content-Length") == 0) {
+            char *length_end;
+            unsigned long long length = strtoull(value, &length_end, 10);
+            if (length_end == value || *length_end != '\0' || value[0] == '-') {
+                printf("Error: FastCGI script sent bad Content-Length %s\n", value);
+                return NULL;
+            }
+            content_length = (size_t)length;
+        } else if (is_hop_by_hop(line)) {
+            continue;
+        } else if (count < FCGI_MAX_HEADERS) {
+            names[count] = line;
+            values[count++] = value;
+        }
+    }
+    // A Location without a Status is a redirect
+    if (location[0] != '\0' && reason == NULL && status == HTTP_STATUS_OK) {
+        status = HTTP_STATUS_FOUND;
+    }
+    if (status < 200 || status > 599) {
+        printf("Error: FastCGI script sent bad status %d\n", status);
+        return NULL;
+    }
+
+    cserver_http_res_t *response = create_streaming_response(
+        (cserver_http_status_t)status, content_type, produce_body, w, release_worker);
+    if (response == NULL) {
+        return NULL;
+    }
+    response->content_length = content_length;
+    if (reason != NULL) {
+        snprintf(response->status_message, sizeof(response->status_message), "%s", reason + 1);
+    }
+    snprintf(response->location, sizeof(response->location), "%s", location);
+    for (size_t i = 0; i < count; i++) {
+        http_response_add_header(response, names[i], values[i]);
+    }
+    return response;
+}
+
+/**
+ * @brief Start the worker pool
+ */
+int cserve_fcgi_init(const char *root_dir, const char *command) {
+    for (size_t i = 0; i < FCGI_WORKERS; i++) {
+        workers[i].pid = -1;
+        workers[i].conn = -1;
+    }
+    if (command[0] == '\0') {
+        return SUCCESS;
+    }
+
+    // SCRIPT_FILENAME is the root followed by the request path, which starts with '/'
+    snprintf(root, sizeof(root), "%s", root_dir);
+    size_t len = strlen(root);
+    while (len > 1 && root[len - 1] == '/') {
+        root[--len] = '\0';
+    }
+    // exec so the worker is the shell's process and gets our signals directly
+    snprintf(exec_command, sizeof(exec_command), "exec %s", command);
+
+    // The sockets live in a directory of mode 0700, so no other user can connect
+    // to a worker or take a socket's name before we bind it
+    snprintf(socket_dir, sizeof(socket_dir), "%s/cserv-fcgi-XXXXXX", FCGI_SOCKET_DIR);
+    if (mkdtemp(socket_dir) == NULL) {
+        perror("FastCGI socket directory");
+        socket_dir[0] = '\0';
+        return FAILURE;
+    }
+
+    for (size_t i = 0; i < FCGI_WORKERS; i++) {
+        snprintf(workers[i].socket_path, sizeof(workers[i].socket_path), "%s/worker-%zu",
+                 socket_dir, i);
+        if (spawn_worker(&workers[i]) != SUCCESS) {
+            printf("Error: Failed to start FastCGI worker: %s\n", command);
+            cserve_fcgi_shutdown();
+            return FAILURE;
+        }
+    }
+    enabled = 1;
+    printf("Started %d FastCGI workers: %s\n", FCGI_WORKERS, command);
+    return SUCCESS;
+}
+
+/**
+ * @brief Stop every worker and remove their sockets and the socket directory
+ */
+void cserve_fcgi_shutdown(void) {
+    for (size_t i = 0; i < FCGI_WORKERS; i++) {
+        fcgi_worker_t *w = &workers[i];
+        disconnect_worker(w);
+        if (w->pid > 0) {
+            kill(w->pid, SIGTERM);
+            waitpid(w->pid, NULL, 0);
+            w->pid = -1;
+        }
+        if (w->socket_path[0] != '\0') {
+            unlink(w->socket_path);
+            w->socket_path[0] = '\0';
+        }
+    }
+    if (socket_dir[0] != '\0') {
+        rmdir(socket_dir);
+        socket_dir[0] = '\0';
+    }
+    enabled = 0;
+}
+
+/**
+ * @brief Check whether a request targets a script
+ */
+int cserve_fcgi_is_script(const char *path) {
+    size_t len = strlen(path);
+    size_t ext_len = strlen(FCGI_EXTENSION);
+    return enabled && len > ext_len && strcmp(path + len - ext_len, FCGI_EXTENSION) == 0;
+}
+
+/**
+ * @brief Check whether a path must never be sent as a file
+ */
+int cserve_fcgi_is_private(const char *path) {
+    // Anywhere in the path, so "/./_cserv/" and "//_cserv/" are caught too
+    if (strstr(path, ADMIN_PATH_PREFIX) != NULL) {
+        return 1;
+    }
+    size_t len = strlen(path);
+    size_t ext_len = strlen(FCGI_EXTENSION);
+    return len >= ext_len && strcmp(path + len - ext_len, FCGI_EXTENSION) == 0;
+}
+
+/**
+ * @brief Run a script and stream back its output
+ */
+cserver_http_res_t *cserve_fcgi_handler(cserver_http_req_t *req) {
+    cserver_http_method_t method = method_str_to_enum(req->method);
+    if (method != HTTP_METHOD_GET && method != HTTP_METHOD_POST) {
+        return create_http_response(HTTP_STATUS_METHOD_NOT_ALLOWED, "text/plain",
+                                    "Method Not Allowed");
+    }
+    if (validate_path(req->path) == FAILURE) {
+        printf("Error: Invalid path: %s\n", req->path);
+        return create_http_response(HTTP_STATUS_BAD_REQUEST, "text/plain", "Bad Request");
+    }
+    // A script handed part of a body would take it for the whole one
+    if (req->body_len < req->content_length) {
+        printf("Error: Request body too large, got %zu of %zu bytes\n", req->body_len,
+               req->content_length);
+        return create_http_response(HTTP_STATUS_PAYLOAD_TOO_LARGE, "text/plain",
+                                    "Payload Too Large");
+    }
+    // The script must exist below the root, the worker is handed its full path
+    struct stat st;
+    if (cserve_bloom_check(req->path) == FAILURE || cserve_fs_stat(req->path, &st) != SUCCESS ||
+        !S_ISREG(st.st_mode)) {
+        return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
+    }
+
+    fcgi_worker_t *w = checkout_worker();
+    if (w == NULL) {
+        return create_http_response(HTTP_STATUS_SERVICE_UNAVAILABLE, "text/plain",
+                                    "Service Unavailable");
+    }
+    cserve_metrics_inc(METRIC_FCGI_REQUESTS);
+
+    // A reused connection may have been closed by the worker since, try a fresh one once
+    size_t head_len = 0;
+    for (int attempt = 0; head_len == 0 && attempt < 2; attempt++) {
+        int reused = w->conn >= 0;
+        w->received = 0;
+        w->ended = 0;
+        if (connect_worker(w) == SUCCESS && send_request(w, req) == SUCCESS) {
+            head_len = read_head(w);
+        }
+        if (head_len == 0) {
+            disconnect_worker(w);
+            if (!reused || w->received) {
+                break; // the worker saw the request, running it twice is not safe
+            }
+        }
+    }
+
+    cserver_http_res_t *response = head_len > 0 ? create_script_response(w, head_len) : NULL;
+    if (response == NULL) {
+        if (head_len > 0) {
+            release_worker(w);
+        } else {
+            pthread_mutex_lock(&workers_lock);
+            w->busy = 0;
+            pthread_mutex_unlock(&workers_lock);
+        }
+        cserve_metrics_inc(METRIC_FCGI_ERRORS);
+        return create_http_response(HTTP_STATUS_BAD_GATEWAY, "text/plain", "Bad Gateway");
+    }
+    return response;
+}
@@ -6,19 +6,36 @@
  * @date 10/10/25
  */
 
+// Define feature macros before including headers
+// These enable posix_fadvise
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
 #include "cserve_get_handler.h"
 #include "config.h"
+#include "cserve_arena.h"
+#include "cserve_autoindex.h"
+#include "cserve_bloom.h"
+#include "cserve_cache.h"
+#include "cserve_fs.h"
+#include "cserve_meta.h"
+#include "cserve_metrics.h"
+#include "cserve_policy.h"
+#include "cserve_prefetch.h"
+#include "cserve_ssi.h"
+#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "error.h"
 
 
 /**
  * @brief Validate the path
- *
- * @param path The path to validate
- * @return SUCCESS on success, FAILURE on failure
  */
 int validate_path(const char *path) {
     // Check for null path
@@ -52,101 +69,490 @@ int validate_path(const char *path) {
     return SUCCESS;
 }
 
+/**
+ * @brief Read a whole file into memory
+ *
+ * Used as the cache loader and as the fallback when waiting on an
+ * in-flight load times out.
+ *
+ * @param key The cache key, unused
+ * @param ctx The request path of the file, resolved below the root
+ * @param data Set to a cserve_arena_alloc()ed, NUL terminated buffer holding the file
+ * @param size Set to the file size in bytes
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int load_file(const char *key, void *ctx, char **data, size_t *size) {
+    (void)key;
+    const char *path = ctx;
+
+    int fd = cserve_fs_open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: File not found: %s\n", path);
+        return FAILURE;
+    }
+
+    // Get the file size
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        printf("Error: Failed to get file size: %s\n", path);
+        return FAILURE;
+    }
+    size_t file_size = (size_t)st.st_size;
+
+    // Allocate memory for the file content
+    char *file_content = cserve_arena_alloc(file_size + 1);
+    if (file_content == NULL) {
+        close(fd);
+        printf("Error: Memory allocation failed\n");
+        return FAILURE;
+    }
+
+    // Read the file content
+    size_t total = 0;
+    while (total < file_size) {
+        ssize_t n = read(fd, file_content + total, file_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += (size_t)n;
+    }
+    close(fd);
+    if (total != file_size) {
+        cserve_arena_free(file_content);
+        printf("Error: Failed to read file (%zu bytes)\n", file_size);
+        return FAILURE;
+    }
+    file_content[file_size] = '\0';
+
+    *data = file_content;
+    *size = file_size;
+    return SUCCESS;
+}
+
+/**
+ * @brief Map a failed lookup below the root to a response
+ *
+ * Escapes rejected by the kernel (symlinks leaving the root, magic links)
+ * are reported as Forbidden, everything else that is missing as Not Found.
+ */
+static cserver_http_res_t *create_lookup_error_response(int err, const char *content_type) {
+    switch (err) {
+    case ENOENT:
+    case ENOTDIR:
+        return create_http_response(HTTP_STATUS_NOT_FOUND, content_type, "Not Found");
+    case EXDEV:
+    case ELOOP:
+    case EACCES:
+    case EPERM:
+        return create_http_response(HTTP_STATUS_FORBIDDEN, "text/plain", "Forbidden");
+    default:
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, "text/plain",
+                                    "Internal Server Error");
+    }
+}
+
+/**
+ * @brief Get the content type for a file based on its extension
+ */
+const char *cserve_get_content_type(const char *path) {
+    if (strstr(path, ".html") != NULL) {
+        return "text/html";
+    } else if (strstr(path, ".css") != NULL) {
+        return "text/css";
+    } else if (strstr(path, ".js") != NULL) {
+        return "application/javascript";
+    } else if (strstr(path, ".png") != NULL) {
+        return "image/png";
+    } else if (strstr(path, ".jpg") != NULL) {
+        return "image/jpeg";
+    } else if (strstr(path, ".jpeg") != NULL) {
+        return "image/jpeg";
+    } else if (strstr(path, ".ico") != NULL) {
+        return "image/x-icon";
+    }
+    return "text/plain";
+}
+
+/**
+ * @brief Resolve a directory path to its index file
+ *
+ * @param path Directory path ending with '/', the index file name is appended on success
+ * @param cap Size of the path buffer
+ * @param st Replaced by the index file's stat information on success
+ * @return SUCCESS if the directory has an index file, FAILURE with errno set otherwise
+ */
+static int resolve_index(char *path, size_t cap, struct stat *st) {
+    size_t len = strlen(path);
+    if (len + strlen(DIRECTORY_INDEX) >= cap) {
+        errno = ENAMETOOLONG;
+        return FAILURE;
+    }
+    strcpy(path + len, DIRECTORY_INDEX);
+
+    struct stat index_st;
+    if (cserve_fs_stat(path, &index_st) != SUCCESS) {
+        path[len] = '\0';
+        return FAILURE;
+    }
+    if (!S_ISREG(index_st.st_mode)) {
+        // Something that is not a file named like the index, same as having none
+        path[len] = '\0';
+        errno = ENOENT;
+        return FAILURE;
+    }
+    *st = index_st;
+    return SUCCESS;
+}
+
+/**
+ * @brief Redirect a directory request to the same path with a trailing slash
+ *
+ * @param path The directory path without the trailing slash
+ * @return cserver_http_res_t* The response
+ */
+static cserver_http_res_t *create_redirect_response(const char *path) {
+    cserver_http_res_t *response =
+        create_http_response(HTTP_STATUS_MOVED_PERMANENTLY, "text/plain", "Moved Permanently");
+    if (response != NULL) {
+        snprintf(response->location, sizeof(response->location), "%s/", path);
+    }
+    return response;
+}
+
+/**
+ * @brief Check whether an Accept header lists a media type
+ *
+ * Only exact matches count. Wildcard ranges are also sent by clients that
+ * cannot decode every image format.
+ *
+ * @param accept The Accept header value
+ * @param type The media type to look for
+ * @return 1 if the type is listed with a non-zero quality, 0 otherwise
+ */
+static int accepts_type(const char *accept, const char *type) {
+    size_t type_len = strlen(type);
+    const char *item = accept;
+    while (*item != '\0') {
+        while (*item == ' ' || *item == ',') {
+            item++;
+        }
+        const char *end = strchr(item, ',');
+        if (end == NULL) {
+            end = item + strlen(item);
+        }
+        if ((size_t)(end - item) >= type_len && strncasecmp(item, type, type_len) == 0 &&
+            (item[type_len] == ';' || item[type_len] == ' ' || item + type_len == end)) {
+            // "q=0" means the client explicitly does not want it
+            const char *q = strstr(item, "q=");
+            if (q == NULL || q > end || strtod(q + 2, NULL) > 0) {
+                return 1;
+            }
+        }
+        item = end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Pick the smallest image variant the client accepts
+ *
+ * @param req The request, its path is rewritten to the variant if one is chosen
+ * @param st The file's stat information, replaced by the variant's
+ * @param content_type The file's MIME type, replaced by the variant's
+ * @return 1 if variants of the file exist and the response depends on Accept, 0 otherwise
+ */
+static int negotiate_variant(cserver_http_req_t *req, struct stat *st, const char **content_type) {
+    if (strcmp(*content_type, "image/jpeg") != 0 && strcmp(*content_type, "image/png") != 0) {
+        return 0;
+    }
+
+    cserver_meta_variants_t variants;
+    cserve_meta_variants(req->path, &variants);
+    int any = 0;
+    int best = -1;
+    off_t best_size = st->st_size;
+    for (int i = 0; i < VARIANT_COUNT; i++) {
+        if (variants.size[i] < 0) {
+            continue;
+        }
+        any = 1;
+        if (variants.size[i] < best_size &&
+            accepts_type(req->accept, cserve_meta_variant_type(i))) {
+            best = i;
+            best_size = variants.size[i];
+        }
+    }
+    if (best < 0) {
+        return any;
+    }
+
+    char variant_path[sizeof(req->path)];
+    int len = snprintf(variant_path, sizeof(variant_path), "%s%s", req->path,
+                       cserve_meta_variant_suffix(best));
+    if (len < 0 || (size_t)len >= sizeof(variant_path)) {
+        return any;
+    }
+    // The variant may have gone away since it was looked up, then serve the original
+    struct stat variant_st;
+    if (cserve_fs_stat(variant_path, &variant_st) != SUCCESS || !S_ISREG(variant_st.st_mode)) {
+        return any;
+    }
+
+    cserve_metrics_inc(METRIC_VARIANTS_SERVED);
+    if (variant_st.st_size < st->st_size) {
+        cserve_metrics_add(METRIC_VARIANT_BYTES_SAVED,
+                           (unsigned long)(st->st_size - variant_st.st_size));
+    }
+    memcpy(req->path, variant_path, (size_t)len + 1);
+    *st = variant_st;
+    *content_type = cserve_meta_variant_type(best);
+    return 1;
+}
+
+/**
+ * @brief Send 103 Early Hints for a page whose linked assets are known
+ *
+ * Goes out before the page is read, so the browser fetches the stylesheets
+ * and scripts while a cold page is still coming off the disk.
+ *
+ * @param req The request for the page
+ * @param st The page's stat information
+ */
+static void send_early_hints(cserver_http_req_t *req, const struct stat *st) {
+    char links[512];
+    if (cserve_prefetch_links(req->path, st, links, sizeof(links)) != SUCCESS) {
+        return;
+    }
+    cserver_http_headers_t headers = {NULL, 0, 0, 0};
+    http_headers_add(&headers, "Link", links);
+    if (send_interim_response(req, HTTP_STATUS_EARLY_HINTS, &headers) == SUCCESS) {
+        cserve_metrics_inc(METRIC_EARLY_HINTS);
+    }
+    http_headers_free(&headers);
+}
+
 /**
  * @brief Handle a GET request
  *
  * @param req The request to handle
- * @param root_dir The root directory to serve
  * @return cserver_http_res_t* The response
 */
-cserver_http_res_t *cserve_get_handler(cserver_http_req_t *req, const char *root_dir) {
+cserver_http_res_t *cserve_get_handler(cserver_http_req_t *req) {
     // Check if the request is a GET request
     if (strcmp(req->method, "GET") != 0) {
         return create_http_response(HTTP_STATUS_METHOD_NOT_ALLOWED, "text/plain", "Method Not Allowed");
     }
 
-    // set the content type based on the file extension
-    char *content_type = "text/plain";
-
     // Check if the path is valid and there is no funny business going on
     if (validate_path(req->path) == FAILURE) {
         printf("Error: Invalid path: %s\n", req->path);
         return create_http_response(HTTP_STATUS_BAD_REQUEST, "text/plain", "Bad Request");
     }
 
-    // if path is "/", serve index.html
-    if (strcmp(req->path, "/") == 0) {
-        content_type = "text/html";
-        strncpy(req->path, "/index.html", sizeof(req->path) - 1);
-    } 
-    if (strstr(req->path, ".html") != NULL) {
-        content_type = "text/html";
-    } else if (strstr(req->path, ".css") != NULL) {
-        content_type = "text/css";
-    } else if (strstr(req->path, ".js") != NULL) {
-        content_type = "application/javascript";
-    } else if (strstr(req->path, ".png") != NULL) {
-        content_type = "image/png";
-    } else if (strstr(req->path, ".jpg") != NULL) {
-        content_type = "image/jpeg";
-    } else if (strstr(req->path, ".jpeg") != NULL) {
-        content_type = "image/jpeg";
-    } 
-    else if (strstr(req->path, ".ico") != NULL) {
-        content_type = "image/x-icon";
-    }
-
     printf("Path: %s\n", req->path);
-    printf("Content type: %s\n", content_type);
 
-    // Check if the requested file exists
-    char file_path[MAX_DIR_PATH_SIZE];
-    snprintf(file_path, sizeof(file_path), "%s%s", root_dir, req->path);
-    FILE *file = fopen(file_path, "r");
-    if (file == NULL) {
-        printf("Error: File not found: %s\n", file_path);
-        return create_http_response(HTTP_STATUS_NOT_FOUND, content_type, "Not Found");
+    // Paths missing from the site index cannot exist, answer without touching the disk
+    if (cserve_bloom_check(req->path) == FAILURE) {
+        cserve_metrics_inc(METRIC_BLOOM_FILTERED);
+        return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
     }
 
-    // Get the file size
-    fseek(file, 0, SEEK_END);
-    unsigned long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    // Check if the requested file exists, resolved below the root by the kernel
+    struct stat st;
+    if (cserve_fs_stat(req->path, &st) != SUCCESS) {
+        // Logging may change errno, it decides between 404 and 403
+        int err = errno;
+        printf("Error: File not found: %s\n", req->path);
+        return create_lookup_error_response(err, "text/plain");
+    }
 
-    // Allocate memory for the file content
-    char *file_content = malloc(file_size + 1);
-    if (file_content == NULL) {
-        fclose(file);
-        printf("Error: Memory allocation failed\n");
-        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, content_type, "Internal Server Error");
+    if (S_ISDIR(st.st_mode)) {
+        // Relative links in the index only work once the URL ends with a slash
+        if (req->path[strlen(req->path) - 1] != '/') {
+            return create_redirect_response(req->path);
+        }
+        struct stat dir_st = st;
+        if (resolve_index(req->path, sizeof(req->path), &st) != SUCCESS) {
+            if (errno != ENOENT) {
+                return create_lookup_error_response(errno, "text/plain");
+            }
+            if (!AUTOINDEX_ENABLED) {
+                return create_http_response(HTTP_STATUS_FORBIDDEN, "text/plain", "Forbidden");
+            }
+            return cserve_autoindex_response(req->path, &dir_st);
+        }
+    } else if (!S_ISREG(st.st_mode)) {
+        return create_http_response(HTTP_STATUS_NOT_FOUND, "text/plain", "Not Found");
     }
 
-    // Read the file content
-    size_t bytes_read = fread(file_content, file_size, 1, file);
-    if (bytes_read != 1) {
-        free(file_content);
-        fclose(file);
-        printf("Error: Failed to read file (read %zu of %ld bytes)\n", bytes_read, file_size);
-        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, content_type, "Internal Server Error");
+    // set the content type based on the file extension
+    const char *content_type = cserve_get_content_type(req->path);
+    printf("Content type: %s\n", content_type);
+    if (EARLY_HINTS_ENABLED && strcmp(content_type, "text/html") == 0) {
+        send_early_hints(req, &st);
     }
-    file_content[file_size] = '\0';
 
-    // Close the file
-    fclose(file);
+    // Modern browsers get a smaller AVIF/WebP encoding of the same image if one exists
+    int vary_accept = negotiate_variant(req, &st, &content_type);
 
-    // Create the HTTP response
-    cserver_http_res_t *response = create_http_response(HTTP_STATUS_OK, content_type, file_content);
+    cserver_http_res_t *response = create_http_response(HTTP_STATUS_OK, content_type, NULL);
     if (response == NULL) {
-        free(file_content);
         printf("Error: Failed to create HTTP response\n");
-        return NULL;
+        return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, content_type, "Internal Server Error");
     }
 
-    // Set the content length
-    response->content_length = file_size;
+    // Pages with includes are assembled from their cached template and fragments
+    if (SSI_ENABLED && strcmp(content_type, "text/html") == 0) {
+        if (cserve_ssi_append(response, req->path, &st) != SUCCESS) {
+            int err = errno;
+            printf("Error: Failed to load file: %s\n", req->path);
+            free_http_response(response);
+            return create_lookup_error_response(err, content_type);
+        }
+    } else {
+        // Get the file content, from the cache or streamed from disk for large files
+        cserver_http_segment_t segment;
+        if (cserve_get_file_segment(req->path, &st, &segment) != SUCCESS) {
+            int err = errno;
+            printf("Error: Failed to load file: %s\n", req->path);
+            free_http_response(response);
+            return create_lookup_error_response(err, content_type);
+        }
 
-    // Dont free the file content, it's now owned by the response
-    // Freeing it will be handled by free_http_response()
+        // The response shares the cache entry, it is not copied
+        int rv = http_response_append(response, segment.buf, segment.offset, segment.length);
+        cserve_buf_unref(segment.buf);
+        if (rv != SUCCESS) {
+            free_http_response(response);
+            printf("Error: Failed to create HTTP response\n");
+            return create_http_response(HTTP_STATUS_INTERNAL_SERVER_ERROR, content_type, "Internal Server Error");
+        }
+    }
+    // Shared caches must not hand this variant to clients that asked for something else
+    if (vary_accept) {
+        strncpy(response->vary, "Accept", sizeof(response->vary) - 1);
+    }
+    cserve_policy_apply(response, req->path);
+    // Get the page's stylesheets, scripts and images into the cache before the browser asks
+    if (strcmp(content_type, "text/html") == 0) {
+        cserve_prefetch_page(req->path, &st, response);
+    }
 
     return response;
-}
\ No newline at end of file
+}
+
+/**
+ * @brief Warm the cache for a path before it is requested
+ */
+int cserve_get_warm(const char *path) {
+    if (validate_path(path) == FAILURE) {
+        return FAILURE;
+    }
+    if (cserve_bloom_check(path) == FAILURE) {
+        return FAILURE;
+    }
+
+    struct stat st;
+    if (cserve_fs_stat(path, &st) != SUCCESS) {
+        return FAILURE;
+    }
+    // Same index resolution as the GET handler so the cache key matches
+    char index_path[sizeof(((cserver_http_req_t *)0)->path)];
+    if (S_ISDIR(st.st_mode)) {
+        snprintf(index_path, sizeof(index_path), "%s", path);
+        if (index_path[strlen(index_path) - 1] != '/' ||
+            resolve_index(index_path, sizeof(index_path), &st) != SUCCESS) {
+            return FAILURE;
+        }
+        path = index_path;
+    } else if (!S_ISREG(st.st_mode)) {
+        return FAILURE;
+    }
+
+    if (st.st_size > MAX_CACHE_OBJECT_SIZE) {
+        // Too big for the file cache, ask the kernel to read it ahead instead
+        int fd = cserve_fs_open(path, O_RDONLY);
+        if (fd < 0) {
+            return FAILURE;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+        return SUCCESS;
+    }
+
+    // Don't evict anything to make room, warming only fills free space
+    cserver_cache_stats_t stats;
+    cserve_cache_get_stats(&stats);
+    if (stats.bytes + (size_t)st.st_size > stats.budget) {
+        return FAILURE;
+    }
+
+    cserver_cache_entry_t *entry =
+        cserve_cache_acquire(path, &st.st_mtim, (size_t)st.st_size, load_file, (void *)path, NULL);
+    if (entry == NULL) {
+        return FAILURE;
+    }
+    cserve_cache_release(entry);
+    return SUCCESS;
+}
+
+/**
+ * @brief Drop the cache reference held by a body buffer
+ */
+static void release_cache_entry(void *ctx) {
+    cserve_cache_release(ctx);
+}
+
+/**
+ * @brief Free a directly loaded file held by a body buffer
+ */
+static void release_loaded(void *ctx) {
+    cserve_arena_free(ctx);
+}
+
+/**
+ * @brief Make a response body segment for a file without copying it
+ */
+int cserve_get_file_segment(const char *path, const struct stat *st,
+                            cserver_http_segment_t *segment) {
+    segment->buf = NULL;
+    segment->offset = 0;
+
+    // Large files skip the cache, the segment streams them straight from disk
+    if (st->st_size > LARGE_FILE_THRESHOLD) {
+        int fd = cserve_fs_open(path, O_RDONLY);
+        if (fd < 0) {
+            return FAILURE;
+        }
+        segment->buf = cserve_buf_file(fd, (size_t)st->st_size);
+        cserve_metrics_inc(METRIC_STREAMED_FILES);
+    } else {
+        // The buffer keeps its cache reference until the last response using it is sent
+        cserver_cache_result_t result;
+        cserver_cache_entry_t *entry = cserve_cache_acquire(path, &st->st_mtim, (size_t)st->st_size,
+                                                            load_file, (void *)path, &result);
+        char *loaded;
+        size_t size;
+        if (entry != NULL) {
+            segment->buf = cserve_buf_wrap(entry->data, entry->size, release_cache_entry, entry);
+        } else if (result != CACHE_RESULT_FALLBACK) {
+            errno = EIO;
+            return FAILURE;
+        } else if (load_file(path, (void *)path, &loaded, &size) == SUCCESS) {
+            // The in-flight load did not finish in time, we read the file ourselves
+            segment->buf = cserve_buf_wrap(loaded, size, release_loaded, loaded);
+        } else {
+            return FAILURE;
+        }
+    }
+    if (segment->buf == NULL) {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    segment->length = segment->buf->size;
+    return SUCCESS;
+}
@@ -0,0 +1,309 @@
+/**
+ * @file cserve_mem.c
+ * @brief Allocator for per-request memory
+ */
+
+#include "cserve_mem.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// defines
+#define MEM_MIN_CLASS_SIZE 16
+#define MEM_CLASS_COUNT 12 // 16 bytes to 32KB
+
+/**
+ * @brief A free block, linked through its first bytes
+ */
+typedef struct mem_block {
+    struct mem_block *next;
+} mem_block_t;
+
+/**
+ * @brief One thread's free lists
+ *
+ * Caches are never freed, blocks of an exited thread may still be freed
+ * back to its remote list and stay there.
+ */
+typedef struct {
+    mem_block_t *free_lists[MEM_CLASS_COUNT];
+    mem_block_t *remote; // freed by other threads, pushed and taken atomically
+} mem_cache_t;
+
+/**
+ * @brief Header in front of every block, keeps blocks 16 byte aligned
+ */
+typedef struct {
+    mem_cache_t *owner; // thread cache the block belongs to, NULL for malloc()ed blocks
+    size_t size;        // size asked for
+} mem_header_t;
+
+// globals
+static const cserver_mem_allocator_t *allocator =
+    MEM_SIZE_CLASSES_ENABLED ? &cserve_mem_size_classes : &cserve_mem_system;
+static __thread mem_cache_t *thread_cache;
+
+// Counters for the metrics output
+static unsigned long slab_bytes;
+static unsigned long class_in_use[MEM_CLASS_COUNT];
+static unsigned long requested_bytes;
+static unsigned long large_bytes;
+static unsigned long remote_frees;
+
+/**
+ * @brief Get the size class for a size, MEM_CLASS_COUNT if it has none
+ */
+static int size_class(size_t size) {
+    int c = 0;
+    size_t class_size = MEM_MIN_CLASS_SIZE;
+    while (class_size < size && c < MEM_CLASS_COUNT) {
+        class_size <<= 1;
+        c++;
+    }
+    return class_size <= MEM_MAX_CLASS_SIZE ? c : MEM_CLASS_COUNT;
+}
+
+/**
+ * @brief Size of the blocks in a class
+ */
+static size_t class_size(int c) {
+    return (size_t)MEM_MIN_CLASS_SIZE << c;
+}
+
+/**
+ * @brief Get the calling thread's cache, creating it on first use
+ */
+static mem_cache_t *get_cache(void) {
+    if (thread_cache == NULL) {
+        thread_cache = calloc(1, sizeof(mem_cache_t));
+    }
+    return thread_cache;
+}
+
+/**
+ * @brief Move blocks other threads freed back onto the free lists
+ */
+static void take_remote(mem_cache_t *cache) {
+    mem_block_t *block = __atomic_exchange_n(&cache->remote, NULL, __ATOMIC_ACQUIRE);
+    while (block != NULL) {
+        mem_block_t *next = block->next;
+        int c = size_class(((mem_header_t *)block - 1)->size);
+        block->next = cache->free_lists[c];
+        cache->free_lists[c] = block;
+        block = next;
+    }
+}
+
+/**
+ * @brief Carve a new slab into blocks of one class
+ */
+static int refill(mem_cache_t *cache, int c) {
+    size_t stride = sizeof(mem_header_t) + class_size(c);
+    char *slab = malloc(MEM_SLAB_SIZE);
+    if (slab == NULL) {
+        return FAILURE;
+    }
+    for (size_t offset = 0; offset + stride <= MEM_SLAB_SIZE; offset += stride) {
+        mem_header_t *header = (mem_header_t *)(slab + offset);
+        header->owner = cache;
+        header->size = class_size(c);
+        mem_block_t *block = (mem_block_t *)(header + 1);
+        block->next = cache->free_lists[c];
+        cache->free_lists[c] = block;
+    }
+    __atomic_add_fetch(&slab_bytes, MEM_SLAB_SIZE, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/**
+ * @brief Allocate a block too large for the size classes
+ */
+static void *large_alloc(size_t size) {
+    if (size > SIZE_MAX - sizeof(mem_header_t)) {
+        return NULL;
+    }
+    mem_header_t *header = malloc(sizeof(mem_header_t) + size);
+    if (header == NULL) {
+        return NULL;
+    }
+    header->owner = NULL;
+    header->size = size;
+    __atomic_add_fetch(&large_bytes, size, __ATOMIC_RELAXED);
+    return header + 1;
+}
+
+/**
+ * @brief Allocate from the calling thread's free lists
+ */
+static void *size_classes_alloc(size_t size) {
+    int c = size_class(size);
+    mem_cache_t *cache = c < MEM_CLASS_COUNT ? get_cache() : NULL;
+    if (cache == NULL) {
+        return large_alloc(size);
+    }
+    if (cache->free_lists[c] == NULL) {
+        take_remote(cache);
+    }
+    if (cache->free_lists[c] == NULL && refill(cache, c) != SUCCESS) {
+        return NULL;
+    }
+    mem_block_t *block = cache->free_lists[c];
+    cache->free_lists[c] = block->next;
+    mem_header_t *header = (mem_header_t *)block - 1;
+    header->size = size;
+    __atomic_add_fetch(&class_in_use[c], 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&requested_bytes, size, __ATOMIC_RELAXED);
+    return block;
+}
+
+/**
+ * @brief Return a block to its owner's free lists
+ */
+static void size_classes_free(void *ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+    mem_header_t *header = (mem_header_t *)ptr - 1;
+    if (header->owner == NULL) {
+        __atomic_sub_fetch(&large_bytes, header->size, __ATOMIC_RELAXED);
+        free(header);
+        return;
+    }
+
+    int c = size_class(header->size);
+    __atomic_sub_fetch(&class_in_use[c], 1, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&requested_bytes, header->size, __ATOMIC_RELAXED);
+    mem_block_t *block = ptr;
+    mem_cache_t *owner = header->owner;
+    if (owner == thread_cache) {
+        block->next = owner->free_lists[c];
+        owner->free_lists[c] = block;
+        return;
+    }
+    // Another thread's block, its owner picks it up the next time it runs dry
+    block->next = __atomic_load_n(&owner->remote, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&owner->remote, &block->next, block, 1, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED)) {
+    }
+    __atomic_add_fetch(&remote_frees, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Resize a block, in place if it stays in the same class
+ */
+static void *size_classes_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) {
+        return size_classes_alloc(size);
+    }
+    mem_header_t *header = (mem_header_t *)ptr - 1;
+    int c = size_class(size);
+    if (header->owner != NULL && c == size_class(header->size)) {
+        __atomic_add_fetch(&requested_bytes, size, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&requested_bytes, header->size, __ATOMIC_RELAXED);
+        header->size = size;
+        return ptr;
+    }
+    void *new_ptr = size_classes_alloc(size);
+    if (new_ptr == NULL) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, header->size < size ? header->size : size);
+    size_classes_free(ptr);
+    return new_ptr;
+}
+
+const cserver_mem_allocator_t cserve_mem_system = {"system", malloc, realloc, free};
+
+const cserver_mem_allocator_t cserve_mem_size_classes = {
+    "size-classes", size_classes_alloc, size_classes_realloc, size_classes_free};
+
+/**
+ * @brief Render the allocator's counters
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    cserve_metrics_appendf(buf, "cserv_mem_allocator{name=\"%s\"} 1\n", allocator->name);
+    if (allocator != &cserve_mem_size_classes) {
+        return;
+    }
+    unsigned long in_use_bytes = 0;
+    for (int c = 0; c < MEM_CLASS_COUNT; c++) {
+        unsigned long blocks = __atomic_load_n(&class_in_use[c], __ATOMIC_RELAXED);
+        cserve_metrics_appendf(buf, "cserv_mem_class_blocks_in_use{size=\"%zu\"} %lu\n",
+                               class_size(c), blocks);
+        in_use_bytes += blocks * class_size(c);
+    }
+    cserve_metrics_appendf(buf, "cserv_mem_slab_bytes %lu\n",
+                           __atomic_load_n(&slab_bytes, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_mem_in_use_bytes %lu\n", in_use_bytes);
+    cserve_metrics_appendf(buf, "cserv_mem_requested_bytes %lu\n",
+                           __atomic_load_n(&requested_bytes, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_mem_large_bytes %lu\n",
+                           __atomic_load_n(&large_bytes, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_mem_remote_frees_total %lu\n",
+                           __atomic_load_n(&remote_frees, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Replace the allocator
+ */
+void cserve_mem_set_allocator(const cserver_mem_allocator_t *new_allocator) {
+    allocator = new_allocator;
+}
+
+/**
+ * @brief Register the allocator's counters with the metrics output
+ */
+int cserve_mem_init(void) {
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Allocate memory
+ */
+void *cserve_mem_alloc(size_t size) {
+    return allocator->alloc(size);
+}
+
+/**
+ * @brief Allocate zeroed memory for an array
+ */
+void *cserve_mem_calloc(size_t nmemb, size_t size) {
+    if (size != 0 && nmemb > SIZE_MAX / size) {
+        return NULL;
+    }
+    void *ptr = allocator->alloc(nmemb * size);
+    if (ptr != NULL) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+/**
+ * @brief Resize memory from cserve_mem_alloc()
+ */
+void *cserve_mem_realloc(void *ptr, size_t size) {
+    return allocator->realloc(ptr, size);
+}
+
+/**
+ * @brief Copy a string into memory from cserve_mem_alloc()
+ */
+char *cserve_mem_strdup(const char *s) {
+    size_t len = strlen(s) + 1;
+    char *copy = allocator->alloc(len);
+    if (copy != NULL) {
+        memcpy(copy, s, len);
+    }
+    return copy;
+}
+
+/**
+ * @brief Free memory from cserve_mem_alloc() and friends
+ */
+void cserve_mem_free(void *ptr) {
+    allocator->free(ptr);
+}
@@ -0,0 +1,276 @@
+/**
+ * @file cserve_memory.c
+ * @brief Memory-pressure aware cache sizing
+ *
+ * The cache gets CACHE_MEMORY_PERCENT of the container's memory limit.
+ * Every MEMORY_POLL_MS the monitor samples the "some avg10" PSI value and
+ * the cgroup's anonymous memory. High pressure, or anonymous memory close
+ * to the limit, shrinks the budget by a quarter and returns freed arena
+ * pages to the kernel. After MEMORY_CALM_SAMPLES quiet samples in a row
+ * the budget grows back in small steps.
+ */
+
+// Define feature macros before including headers
+// These enable usleep
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_memory.h"
+#include "config.h"
+#include "cserve_arena.h"
+#include "cserve_cache.h"
+#include "cserve_metrics.h"
+#include "cserve_prof.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// defines
+#define CGROUP_ROOT "/sys/fs/cgroup"
+#define PROC_LINE_SIZE 256
+
+// globals
+static char cgroup_dir[MAX_DIR_PATH_SIZE + 16]; // empty outside a cgroup v2 hierarchy
+static size_t limit;                            // memory limit, 0 if unknown
+static const char *limit_source = "none";
+static size_t max_budget;
+
+// Last sample, written by the monitor thread, read by metrics
+static double pressure_avg10;
+static size_t anon_bytes;
+static unsigned long shrinks;
+static unsigned long grows;
+
+/**
+ * @brief Find our cgroup v2 directory from /proc/self/cgroup
+ *
+ * @return SUCCESS if found, FAILURE otherwise
+ */
+static int find_cgroup_dir(void) {
+    FILE *file = fopen("/proc/self/cgroup", "r");
+    if (file == NULL) {
+        return FAILURE;
+    }
+    char line[MAX_DIR_PATH_SIZE];
+    int rv = FAILURE;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        // The unified hierarchy is the "0::/path" line
+        if (strncmp(line, "0::", 3) == 0) {
+            line[strcspn(line, "\n")] = '\0';
+            snprintf(cgroup_dir, sizeof(cgroup_dir), "%s%s", CGROUP_ROOT,
+                     strcmp(line + 3, "/") == 0 ? "" : line + 3);
+            rv = SUCCESS;
+            break;
+        }
+    }
+    fclose(file);
+    return rv;
+}
+
+/**
+ * @brief Read a file from our cgroup directory into a buffer
+ *
+ * @return SUCCESS on success, FAILURE if the file does not exist
+ */
+static int read_cgroup_file(const char *name, char *buf, size_t size) {
+    if (cgroup_dir[0] == '\0') {
+        return FAILURE;
+    }
+    char path[sizeof(cgroup_dir) + 32];
+    snprintf(path, sizeof(path), "%s/%s", cgroup_dir, name);
+    FILE *file = fopen(path, "r");
+    if (file == NULL) {
+        return FAILURE;
+    }
+    size_t n = fread(buf, 1, size - 1, file);
+    buf[n] = '\0';
+    fclose(file);
+    return SUCCESS;
+}
+
+/**
+ * @brief Read a "Key: value kB" field from /proc/meminfo
+ *
+ * @return The value in bytes, 0 if not found
+ */
+static size_t read_meminfo(const char *key) {
+    FILE *file = fopen("/proc/meminfo", "r");
+    if (file == NULL) {
+        return 0;
+    }
+    char line[PROC_LINE_SIZE];
+    size_t key_len = strlen(key);
+    size_t value = 0;
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, key, key_len) == 0 && line[key_len] == ':') {
+            value = strtoull(line + key_len + 1, NULL, 10) * _KBYTE;
+            break;
+        }
+    }
+    fclose(file);
+    return value;
+}
+
+/**
+ * @brief Sample the PSI "some avg10" value, in percent
+ *
+ * Uses the cgroup's memory.pressure, or the system wide file outside a cgroup.
+ */
+static double read_pressure(void) {
+    char buf[PROC_LINE_SIZE];
+    if (read_cgroup_file("memory.pressure", buf, sizeof(buf)) == FAILURE) {
+        FILE *file = fopen("/proc/pressure/memory", "r");
+        if (file == NULL) {
+            return 0.0;
+        }
+        size_t n = fread(buf, 1, sizeof(buf) - 1, file);
+        buf[n] = '\0';
+        fclose(file);
+    }
+    double avg10 = 0.0;
+    if (sscanf(buf, "some avg10=%lf", &avg10) != 1) {
+        return 0.0;
+    }
+    return avg10;
+}
+
+/**
+ * @brief Sample the cgroup's anonymous memory from memory.stat
+ *
+ * Page cache is left out on purpose: the kernel reclaims it on its own, and
+ * a file server's cgroup is always close to its limit counting it.
+ */
+static size_t read_anon(void) {
+    char buf[4 * _KBYTE];
+    if (read_cgroup_file("memory.stat", buf, sizeof(buf)) == FAILURE) {
+        return 0;
+    }
+    // "anon" is the first line of memory.stat
+    size_t value = 0;
+    if (strncmp(buf, "anon ", 5) == 0) {
+        value = strtoull(buf + 5, NULL, 10);
+    }
+    return value;
+}
+
+/**
+ * @brief Work out the largest cache budget for this container
+ */
+size_t cserve_memory_max_budget(void) {
+    char buf[PROC_LINE_SIZE];
+    if (find_cgroup_dir() == SUCCESS &&
+        read_cgroup_file("memory.max", buf, sizeof(buf)) == SUCCESS && strncmp(buf, "max", 3) != 0) {
+        limit = strtoull(buf, NULL, 10);
+        limit_source = "cgroup";
+    }
+    if (limit == 0) {
+        limit = read_meminfo("MemAvailable");
+        limit_source = limit > 0 ? "meminfo" : "none";
+    }
+
+    if (limit == 0) {
+        max_budget = DEFAULT_CACHE_BUDGET;
+    } else {
+        max_budget = limit / 100 * CACHE_MEMORY_PERCENT;
+    }
+    if (max_budget < MIN_CACHE_BUDGET) {
+        max_budget = MIN_CACHE_BUDGET;
+    }
+    if (max_budget > MAX_CACHE_BUDGET) {
+        max_budget = MAX_CACHE_BUDGET;
+    }
+    printf("Cache budget: %zu MB (%s limit %zu MB)\n", max_budget / _MBYTE, limit_source,
+           limit / _MBYTE);
+    return max_budget;
+}
+
+/**
+ * @brief Background thread that adjusts the cache budget to memory pressure
+ */
+static void *monitor_thread(void *arg) {
+    (void)arg;
+    cserve_prof_register_thread();
+    int calm_samples = 0;
+
+    while (1) {
+        usleep(MEMORY_POLL_MS * 1000);
+
+        double avg10 = read_pressure();
+        size_t anon = read_anon();
+        __atomic_store(&pressure_avg10, &avg10, __ATOMIC_RELAXED);
+        __atomic_store_n(&anon_bytes, anon, __ATOMIC_RELAXED);
+
+        cserver_cache_stats_t stats;
+        cserve_cache_get_stats(&stats);
+        size_t budget = stats.budget;
+
+        int near_limit = strcmp(limit_source, "cgroup") == 0 &&
+                         anon / MEMORY_ANON_HIGH_PERCENT >= limit / 100;
+        if (avg10 >= MEMORY_PSI_HIGH || near_limit) {
+            calm_samples = 0;
+            size_t target = budget - budget / 4;
+            if (target < MIN_CACHE_BUDGET) {
+                target = MIN_CACHE_BUDGET;
+            }
+            if (target < budget) {
+                printf("Memory pressure (avg10 %.2f, anon %zu MB), cache budget %zu -> %zu MB\n",
+                       avg10, anon / _MBYTE, budget / _MBYTE, target / _MBYTE);
+                cserve_cache_set_budget(target, CACHE_EVICT_PRESSURE);
+                __atomic_add_fetch(&shrinks, 1, __ATOMIC_RELAXED);
+            }
+            // Evicted objects went back to the arena, give their pages to the kernel
+            cserve_arena_release_free();
+        } else if (avg10 < MEMORY_PSI_LOW) {
+            calm_samples++;
+            if (calm_samples >= MEMORY_CALM_SAMPLES && budget < max_budget) {
+                size_t target = budget + max_budget / 16;
+                if (target > max_budget) {
+                    target = max_budget;
+                }
+                cserve_cache_set_budget(target, CACHE_EVICT_CAPACITY);
+                __atomic_add_fetch(&grows, 1, __ATOMIC_RELAXED);
+                calm_samples = 0;
+            }
+        } else {
+            calm_samples = 0;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Render the memory section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    double avg10;
+    __atomic_load(&pressure_avg10, &avg10, __ATOMIC_RELAXED);
+    cserve_metrics_appendf(buf, "cserv_memory_limit_bytes{source=\"%s\"} %zu\n", limit_source,
+                           limit);
+    cserve_metrics_appendf(buf, "cserv_memory_anon_bytes %zu\n",
+                           __atomic_load_n(&anon_bytes, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_memory_pressure_some_avg10 %.2f\n", avg10);
+    cserve_metrics_appendf(buf, "cserv_cache_budget_max_bytes %zu\n", max_budget);
+    cserve_metrics_appendf(buf, "cserv_cache_budget_shrinks_total %lu\n",
+                           __atomic_load_n(&shrinks, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_cache_budget_grows_total %lu\n",
+                           __atomic_load_n(&grows, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Start watching memory pressure
+ */
+int cserve_memory_init(void) {
+    if (cserve_metrics_register(render_metrics) == FAILURE) {
+        return FAILURE;
+    }
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, monitor_thread, NULL) != 0) {
+        printf("Error: Failed to start memory pressure monitor\n");
+        return FAILURE;
+    }
+    pthread_detach(thread);
+    return SUCCESS;
+}
@@ -0,0 +1,157 @@
+/**
+ * @file cserve_meta.c
+ * @brief File metadata cache for content negotiation
+ *
+ * A direct-mapped table keyed by request path. A colliding path simply
+ * replaces the slot, the cost of a miss is a few stat() calls.
+ */
+
+#include "cserve_meta.h"
+#include "config.h"
+#include "cserve_bloom.h"
+#include "cserve_fs.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
+// defines
+#define META_SLOTS 1024
+#define META_KEY_SIZE 256
+
+/**
+ * @brief One cached lookup
+ */
+typedef struct {
+    char path[META_KEY_SIZE]; // empty if the slot is unused
+    unsigned long generation; // site index generation the lookup was made in
+    time_t checked;           // when the lookup was made
+    cserver_meta_variants_t variants;
+} meta_slot_t;
+
+/**
+ * @brief Description of one variant
+ */
+typedef struct {
+    const char *suffix;
+    const char *type;
+} variant_info_t;
+
+// globals
+static meta_slot_t slots[META_SLOTS];
+static pthread_mutex_t meta_lock = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long hits;
+static unsigned long misses;
+
+// Variant descriptions, indexed by cserver_variant_t
+static const variant_info_t variant_info[VARIANT_COUNT] = {
+    {".avif", "image/avif"},
+    {".webp", "image/webp"},
+};
+
+/**
+ * @brief FNV-1a hash of a path
+ */
+static unsigned long hash_path(const char *path) {
+    unsigned long hash = 2166136261UL;
+    for (const char *p = path; *p; p++) {
+        hash ^= (unsigned char)*p;
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Stat every variant of a file
+ */
+static void lookup_variants(const char *path, cserver_meta_variants_t *variants) {
+    char variant_path[MAX_DIR_PATH_SIZE];
+    for (int i = 0; i < VARIANT_COUNT; i++) {
+        variants->size[i] = -1;
+        int len =
+            snprintf(variant_path, sizeof(variant_path), "%s%s", path, variant_info[i].suffix);
+        if (len < 0 || (size_t)len >= sizeof(variant_path)) {
+            continue;
+        }
+        // Most images have no variants, the site index usually knows without a syscall
+        if (cserve_bloom_check(variant_path) == FAILURE) {
+            continue;
+        }
+        struct stat st;
+        if (cserve_fs_stat(variant_path, &st) == SUCCESS && S_ISREG(st.st_mode)) {
+            variants->size[i] = st.st_size;
+        }
+    }
+}
+
+/**
+ * @brief Render the metadata cache section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    cserve_metrics_appendf(buf, "cserv_meta_hits_total %lu\n",
+                           __atomic_load_n(&hits, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_meta_misses_total %lu\n",
+                           __atomic_load_n(&misses, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Initialize the metadata cache
+ */
+int cserve_meta_init(void) {
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Look up which variants of a file exist
+ */
+void cserve_meta_variants(const char *path, cserver_meta_variants_t *variants) {
+    unsigned long generation = 0;
+    int watched = cserve_bloom_generation(&generation) == SUCCESS;
+    time_t now = time(NULL);
+
+    if (strlen(path) >= META_KEY_SIZE) {
+        // Too long to cache, look it up every time
+        __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+        lookup_variants(path, variants);
+        return;
+    }
+
+    meta_slot_t *slot = &slots[hash_path(path) % META_SLOTS];
+    pthread_mutex_lock(&meta_lock);
+    if (strcmp(slot->path, path) == 0 &&
+        (watched ? slot->generation == generation : now - slot->checked < META_TTL_SECONDS)) {
+        *variants = slot->variants;
+        pthread_mutex_unlock(&meta_lock);
+        __atomic_add_fetch(&hits, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    pthread_mutex_unlock(&meta_lock);
+
+    // Stat outside the lock, a concurrent miss on the same path just does the work twice
+    __atomic_add_fetch(&misses, 1, __ATOMIC_RELAXED);
+    lookup_variants(path, variants);
+
+    pthread_mutex_lock(&meta_lock);
+    snprintf(slot->path, sizeof(slot->path), "%s", path);
+    slot->generation = generation;
+    slot->checked = now;
+    slot->variants = *variants;
+    pthread_mutex_unlock(&meta_lock);
+}
+
+/**
+ * @brief Get the file name suffix of a variant
+ */
+const char *cserve_meta_variant_suffix(cserver_variant_t variant) {
+    return variant_info[variant].suffix;
+}
+
+/**
+ * @brief Get the MIME type of a variant
+ */
+const char *cserve_meta_variant_type(cserver_variant_t variant) {
+    return variant_info[variant].type;
+}
@@ -0,0 +1,129 @@
+/**
+ * @file cserve_metrics.c
+ * @brief Server counters and metrics rendering
+ */
+
+#include "cserve_metrics.h"
+#include "error.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// defines
+#define MAX_METRICS_SECTIONS 16
+#define METRICS_BUFFER_SIZE 4096
+
+// globals
+static unsigned long counters[METRIC_COUNT];
+static cserver_metrics_section_t sections[MAX_METRICS_SECTIONS];
+static int num_sections;
+
+// Counter names, indexed by cserver_metric_t
+static const char *counter_names[METRIC_COUNT] = {
+    "cserv_requests_total",
+    "cserv_bloom_filtered_total",
+    "cserv_streamed_files_total",
+    "cserv_streamed_bytes_total",
+    "cserv_variants_served_total",
+    "cserv_variant_bytes_saved_total",
+    "cserv_bundles_served_total",
+    "cserv_bundle_parts_total",
+    "cserv_early_hints_total",
+    "cserv_query_params_dropped_total",
+    "cserv_fcgi_requests_total",
+    "cserv_fcgi_errors_total",
+    "cserv_fcgi_respawns_total",
+    "cserv_ssi_pages_total",
+    "cserv_ssi_includes_total",
+};
+
+/**
+ * @brief Increment a counter by one
+ */
+void cserve_metrics_inc(cserver_metric_t metric) {
+    __atomic_add_fetch(&counters[metric], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Add a value to a counter
+ */
+void cserve_metrics_add(cserver_metric_t metric, unsigned long value) {
+    __atomic_add_fetch(&counters[metric], value, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Register a module specific section of the metrics output
+ *
+ * Sections are registered once during init, before any request is served.
+ */
+int cserve_metrics_register(cserver_metrics_section_t section) {
+    if (num_sections >= MAX_METRICS_SECTIONS) {
+        printf("Error: Too many metrics sections\n");
+        return FAILURE;
+    }
+    sections[num_sections++] = section;
+    return SUCCESS;
+}
+
+/**
+ * @brief Append formatted text to a metrics buffer
+ *
+ * Grows the buffer as needed. On allocation failure the text is dropped.
+ */
+int cserve_metrics_appendf(cserver_metrics_buf_t *buf, const char *fmt, ...) {
+    if (buf->data == NULL) {
+        return FAILURE;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int needed = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+    va_end(args);
+    if (needed < 0) {
+        buf->data[buf->len] = '\0';
+        return FAILURE;
+    }
+
+    if ((size_t)needed >= buf->cap - buf->len) {
+        // Not enough room, grow and format again
+        size_t new_cap = buf->cap * 2;
+        while (new_cap - buf->len <= (size_t)needed) {
+            new_cap *= 2;
+        }
+        char *new_data = realloc(buf->data, new_cap);
+        if (new_data == NULL) {
+            buf->data[buf->len] = '\0';
+            return FAILURE;
+        }
+        buf->data = new_data;
+        buf->cap = new_cap;
+        va_start(args, fmt);
+        vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, args);
+        va_end(args);
+    }
+    buf->len += needed;
+    return SUCCESS;
+}
+
+/**
+ * @brief Render all counters and registered sections
+ */
+char *cserve_metrics_render(void) {
+    cserver_metrics_buf_t buf;
+    buf.len = 0;
+    buf.cap = METRICS_BUFFER_SIZE;
+    buf.data = malloc(buf.cap);
+    if (buf.data == NULL) {
+        printf("Error: Memory allocation failed for metrics\n");
+        return NULL;
+    }
+    buf.data[0] = '\0';
+
+    for (int i = 0; i < METRIC_COUNT; i++) {
+        cserve_metrics_appendf(&buf, "%s %lu\n", counter_names[i],
+                               __atomic_load_n(&counters[i], __ATOMIC_RELAXED));
+    }
+    for (int i = 0; i < num_sections; i++) {
+        sections[i](&buf);
+    }
+    return buf.data;
+}
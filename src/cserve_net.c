@@ -7,16 +7,19 @@
  */
 
 // Define feature macros before including headers
-// These enable POSIX functions like strncasecmp and strdup
+// These enable POSIX functions like strncasecmp and strtok_r
 #define _GNU_SOURCE
 #define _POSIX_C_SOURCE 200809L
 
 #include "cserve_net.h"
+#include "cserve_mem.h"
+#include "error.h"
 #include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h> // For strncasecmp
+#include <sys/socket.h>
 #include <time.h>    // For time functions
 
 /*
@@ -102,10 +105,14 @@ static int extract_header_value(const char *line, const char *header_name, char
         return 0; // Not the header we're looking for
     }
 
-    // Look for the colon separator
-    const char *colon = strchr(line, ':');
-    if (colon == NULL) {
-        return 0; // Malformed header line
+    // Look for the colon separator, right after the name so "Accept" does not match
+    // "Accept-Encoding"
+    const char *colon = line + header_len;
+    while (*colon == ' ' || *colon == '\t') {
+        colon++;
+    }
+    if (*colon != ':') {
+        return 0; // A different header that starts with the same name, or malformed
     }
 
     // Extract the value part (everything after the colon)
@@ -133,14 +140,14 @@ static int extract_header_value(const char *line, const char *header_name, char
  * @param raw_request The complete HTTP request text
  * @return Pointer to parsed request structure, or NULL if parsing failed
  */
-cserver_http_req_t *parse_http_request(const char *raw_request) {
+cserver_http_req_t *parse_http_request(const char *raw_request, size_t length) {
     if (raw_request == NULL) {
         printf("Error: Raw request is NULL\n");
         return NULL;
     }
 
     // Allocate memory for the parsed request structure
-    cserver_http_req_t *req = malloc(sizeof(cserver_http_req_t));
+    cserver_http_req_t *req = cserve_mem_alloc(sizeof(cserver_http_req_t));
     if (req == NULL) {
         printf("Error: Memory allocation failed\n");
         return NULL; // Memory allocation failed
@@ -148,11 +155,12 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
 
     // Initialize all fields to empty strings
     memset(req, 0, sizeof(cserver_http_req_t));
+    req->client_fd = -1;
 
     // Create a working copy of the request since we'll modify it
-    char *request_copy = strdup(raw_request);
+    char *request_copy = cserve_mem_strdup(raw_request);
     if (request_copy == NULL) {
-        free(req);
+        cserve_mem_free(req);
         printf("Error: Memory allocation failed\n");
         return NULL; // Memory allocation failed
     }
@@ -162,8 +170,8 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
     char *saveptr1; // State pointer for line tokenization
     char *line = strtok_r(request_copy, "\r\n", &saveptr1);
     if (line == NULL) {
-        free(req);
-        free(request_copy);
+        cserve_mem_free(req);
+        cserve_mem_free(request_copy);
         printf("Error: Empty request\n");
         return NULL; // Empty request
     }
@@ -177,8 +185,8 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
     char *version = strtok_r(NULL, " ", &saveptr2);
 
     if (method == NULL || path == NULL || version == NULL) {
-        free(req);
-        free(request_copy);
+        cserve_mem_free(req);
+        cserve_mem_free(request_copy);
         printf("Error: Malformed request line - missing method, path, or version\n");
         return NULL; // Malformed request line
     }
@@ -186,8 +194,16 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
     // Copy the parsed values to our structure
     strncpy(req->method, method, sizeof(req->method) - 1);
     strncpy(req->path, path, sizeof(req->path) - 1);
+    strncpy(req->target, path, sizeof(req->target) - 1);
     strncpy(req->version, version, sizeof(req->version) - 1);
 
+    // Split off the query string, handlers look at the path alone
+    char *query = strchr(req->path, '?');
+    if (query != NULL) {
+        *query = '\0';
+        strncpy(req->query, query + 1, sizeof(req->query) - 1);
+    }
+
     // STEP 2: Parse the header lines
     // Continue reading lines until we hit an empty line or end of request
     while ((line = strtok_r(NULL, "\r\n", &saveptr1)) != NULL && strlen(line) > 0) {
@@ -213,15 +229,50 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
             continue;
         }
 
+        if (extract_header_value(line, "If-None-Match", req->if_none_match,
+                                 sizeof(req->if_none_match))) {
+            // If-None-Match header found and extracted
+            continue;
+        }
+
+        if (extract_header_value(line, "Content-Type", req->content_type,
+                                 sizeof(req->content_type))) {
+            // Content-Type header found and extracted
+            continue;
+        }
+
+        char length[32];
+        if (extract_header_value(line, "Content-Length", length, sizeof(length))) {
+            // Content-Length header found, the body itself is picked up below
+            req->content_length = strtoul(length, NULL, 10);
+            continue;
+        }
+
         // If we reach here, it's a header we don't care about, so we ignore it
     }
 
     // Clean up the working copy
-    free(request_copy);
+    cserve_mem_free(request_copy);
+
+    // STEP 3: Copy the body, it starts after the empty line that ends the headers
+    const char *body = strstr(raw_request, "\r\n\r\n");
+    if (body != NULL && req->content_length > 0) {
+        body += 4;
+        size_t body_len = length - (size_t)(body - raw_request);
+        if (body_len > req->content_length) {
+            body_len = req->content_length;
+        }
+        if (body_len > sizeof(req->body) - 1) {
+            body_len = sizeof(req->body) - 1;
+        }
+        memcpy(req->body, body, body_len);
+        req->body[body_len] = '\0';
+        req->body_len = body_len;
+    }
 
     // Basic validation: we must have at least method and path
     if (strlen(req->method) == 0 || strlen(req->path) == 0) {
-        free(req);
+        cserve_mem_free(req);
         printf("Error: Invalid request - empty method or path\n");
         return NULL; // Invalid request
     }
@@ -240,12 +291,20 @@ cserver_http_req_t *parse_http_request(const char *raw_request) {
  */
 static const char *get_status_message(cserver_http_status_t status_code) {
     switch (status_code) {
+    case HTTP_STATUS_EARLY_HINTS:
+        return "Early Hints";
     case HTTP_STATUS_OK:
         return "OK";
     case HTTP_STATUS_CREATED:
         return "Created";
     case HTTP_STATUS_NO_CONTENT:
         return "No Content";
+    case HTTP_STATUS_MOVED_PERMANENTLY:
+        return "Moved Permanently";
+    case HTTP_STATUS_FOUND:
+        return "Found";
+    case HTTP_STATUS_NOT_MODIFIED:
+        return "Not Modified";
     case HTTP_STATUS_BAD_REQUEST:
         return "Bad Request";
     case HTTP_STATUS_UNAUTHORIZED:
@@ -256,10 +315,14 @@ static const char *get_status_message(cserver_http_status_t status_code) {
         return "Not Found";
     case HTTP_STATUS_METHOD_NOT_ALLOWED:
         return "Method Not Allowed";
+    case HTTP_STATUS_PAYLOAD_TOO_LARGE:
+        return "Payload Too Large";
     case HTTP_STATUS_INTERNAL_SERVER_ERROR:
         return "Internal Server Error";
     case HTTP_STATUS_NOT_IMPLEMENTED:
         return "Not Implemented";
+    case HTTP_STATUS_BAD_GATEWAY:
+        return "Bad Gateway";
     case HTTP_STATUS_SERVICE_UNAVAILABLE:
         return "Service Unavailable";
     default:
@@ -267,6 +330,85 @@ static const char *get_status_message(cserver_http_status_t status_code) {
     }
 }
 
+/**
+ * @brief Append raw bytes to a header buffer
+ */
+void http_headers_append(cserver_http_headers_t *headers, const char *data, size_t len) {
+    if (headers->failed || len == 0) {
+        return;
+    }
+    if (headers->len + len >= headers->cap) {
+        size_t cap = headers->cap > 0 ? headers->cap : 256;
+        while (headers->len + len >= cap) {
+            cap *= 2;
+        }
+        char *new_data = cserve_mem_realloc(headers->data, cap);
+        if (new_data == NULL) {
+            printf("Error: Memory allocation failed for HTTP headers\n");
+            headers->failed = 1;
+            return;
+        }
+        headers->data = new_data;
+        headers->cap = cap;
+    }
+    memcpy(headers->data + headers->len, data, len);
+    headers->len += len;
+    headers->data[headers->len] = '\0';
+}
+
+/**
+ * @brief Append a decimal number to a header buffer
+ *
+ * Digits are produced from the end of a small buffer, no format string.
+ */
+void http_headers_append_uint(cserver_http_headers_t *headers, unsigned long long value) {
+    char digits[20]; // enough for 2^64 - 1
+    char *p = digits + sizeof(digits);
+    do {
+        *--p = (char)('0' + value % 10);
+        value /= 10;
+    } while (value > 0);
+    http_headers_append(headers, p, (size_t)(digits + sizeof(digits) - p));
+}
+
+/**
+ * @brief Append a "name: value" header line
+ */
+void http_headers_add(cserver_http_headers_t *headers, const char *name, const char *value) {
+    http_headers_append(headers, name, strlen(name));
+    HTTP_HEADERS_APPEND_LITERAL(headers, ": ");
+    http_headers_append(headers, value, strlen(value));
+    HTTP_HEADERS_APPEND_LITERAL(headers, "\r\n");
+}
+
+/**
+ * @brief Free a header buffer's memory and reset it for reuse
+ */
+void http_headers_free(cserver_http_headers_t *headers) {
+    cserve_mem_free(headers->data);
+    headers->data = NULL;
+    headers->len = 0;
+    headers->cap = 0;
+    headers->failed = 0;
+}
+
+/**
+ * @brief Append a header line unless its value is empty
+ */
+static void append_header(cserver_http_headers_t *out, const char *name, size_t name_len,
+                          const char *value) {
+    if (value[0] == '\0') {
+        return;
+    }
+    http_headers_append(out, name, name_len);
+    http_headers_append(out, value, strlen(value));
+    HTTP_HEADERS_APPEND_LITERAL(out, "\r\n");
+}
+
+// Append a header line whose name is a literal, skipped if the value is empty
+#define APPEND_HEADER(out, name, value)                                                           \
+    append_header((out), name ": ", sizeof(name ": ") - 1, (value))
+
 /**
  * @brief Create a default HTTP response with common headers populated
  *
@@ -281,7 +423,7 @@ cserver_http_res_t *create_http_response(cserver_http_status_t status_code,
     }
 
     // Allocate memory for the response structure
-    cserver_http_res_t *response = malloc(sizeof(cserver_http_res_t));
+    cserver_http_res_t *response = cserve_mem_alloc(sizeof(cserver_http_res_t));
     if (response == NULL) {
         printf("Error: Memory allocation failed for HTTP response structure\n");
         return NULL; // Memory allocation failed
@@ -313,28 +455,76 @@ cserver_http_res_t *create_http_response(cserver_http_status_t status_code,
     // Set connection to close (simple approach for now)
     strncpy(response->connection, "close", sizeof(response->connection) - 1);
 
-    // Handle the body content
+    // Copy the body content into a buffer of its own
     if (body != NULL) {
-        // Calculate content length
-        response->content_length = strlen(body);
-
-        // Allocate and copy the body
-        response->body = malloc(response->content_length + 1);
-        if (response->body == NULL) {
-            free(response);
+        char *data;
+        cserver_buf_t *buf = cserve_buf_alloc(strlen(body), &data);
+        if (buf == NULL || http_response_append(response, buf, 0, buf->size) != SUCCESS) {
+            cserve_buf_unref(buf);
+            free_http_response(response);
             printf("Error: Memory allocation failed for HTTP response body\n");
             return NULL; // Memory allocation failed
         }
-        strcpy(response->body, body);
-    } else {
-        // No body content
-        response->content_length = 0;
-        response->body = NULL;
+        strcpy(data, body);
+        cserve_buf_unref(buf);
     }
 
     return response;
 }
 
+/**
+ * @brief Add a header without a field of its own to a response
+ */
+int http_response_add_header(cserver_http_res_t *response, const char *name, const char *value) {
+    http_headers_add(&response->headers, name, value);
+    return response->headers.failed ? FAILURE : SUCCESS;
+}
+
+/**
+ * @brief Append a byte range of a buffer to a response body
+ */
+int http_response_append(cserver_http_res_t *response, cserver_buf_t *buf, size_t offset,
+                         size_t length) {
+    if (response->num_segments == response->segments_cap) {
+        size_t cap = response->segments_cap > 0 ? 2 * response->segments_cap : 4;
+        cserver_http_segment_t *segments =
+            cserve_mem_realloc(response->segments, cap * sizeof(cserver_http_segment_t));
+        if (segments == NULL) {
+            printf("Error: Memory allocation failed for HTTP response segments\n");
+            return FAILURE;
+        }
+        response->segments = segments;
+        response->segments_cap = cap;
+    }
+    cserver_http_segment_t *segment = &response->segments[response->num_segments++];
+    segment->buf = cserve_buf_ref(buf);
+    segment->offset = offset;
+    segment->length = length;
+    response->content_length += length;
+    return SUCCESS;
+}
+
+/**
+ * @brief Create a response whose body is generated while it is sent
+ */
+cserver_http_res_t *create_streaming_response(cserver_http_status_t status_code,
+                                              const char *content_type,
+                                              cserver_http_producer_t producer, void *ctx,
+                                              void (*release)(void *ctx)) {
+    cserver_http_res_t *response = create_http_response(status_code, content_type, NULL);
+    if (response == NULL) {
+        if (release != NULL) {
+            release(ctx);
+        }
+        return NULL;
+    }
+    response->content_length = HTTP_CONTENT_LENGTH_UNKNOWN;
+    response->producer = producer;
+    response->producer_ctx = ctx;
+    response->producer_release = release;
+    return response;
+}
+
 /**
  * @brief Convert HTTP response structure to byte stream for transmission
  *
@@ -347,60 +537,83 @@ char *http_response_to_string(const cserver_http_res_t *response) {
         return NULL;
     }
 
-    // Calculate the size needed for the complete response
-    // Headers typically need about 300-500 bytes, plus body length
-    size_t header_size = 512;
-    size_t total_size = header_size + response->content_length + 1;
-
-    // Allocate memory for the complete response string
-    char *response_str = malloc(total_size);
-    if (response_str == NULL) {
+    // Headers typically need about 300-500 bytes, start big enough for most responses
+    cserver_http_headers_t out = {NULL, 0, 0, 0};
+    out.cap = 512 + response->headers.len;
+    out.data = cserve_mem_alloc(out.cap);
+    if (out.data == NULL) {
         printf("Error: Memory allocation failed for HTTP response string\n");
         return NULL; // Memory allocation failed
     }
 
-    // Format the HTTP response according to protocol
     // Status line: HTTP/1.1 200 OK\r\n
-    int written = snprintf(response_str, total_size,
-                           "%s %d %s\r\n"
-                           "Date: %s\r\n"
-                           "Server: %s\r\n"
-                           "Content-Type: %s\r\n"
-                           "Content-Length: %zu\r\n"
-                           "Connection: %s\r\n"
-                           "\r\n", // Empty line separates headers from body
-                           response->version, response->status_code, response->status_message,
-                           response->date, response->server, response->content_type,
-                           response->content_length, response->connection);
-
-    // Check if header formatting was successful
-    if (written < 0 || (size_t)written >= header_size) {
-        free(response_str);
-        printf("Error: HTTP response header formatting failed or buffer too small\n");
-        return NULL; // Formatting error or buffer too small
-    }
-
-
-    // Append the body content if it exists
-    if (response->body != NULL && response->content_length > 0) {
-        // Make sure we have enough space
-        if ((size_t)written + response->content_length >= total_size) {
-            free(response_str);
-            printf("Error: Not enough buffer space for HTTP response body\n");
-            return NULL; // Not enough space
-        }
+    http_headers_append(&out, response->version, strlen(response->version));
+    HTTP_HEADERS_APPEND_LITERAL(&out, " ");
+    http_headers_append_uint(&out, (unsigned long long)response->status_code);
+    HTTP_HEADERS_APPEND_LITERAL(&out, " ");
+    http_headers_append(&out, response->status_message, strlen(response->status_message));
+    HTTP_HEADERS_APPEND_LITERAL(&out, "\r\n");
+
+    APPEND_HEADER(&out, "Date", response->date);
+    APPEND_HEADER(&out, "Server", response->server);
+    APPEND_HEADER(&out, "Content-Type", response->content_type);
+
+    // Bodies of unknown length are chunked, or delimited by closing the connection
+    if (response->content_length != HTTP_CONTENT_LENGTH_UNKNOWN) {
+        HTTP_HEADERS_APPEND_LITERAL(&out, "Content-Length: ");
+        http_headers_append_uint(&out, (unsigned long long)response->content_length);
+        HTTP_HEADERS_APPEND_LITERAL(&out, "\r\n");
+    } else if (response->chunked) {
+        HTTP_HEADERS_APPEND_LITERAL(&out, "Transfer-Encoding: chunked\r\n");
+    }
+    APPEND_HEADER(&out, "Connection", response->connection);
+
+    // Optional headers, omitted if empty
+    APPEND_HEADER(&out, "Location", response->location);
+    APPEND_HEADER(&out, "Vary", response->vary);
+    if (response->cache_control != NULL) {
+        http_headers_append(&out, response->cache_control, strlen(response->cache_control));
+    }
+    APPEND_HEADER(&out, "Expires", response->expires);
+    APPEND_HEADER(&out, "ETag", response->etag);
+    APPEND_HEADER(&out, "Link", response->link);
+    http_headers_append(&out, response->headers.data, response->headers.len);
 
-        printf("Response created\n");
-        printf("Debug: total size: %lu\n", total_size);
-        printf("Debug: written: %d\n", written);
-        printf("Debug: content length: %ld\n", response->content_length);
+    // Empty line separates headers from body
+    HTTP_HEADERS_APPEND_LITERAL(&out, "\r\n");
 
-        // Append the body to the response
-        memcpy(response_str + written, response->body, response->content_length);
-        response_str[written + response->content_length] = '\0';
+    if (out.failed || response->headers.failed) {
+        http_headers_free(&out);
+        printf("Error: HTTP response header formatting failed\n");
+        return NULL;
     }
+    return out.data;
+}
 
-    return response_str;
+/**
+ * @brief Send an interim (1xx) response ahead of the final one
+ */
+int send_interim_response(const cserver_http_req_t *req, cserver_http_status_t status_code,
+                          const cserver_http_headers_t *headers) {
+    if (req->client_fd < 0 || strcmp(req->version, "HTTP/1.1") != 0 || headers->failed) {
+        return FAILURE;
+    }
+
+    cserver_http_headers_t out = {NULL, 0, 0, 0};
+    HTTP_HEADERS_APPEND_LITERAL(&out, "HTTP/1.1 ");
+    http_headers_append_uint(&out, (unsigned long long)status_code);
+    HTTP_HEADERS_APPEND_LITERAL(&out, " ");
+    const char *message = get_status_message(status_code);
+    http_headers_append(&out, message, strlen(message));
+    HTTP_HEADERS_APPEND_LITERAL(&out, "\r\n");
+    http_headers_append(&out, headers->data, headers->len);
+    HTTP_HEADERS_APPEND_LITERAL(&out, "\r\n");
+
+    int rv = !out.failed && send(req->client_fd, out.data, out.len, 0) == (ssize_t)out.len
+                 ? SUCCESS
+                 : FAILURE;
+    http_headers_free(&out);
+    return rv;
 }
 
 /**
@@ -414,14 +627,21 @@ void free_http_response(cserver_http_res_t *response) {
         return; // Nothing to free
     }
 
-    // Free the body content if it was allocated
-    if (response->body != NULL) {
-        free(response->body);
-        response->body = NULL;
+    // Drop the body segments' references, the last one frees each buffer
+    for (size_t i = 0; i < response->num_segments; i++) {
+        cserve_buf_unref(response->segments[i].buf);
+    }
+    cserve_mem_free(response->segments);
+
+    http_headers_free(&response->headers);
+
+    // Let the producer clean up whatever it was generating the body from
+    if (response->producer_release != NULL) {
+        response->producer_release(response->producer_ctx);
     }
 
     // Free the response structure itself
-    free(response);
+    cserve_mem_free(response);
 }
 
 /**
@@ -0,0 +1,203 @@
+/**
+ * @file cserve_policy.c
+ * @brief Browser caching policy
+ *
+ * Rules are listed in a table and matched in order, add new ones there.
+ */
+
+// Define feature macros before including headers
+// These enable gmtime_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_policy.h"
+#include "config.h"
+#include "error.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+// defines
+#define FINGERPRINT_MIN_LENGTH 6
+
+/**
+ * @brief What a rule matches against
+ */
+typedef enum {
+    POLICY_MATCH_FINGERPRINT, // File names carrying a content hash, pattern unused
+    POLICY_MATCH_PREFIX,      // Paths starting with pattern
+    POLICY_MATCH_EXTENSION,   // Paths ending with pattern
+    POLICY_MATCH_ANY          // Everything, pattern unused
+} policy_match_t;
+
+/**
+ * @brief One caching rule
+ */
+typedef struct {
+    policy_match_t match;
+    const char *pattern;
+    long max_age;      // seconds, 0 means the response must not be stored
+    const char *extra; // directives appended after max-age, may be NULL
+    char header[128];  // "Cache-Control: ...\r\n", formatted at init
+} policy_rule_t;
+
+// Caching rules, first match wins
+static policy_rule_t rules[] = {
+    {POLICY_MATCH_FINGERPRINT, NULL, CACHE_MAX_AGE_IMMUTABLE, "immutable", ""},
+    {POLICY_MATCH_EXTENSION, ".html", CACHE_MAX_AGE_HTML, "must-revalidate", ""},
+    {POLICY_MATCH_EXTENSION, ".css", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".js", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".png", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".jpg", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".jpeg", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".ico", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".avif", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_EXTENSION, ".webp", CACHE_MAX_AGE_ASSETS, NULL, ""},
+    {POLICY_MATCH_ANY, NULL, CACHE_MAX_AGE_DEFAULT, NULL, ""},
+};
+
+/**
+ * @brief Check whether a string ends with a suffix
+ */
+static int ends_with(const char *str, const char *suffix) {
+    size_t len = strlen(str);
+    size_t suffix_len = strlen(suffix);
+    return len >= suffix_len && strcmp(str + len - suffix_len, suffix) == 0;
+}
+
+/**
+ * @brief Check whether a rule matches a path
+ */
+static int rule_matches(const policy_rule_t *rule, const char *path) {
+    switch (rule->match) {
+    case POLICY_MATCH_FINGERPRINT:
+        return cserve_policy_is_fingerprinted(path);
+    case POLICY_MATCH_PREFIX:
+        return strncmp(path, rule->pattern, strlen(rule->pattern)) == 0;
+    case POLICY_MATCH_EXTENSION:
+        return ends_with(path, rule->pattern);
+    case POLICY_MATCH_ANY:
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Format the header lines of every rule
+ */
+int cserve_policy_init(void) {
+    for (size_t i = 0; i < sizeof(rules) / sizeof(rules[0]); i++) {
+        policy_rule_t *rule = &rules[i];
+        int len;
+        if (rule->max_age <= 0) {
+            len = snprintf(rule->header, sizeof(rule->header), "Cache-Control: no-store\r\n");
+        } else {
+            len = snprintf(rule->header, sizeof(rule->header),
+                           "Cache-Control: public, max-age=%ld%s%s\r\n", rule->max_age,
+                           rule->extra != NULL ? ", " : "", rule->extra != NULL ? rule->extra : "");
+        }
+        if (len < 0 || (size_t)len >= sizeof(rule->header)) {
+            printf("Error: Caching rule %zu does not fit its header buffer\n", i);
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Find the first rule matching a path
+ *
+ * @return The rule, never NULL since the table ends with a catch-all rule
+ */
+static const policy_rule_t *find_rule(const char *path) {
+    size_t last = sizeof(rules) / sizeof(rules[0]) - 1;
+    for (size_t i = 0; i < last; i++) {
+        if (rule_matches(&rules[i], path)) {
+            return &rules[i];
+        }
+    }
+    return &rules[last];
+}
+
+/**
+ * @brief Check whether a response gets caching headers at all
+ *
+ * Errors and redirects don't, a 304 repeats the headers of the 200 it stands for.
+ */
+static int is_cacheable(const cserver_http_res_t *response) {
+    return response->status_code == HTTP_STATUS_OK ||
+           response->status_code == HTTP_STATUS_NOT_MODIFIED;
+}
+
+/**
+ * @brief Set the caching headers of a response from a rule
+ */
+static void set_headers(cserver_http_res_t *response, const policy_rule_t *rule) {
+    response->cache_control = rule->header;
+
+    // Expires is only for HTTP/1.0 caches, Cache-Control takes precedence everywhere else
+    time_t expires = time(NULL) + (rule->max_age > 0 ? rule->max_age : 0);
+    struct tm gmt;
+    gmtime_r(&expires, &gmt);
+    strftime(response->expires, sizeof(response->expires), "%a, %d %b %Y %H:%M:%S GMT", &gmt);
+}
+
+/**
+ * @brief Set the caching headers of a response for a file
+ */
+void cserve_policy_apply(cserver_http_res_t *response, const char *path) {
+    if (response == NULL || !is_cacheable(response)) {
+        return;
+    }
+    set_headers(response, find_rule(path));
+}
+
+/**
+ * @brief Set the caching headers of a response made of several files
+ */
+void cserve_policy_apply_all(cserver_http_res_t *response, const char *const *paths, size_t count) {
+    if (response == NULL || count == 0 || !is_cacheable(response)) {
+        return;
+    }
+    // The response is only as cacheable as its least cacheable part
+    const policy_rule_t *strictest = find_rule(paths[0]);
+    for (size_t i = 1; i < count; i++) {
+        const policy_rule_t *rule = find_rule(paths[i]);
+        if (rule->max_age < strictest->max_age) {
+            strictest = rule;
+        }
+    }
+    set_headers(response, strictest);
+}
+
+/**
+ * @brief Check whether a file name carries a content fingerprint
+ */
+int cserve_policy_is_fingerprinted(const char *path) {
+    const char *name = strrchr(path, '/');
+    name = name != NULL ? name + 1 : path;
+
+    // Look at every run of characters that starts after a separator and ends at a dot
+    for (const char *p = name; *p; p++) {
+        if (*p != '.' && *p != '-') {
+            continue;
+        }
+        const char *run = p + 1;
+        size_t len = 0;
+        int digits = 0;
+        int letters = 0;
+        while ((run[len] >= '0' && run[len] <= '9') || (run[len] >= 'a' && run[len] <= 'f')) {
+            if (run[len] <= '9') {
+                digits++;
+            } else {
+                letters++;
+            }
+            len++;
+        }
+        // Mixed digits and letters rule out words like "facade" and version numbers
+        if (len >= FINGERPRINT_MIN_LENGTH && digits > 0 && letters > 0 && run[len] == '.' &&
+            run[len + 1] != '\0') {
+            return 1;
+        }
+    }
+    return 0;
+}
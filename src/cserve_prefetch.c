@@ -0,0 +1,424 @@
+/**
+ * @file cserve_prefetch.c
+ * @brief Predictive prefetch of linked assets
+ *
+ * Request threads only queue page paths. The prefetch thread scans each
+ * page, keeps the asset list in a direct-mapped table keyed by page path
+ * and validated by the page's mtime and size, and warms the assets.
+ */
+
+// Define feature macros before including headers
+// These enable strncasecmp
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_prefetch.h"
+#include "config.h"
+#include "cserve_fs.h"
+#include "cserve_get_handler.h"
+#include "cserve_metrics.h"
+#include "cserve_prof.h"
+#include "error.h"
+#include <ctype.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+// defines
+#define PREFETCH_SLOTS 128
+#define PREFETCH_PATH_SIZE 256
+
+/**
+ * @brief Cached scan of one page
+ */
+typedef struct {
+    char path[PREFETCH_PATH_SIZE]; // page path, empty if the slot is unused
+    struct timespec mtime;         // version of the page the scan belongs to
+    off_t size;
+    time_t warmed; // when the assets were last warmed
+    size_t num_assets;
+    char assets[PREFETCH_MAX_ASSETS][PREFETCH_PATH_SIZE];
+} page_slot_t;
+
+// globals
+static page_slot_t slots[PREFETCH_SLOTS];
+static char queue[PREFETCH_QUEUE_SIZE][PREFETCH_PATH_SIZE];
+static size_t queue_head;
+static size_t queue_len;
+static pthread_mutex_t prefetch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t prefetch_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long pages_scanned;
+static unsigned long assets_warmed;
+static unsigned long dropped;
+
+/**
+ * @brief Find the slot for a page, prefetch lock must be held
+ */
+static page_slot_t *slot_for(const char *path) {
+    unsigned long hash = 2166136261UL;
+    for (const char *p = path; *p; p++) {
+        hash = (hash ^ (unsigned char)*p) * 16777619UL;
+    }
+    return &slots[hash % PREFETCH_SLOTS];
+}
+
+/**
+ * @brief Check whether a slot holds the scan of this version of a page
+ */
+static int slot_is_fresh(const page_slot_t *slot, const char *path, const struct stat *st) {
+    return strcmp(slot->path, path) == 0 && slot->mtime.tv_sec == st->st_mtim.tv_sec &&
+           slot->mtime.tv_nsec == st->st_mtim.tv_nsec && slot->size == st->st_size;
+}
+
+/**
+ * @brief Get the value of an attribute inside a tag
+ *
+ * @param start First character after the tag name
+ * @param end The '>' closing the tag
+ * @param name Attribute name
+ * @param value Set to the attribute value
+ * @param size Size of the value buffer
+ * @return 1 if the attribute was found, 0 otherwise
+ */
+static int get_attribute(const char *start, const char *end, const char *name, char *value,
+                         size_t size) {
+    size_t name_len = strlen(name);
+    for (const char *p = start; p + name_len < end; p++) {
+        // start[-1] is the last character of the tag name, so p[-1] is always valid
+        if (!isspace((unsigned char)p[-1]) || strncasecmp(p, name, name_len) != 0) {
+            continue;
+        }
+        const char *q = p + name_len;
+        while (q < end && isspace((unsigned char)*q)) {
+            q++;
+        }
+        if (q == end || *q != '=') {
+            continue;
+        }
+        q++;
+        while (q < end && isspace((unsigned char)*q)) {
+            q++;
+        }
+        char quote = (q < end && (*q == '"' || *q == '\'')) ? *q++ : '\0';
+        const char *v = q;
+        while (q < end && (quote ? *q != quote : !isspace((unsigned char)*q))) {
+            q++;
+        }
+        size_t len = (size_t)(q - v) < size - 1 ? (size_t)(q - v) : size - 1;
+        memcpy(value, v, len);
+        value[len] = '\0';
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Collapse "." and ".." segments of an absolute path in place
+ *
+ * The browser resolves them before it requests an asset, so the path warmed
+ * has to match the one it asks for later.
+ *
+ * @param path Absolute path
+ */
+static void normalize_path(char *path) {
+    char *out = path;
+    const char *in = path;
+    while (*in != '\0') {
+        // in points at a '/', out ends just before the segment is written
+        const char *segment = in + 1;
+        size_t seg_len = strcspn(segment, "/");
+        if (seg_len == 1 && segment[0] == '.') {
+            // "." keeps the directory, a trailing one leaves its slash
+            if (segment[1] == '\0') {
+                *out++ = '/';
+            }
+        } else if (seg_len == 2 && segment[0] == '.' && segment[1] == '.') {
+            // Like the browser, ".." at the root stays there
+            while (out > path && *--out != '/') {
+            }
+            if (segment[2] == '\0') {
+                *out++ = '/';
+            }
+        } else {
+            memmove(out, in, seg_len + 1);
+            out += seg_len + 1;
+        }
+        in = segment + seg_len;
+    }
+    if (out == path) {
+        *out++ = '/';
+    }
+    *out = '\0';
+}
+
+/**
+ * @brief Turn a link found in a page into a request path
+ *
+ * @param page Request path of the page
+ * @param link The href or src value
+ * @param path Set to the asset's request path
+ * @param size Size of the path buffer
+ * @return SUCCESS for same-origin links, FAILURE otherwise
+ */
+static int resolve_link(const char *page, char *link, char *path, size_t size) {
+    link[strcspn(link, "?#")] = '\0';
+    // Other origins ("//cdn", "https:") and data: URLs are not ours to warm
+    if (link[0] == '\0' || strncmp(link, "//", 2) == 0 || strchr(link, ':') != NULL) {
+        return FAILURE;
+    }
+
+    // Relative links are relative to the directory of the page
+    int dir_len = link[0] == '/' ? 0 : (int)(strrchr(page, '/') - page) + 1;
+    int len = snprintf(path, size, "%.*s%s", dir_len, page, link);
+    if (len <= 0 || (size_t)len >= size) {
+        return FAILURE;
+    }
+    normalize_path(path);
+    return SUCCESS;
+}
+
+/**
+ * @brief Collect the same-origin assets a page links to
+ *
+ * @param page Request path of the page
+ * @param data The page's contents
+ * @param len Size of the page in bytes
+ * @param slot Filled with the asset list
+ */
+static void scan_page(const char *page, const char *data, size_t len, page_slot_t *slot) {
+    const char *end = data + len;
+    const char *p = data;
+    slot->num_assets = 0;
+    while (slot->num_assets < PREFETCH_MAX_ASSETS &&
+           (p = memchr(p, '<', (size_t)(end - p))) != NULL) {
+        p++;
+        const char *name = p;
+        while (p < end && isalpha((unsigned char)*p)) {
+            p++;
+        }
+        size_t name_len = (size_t)(p - name);
+        const char *tag_end = p < end ? memchr(p, '>', (size_t)(end - p)) : NULL;
+        if (tag_end == NULL) {
+            break;
+        }
+
+        char link[PREFETCH_PATH_SIZE];
+        char rel[64];
+        int found = 0;
+        if (name_len == 4 && strncasecmp(name, "link", 4) == 0) {
+            // Only links the page needs to render, not alternates or canonical URLs
+            found = get_attribute(p, tag_end, "rel", rel, sizeof(rel)) &&
+                    (strstr(rel, "stylesheet") != NULL || strstr(rel, "icon") != NULL ||
+                     strstr(rel, "preload") != NULL) &&
+                    get_attribute(p, tag_end, "href", link, sizeof(link));
+        } else if ((name_len == 6 && strncasecmp(name, "script", 6) == 0) ||
+                   (name_len == 3 && strncasecmp(name, "img", 3) == 0)) {
+            found = get_attribute(p, tag_end, "src", link, sizeof(link));
+        }
+        p = tag_end;
+
+        char *asset = slot->assets[slot->num_assets];
+        if (!found || resolve_link(page, link, asset, PREFETCH_PATH_SIZE) != SUCCESS) {
+            continue;
+        }
+        int duplicate = strcmp(asset, page) == 0;
+        for (size_t i = 0; !duplicate && i < slot->num_assets; i++) {
+            duplicate = strcmp(slot->assets[i], asset) == 0;
+        }
+        if (!duplicate) {
+            slot->num_assets++;
+        }
+    }
+}
+
+/**
+ * @brief Get the preload destination for an asset, NULL if it has none we know
+ */
+static const char *preload_type(const char *asset) {
+    const char *type = cserve_get_content_type(asset);
+    if (strcmp(type, "text/css") == 0) {
+        return "style";
+    }
+    if (strcmp(type, "application/javascript") == 0) {
+        return "script";
+    }
+    if (strncmp(type, "image/", 6) == 0) {
+        return "image";
+    }
+    return NULL;
+}
+
+/**
+ * @brief Format the preload links of a page from its cached scan, prefetch lock must be held
+ *
+ * @return Length of the links, 0 if none of the assets can be preloaded
+ */
+static size_t format_links(const page_slot_t *slot, char *links, size_t size) {
+    size_t len = 0;
+    links[0] = '\0';
+    for (size_t i = 0; i < slot->num_assets; i++) {
+        const char *as = preload_type(slot->assets[i]);
+        if (as == NULL) {
+            continue;
+        }
+        int n = snprintf(links + len, size - len, "%s<%s>; rel=preload; as=%s",
+                         len > 0 ? ", " : "", slot->assets[i], as);
+        if (n < 0 || (size_t)n >= size - len) {
+            links[len] = '\0'; // keep only the links that fit completely
+            break;
+        }
+        len += (size_t)n;
+    }
+    return len;
+}
+
+/**
+ * @brief Scan a page if needed and warm its assets
+ */
+static void prefetch(const char *page) {
+    struct stat st;
+    if (cserve_fs_stat(page, &st) != SUCCESS || !S_ISREG(st.st_mode) ||
+        st.st_size > MAX_CACHE_OBJECT_SIZE) {
+        return;
+    }
+
+    page_slot_t scan;
+    pthread_mutex_lock(&prefetch_lock);
+    page_slot_t *slot = slot_for(page);
+    int fresh = slot_is_fresh(slot, page, &st);
+    if (fresh) {
+        scan = *slot;
+    }
+    pthread_mutex_unlock(&prefetch_lock);
+
+    if (!fresh) {
+        // Served through the file cache, the page was just requested so it is most likely hot
+        cserver_http_segment_t segment;
+        if (cserve_get_file_segment(page, &st, &segment) != SUCCESS) {
+            return;
+        }
+        const char *data = segment.buf->data;
+        if (data != NULL) {
+            scan_page(page, data + segment.offset, segment.length, &scan);
+        }
+        cserve_buf_unref(segment.buf);
+        if (data == NULL) {
+            return;
+        }
+        snprintf(scan.path, sizeof(scan.path), "%s", page);
+        scan.mtime = st.st_mtim;
+        scan.size = st.st_size;
+        __atomic_add_fetch(&pages_scanned, 1, __ATOMIC_RELAXED);
+    }
+
+    for (size_t i = 0; i < scan.num_assets; i++) {
+        if (cserve_get_warm(scan.assets[i]) == SUCCESS) {
+            __atomic_add_fetch(&assets_warmed, 1, __ATOMIC_RELAXED);
+        }
+    }
+
+    scan.warmed = time(NULL);
+    pthread_mutex_lock(&prefetch_lock);
+    *slot = scan;
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/**
+ * @brief Background thread that works through the page queue
+ */
+static void *prefetch_thread(void *arg) {
+    (void)arg;
+    cserve_prof_register_thread();
+    char page[PREFETCH_PATH_SIZE];
+    while (1) {
+        pthread_mutex_lock(&prefetch_lock);
+        while (queue_len == 0) {
+            pthread_cond_wait(&prefetch_cond, &prefetch_lock);
+        }
+        memcpy(page, queue[queue_head], sizeof(page));
+        queue_head = (queue_head + 1) % PREFETCH_QUEUE_SIZE;
+        queue_len--;
+        pthread_mutex_unlock(&prefetch_lock);
+
+        prefetch(page);
+    }
+    return NULL;
+}
+
+/**
+ * @brief Render the prefetch section of the metrics output
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    cserve_metrics_appendf(buf, "cserv_prefetch_pages_scanned_total %lu\n",
+                           __atomic_load_n(&pages_scanned, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_prefetch_assets_warmed_total %lu\n",
+                           __atomic_load_n(&assets_warmed, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_prefetch_dropped_total %lu\n",
+                           __atomic_load_n(&dropped, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Start the prefetch thread
+ */
+int cserve_prefetch_init(void) {
+    if (cserve_metrics_register(render_metrics) != SUCCESS) {
+        return FAILURE;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prefetch_thread, NULL) != 0) {
+        printf("Error: Failed to start prefetch thread\n");
+        return FAILURE;
+    }
+    pthread_detach(thread);
+    return SUCCESS;
+}
+
+/**
+ * @brief Note that an HTML page is being served
+ */
+void cserve_prefetch_page(const char *path, const struct stat *st, cserver_http_res_t *response) {
+    if (strlen(path) >= PREFETCH_PATH_SIZE) {
+        return;
+    }
+
+    pthread_mutex_lock(&prefetch_lock);
+    page_slot_t *slot = slot_for(path);
+    int fresh = slot_is_fresh(slot, path, st);
+    if (fresh && PREFETCH_LINK_PRELOAD && response != NULL) {
+        format_links(slot, response->link, sizeof(response->link));
+    }
+
+    // Assets warmed a moment ago are still hot, don't queue the page again
+    if (fresh && time(NULL) - slot->warmed < PREFETCH_REWARM_SECONDS) {
+        pthread_mutex_unlock(&prefetch_lock);
+        return;
+    }
+    for (size_t i = 0; i < queue_len; i++) {
+        if (strcmp(queue[(queue_head + i) % PREFETCH_QUEUE_SIZE], path) == 0) {
+            pthread_mutex_unlock(&prefetch_lock);
+            return;
+        }
+    }
+    if (queue_len == PREFETCH_QUEUE_SIZE) {
+        pthread_mutex_unlock(&prefetch_lock);
+        __atomic_add_fetch(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    snprintf(queue[(queue_head + queue_len) % PREFETCH_QUEUE_SIZE], PREFETCH_PATH_SIZE, "%s", path);
+    queue_len++;
+    pthread_cond_signal(&prefetch_cond);
+    pthread_mutex_unlock(&prefetch_lock);
+}
+
+/**
+ * @brief Get the preload links of a page whose scan is cached
+ */
+int cserve_prefetch_links(const char *path, const struct stat *st, char *links, size_t size) {
+    pthread_mutex_lock(&prefetch_lock);
+    page_slot_t *slot = slot_for(path);
+    size_t len = slot_is_fresh(slot, path, st) ? format_links(slot, links, size) : 0;
+    pthread_mutex_unlock(&prefetch_lock);
+    return len > 0 ? SUCCESS : FAILURE;
+}
@@ -0,0 +1,204 @@
+/**
+ * @file cserve_prewarm.c
+ * @brief Cache pre-warming from persisted hotness statistics
+ *
+ * The state file is plain text, one "count path" pair per line, hottest
+ * first. Each save merges the path sketch (current and previous window)
+ * with the last saved list at half weight, so a quiet restart does not
+ * throw away what was hot before it.
+ */
+
+// Define feature macros before including headers
+// These enable sleep
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_prewarm.h"
+#include "config.h"
+#include "cserve_admin.h"
+#include "cserve_get_handler.h"
+#include "cserve_prof.h"
+#include "cserve_topk.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// globals
+static char state_path[MAX_DIR_PATH_SIZE];
+static pthread_mutex_t save_lock = PTHREAD_MUTEX_INITIALIZER;
+static cserver_topk_item_t history[HOT_PATHS_MAX]; // last saved list
+static size_t history_len;
+
+/**
+ * @brief qsort() comparator, heaviest first
+ */
+static int compare_items(const void *a, const void *b) {
+    const cserver_topk_item_t *ia = a;
+    const cserver_topk_item_t *ib = b;
+    if (ia->count != ib->count) {
+        return ia->count < ib->count ? 1 : -1;
+    }
+    return strcmp(ia->key, ib->key);
+}
+
+/**
+ * @brief Add a count for a path to a list, merging duplicates
+ *
+ * @return New length of the list
+ */
+static size_t merge_item(cserver_topk_item_t *items, size_t len, size_t cap, const char *key,
+                         unsigned long count) {
+    if (count == 0 || cserve_admin_is_admin_path(key)) {
+        return len;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (strcmp(items[i].key, key) == 0) {
+            items[i].count += count;
+            return len;
+        }
+    }
+    if (len == cap) {
+        return len;
+    }
+    snprintf(items[len].key, TOPK_KEY_SIZE, "%s", key);
+    items[len].count = count;
+    items[len].error = 0;
+    return len + 1;
+}
+
+/**
+ * @brief Save the current hot paths to the state file
+ *
+ * Written to a temporary file first and renamed, so a crash mid-write
+ * never leaves a truncated list behind.
+ */
+int cserve_prewarm_save(void) {
+    if (state_path[0] == '\0') {
+        return SUCCESS;
+    }
+
+    cserver_topk_item_t window[TOPK_CAPACITY];
+    cserver_topk_item_t merged[2 * TOPK_CAPACITY + HOT_PATHS_MAX];
+    size_t len = 0;
+    size_t cap = sizeof(merged) / sizeof(merged[0]);
+
+    pthread_mutex_lock(&save_lock);
+
+    size_t n = cserve_topk_snapshot(TOPK_PATHS, TOPK_WINDOW_CURRENT, window, TOPK_CAPACITY);
+    for (size_t i = 0; i < n; i++) {
+        len = merge_item(merged, len, cap, window[i].key, window[i].count - window[i].error);
+    }
+    n = cserve_topk_snapshot(TOPK_PATHS, TOPK_WINDOW_PREVIOUS, window, TOPK_CAPACITY);
+    for (size_t i = 0; i < n; i++) {
+        len = merge_item(merged, len, cap, window[i].key, window[i].count - window[i].error);
+    }
+    for (size_t i = 0; i < history_len; i++) {
+        len = merge_item(merged, len, cap, history[i].key, history[i].count / 2);
+    }
+
+    qsort(merged, len, sizeof(cserver_topk_item_t), compare_items);
+    if (len > HOT_PATHS_MAX) {
+        len = HOT_PATHS_MAX;
+    }
+    memcpy(history, merged, len * sizeof(cserver_topk_item_t));
+    history_len = len;
+
+    char tmp_path[MAX_DIR_PATH_SIZE + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", state_path);
+    FILE *file = fopen(tmp_path, "w");
+    if (file == NULL) {
+        pthread_mutex_unlock(&save_lock);
+        printf("Error: Failed to open hot paths file: %s\n", tmp_path);
+        return FAILURE;
+    }
+    for (size_t i = 0; i < len; i++) {
+        fprintf(file, "%lu %s\n", history[i].count, history[i].key);
+    }
+    int rv = fclose(file) == 0 && rename(tmp_path, state_path) == 0 ? SUCCESS : FAILURE;
+    pthread_mutex_unlock(&save_lock);
+
+    if (rv == FAILURE) {
+        printf("Error: Failed to write hot paths file: %s\n", state_path);
+    }
+    return rv;
+}
+
+/**
+ * @brief Read the state file left by the previous run into the history list
+ */
+static void load_history(void) {
+    FILE *file = fopen(state_path, "r");
+    if (file == NULL) {
+        printf("No hot paths file yet: %s\n", state_path);
+        return;
+    }
+
+    char line[TOPK_KEY_SIZE + 32];
+    pthread_mutex_lock(&save_lock);
+    while (history_len < HOT_PATHS_MAX && fgets(line, sizeof(line), file) != NULL) {
+        char *path = strchr(line, ' ');
+        if (path == NULL) {
+            continue;
+        }
+        *path++ = '\0';
+        path[strcspn(path, "\r\n")] = '\0';
+        unsigned long count = strtoul(line, NULL, 10);
+        history_len = merge_item(history, history_len, HOT_PATHS_MAX, path, count);
+    }
+    pthread_mutex_unlock(&save_lock);
+    fclose(file);
+}
+
+/**
+ * @brief Background thread: warm the cache once, then save periodically
+ */
+static void *prewarm_thread(void *arg) {
+    (void)arg;
+    cserve_prof_register_thread();
+
+    // Work on a copy, a save may rewrite the history while we warm
+    cserver_topk_item_t hot[HOT_PATHS_MAX];
+    pthread_mutex_lock(&save_lock);
+    size_t hot_len = history_len;
+    memcpy(hot, history, hot_len * sizeof(cserver_topk_item_t));
+    pthread_mutex_unlock(&save_lock);
+
+    // The list is sorted hottest first, so the hottest files are loaded first
+    size_t warmed = 0;
+    for (size_t i = 0; i < hot_len; i++) {
+        if (cserve_get_warm(hot[i].key) == SUCCESS) {
+            warmed++;
+        }
+    }
+    printf("Pre-warmed %zu of %zu hot paths\n", warmed, hot_len);
+
+    while (1) {
+        sleep(HOT_PATHS_SAVE_SECONDS);
+        cserve_prewarm_save();
+    }
+    return NULL;
+}
+
+/**
+ * @brief Start pre-warming and periodic saving
+ */
+int cserve_prewarm_init(const char *state_file) {
+    if (state_file == NULL || state_file[0] == '\0') {
+        return SUCCESS;
+    }
+    snprintf(state_path, sizeof(state_path), "%s", state_file);
+
+    // Load synchronously so a save can never run before the old list is merged in
+    load_history();
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, prewarm_thread, NULL) != 0) {
+        printf("Error: Failed to start pre-warm thread\n");
+        return FAILURE;
+    }
+    pthread_detach(thread);
+    return SUCCESS;
+}
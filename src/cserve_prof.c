@@ -0,0 +1,595 @@
+/**
+ * @file cserve_prof.c
+ * @brief Sampling CPU profiler
+ */
+
+// Define feature macros before including headers
+// These enable sigaction, REG_RIP, dladdr, dl_iterate_phdr and pthread_getattr_np
+#define _GNU_SOURCE
+
+#include "cserve_prof.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <dlfcn.h>
+#include <elf.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <link.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <ucontext.h>
+#include <unistd.h>
+
+// defines
+#define PROF_SYMBOL_SIZE 128
+
+/**
+ * @brief One sampled stack, innermost frame first
+ */
+typedef struct {
+    size_t depth;
+    uintptr_t pcs[PROF_MAX_DEPTH];
+} prof_sample_t;
+
+/**
+ * @brief A thread's sample ring, written by its signal handler, read by the drain
+ */
+typedef struct {
+    uintptr_t stack_lo; // bounds of the thread's stack, both 0 if not registered
+    uintptr_t stack_hi;
+    unsigned long head; // next slot the handler writes
+    unsigned long tail; // next slot the drain reads
+    prof_sample_t samples[PROF_BUFFER_SAMPLES];
+} prof_thread_t;
+
+/**
+ * @brief A distinct stack and how often it was sampled
+ */
+typedef struct {
+    prof_sample_t stack;
+    unsigned long count; // 0 for an empty slot
+} prof_stack_t;
+
+/**
+ * @brief A function in the executable's symbol table
+ */
+typedef struct {
+    uintptr_t addr;
+    size_t size;
+    const char *name;
+} prof_symbol_t;
+
+/**
+ * @brief A line of the report
+ */
+typedef struct {
+    char *frames;
+    unsigned long count;
+} prof_line_t;
+
+// Sample rings, claimed when a thread registers or else on its first sample
+static prof_thread_t threads[PROF_MAX_THREADS];
+static unsigned int num_threads;
+static __thread int thread_index = -1;
+
+// Collected stacks and the drain thread, under the lock
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static prof_stack_t *stacks;
+static size_t num_stacks;
+static pthread_t drain_thread;
+static int running;
+
+// Symbols of the executable, loaded on the first report
+static prof_symbol_t *symbols;
+static size_t num_symbols;
+static char *symbol_names;
+static uintptr_t load_bias;
+static int symbols_loaded;
+
+// Counters for the metrics output
+static unsigned long samples_total;
+static unsigned long dropped_total;
+
+/**
+ * @brief Walk the interrupted thread's frame pointers
+ *
+ * Only frames between the stack pointer and the top of the thread's stack
+ * are followed, a thread whose stack is not known gets its leaf frame alone.
+ *
+ * @param uc The interrupted context
+ * @param t The thread's ring, holding its stack bounds
+ * @param pcs Set to the frames
+ * @return Number of frames written to pcs
+ */
+static size_t unwind(const ucontext_t *uc, const prof_thread_t *t, uintptr_t *pcs) {
+#if defined(__x86_64__)
+    uintptr_t pc = (uintptr_t)uc->uc_mcontext.gregs[REG_RIP];
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.gregs[REG_RBP];
+    uintptr_t sp = (uintptr_t)uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    uintptr_t pc = (uintptr_t)uc->uc_mcontext.pc;
+    uintptr_t fp = (uintptr_t)uc->uc_mcontext.regs[29];
+    uintptr_t sp = (uintptr_t)uc->uc_mcontext.sp;
+#else
+    // No unwinder for this architecture, every sample is an unknown frame
+    (void)uc;
+    uintptr_t pc = 0;
+    uintptr_t fp = 0;
+    uintptr_t sp = 1;
+#endif
+    size_t depth = 0;
+    pcs[depth++] = pc;
+
+    // Code built without frame pointers (libc mostly) uses the register for something
+    // else, a frame record outside [sp, top of stack) is garbage and following it could fault
+    uintptr_t lo = sp > t->stack_lo ? sp : t->stack_lo;
+    uintptr_t hi = t->stack_hi;
+    while (depth < PROF_MAX_DEPTH && hi >= 2 * sizeof(uintptr_t) && fp >= lo &&
+           fp <= hi - 2 * sizeof(uintptr_t) && fp % sizeof(uintptr_t) == 0) {
+        const uintptr_t *frame = (const uintptr_t *)fp;
+        uintptr_t next = frame[0];
+        uintptr_t ret = frame[1];
+        if (ret == 0) {
+            break;
+        }
+        pcs[depth++] = ret;
+        // Frames only grow towards the base of the stack
+        if (next <= fp) {
+            break;
+        }
+        fp = next;
+    }
+    return depth;
+}
+
+/**
+ * @brief SIGPROF handler, records the interrupted stack
+ *
+ * Only async-signal-safe work here: atomics and plain stores into
+ * memory that was there before the signal.
+ */
+static void handle_sigprof(int sig, siginfo_t *info, void *context) {
+    (void)sig;
+    (void)info;
+    int saved_errno = errno;
+
+    // A thread that did not register gets a ring without stack bounds
+    if (thread_index == -1) {
+        unsigned int index = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED);
+        thread_index = index < PROF_MAX_THREADS ? (int)index : -2;
+    }
+    if (thread_index < 0) {
+        __atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+
+    // SIGPROF is blocked while its handler runs, so this is the only writer
+    prof_thread_t *t = &threads[thread_index];
+    unsigned long head = t->head;
+    if (head - __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE) >= PROF_BUFFER_SAMPLES) {
+        __atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+    } else {
+        prof_sample_t *sample = &t->samples[head % PROF_BUFFER_SAMPLES];
+        sample->depth = unwind(context, t, sample->pcs);
+        __atomic_store_n(&t->head, head + 1, __ATOMIC_RELEASE);
+        __atomic_add_fetch(&samples_total, 1, __ATOMIC_RELAXED);
+    }
+    errno = saved_errno;
+}
+
+/**
+ * @brief Count a sample in the stack table, called with the lock held
+ */
+static void add_stack(const prof_sample_t *sample) {
+    // FNV-1a over the frames
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < sample->depth; i++) {
+        hash = (hash ^ sample->pcs[i]) * 1099511628211ULL;
+    }
+    for (size_t probe = 0; probe < PROF_MAX_STACKS; probe++) {
+        prof_stack_t *slot = &stacks[(hash + probe) % PROF_MAX_STACKS];
+        if (slot->count == 0) {
+            slot->stack = *sample;
+            slot->count = 1;
+            num_stacks++;
+            return;
+        }
+        if (slot->stack.depth == sample->depth &&
+            memcmp(slot->stack.pcs, sample->pcs, sample->depth * sizeof(uintptr_t)) == 0) {
+            slot->count++;
+            return;
+        }
+    }
+    __atomic_add_fetch(&dropped_total, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief Move the samples of all threads into the stack table, called with the lock held
+ */
+static void drain(void) {
+    unsigned int count = __atomic_load_n(&num_threads, __ATOMIC_RELAXED);
+    for (unsigned int i = 0; i < count && i < PROF_MAX_THREADS; i++) {
+        prof_thread_t *t = &threads[i];
+        unsigned long head = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+        for (unsigned long tail = t->tail; tail != head; tail++) {
+            add_stack(&t->samples[tail % PROF_BUFFER_SAMPLES]);
+        }
+        __atomic_store_n(&t->tail, head, __ATOMIC_RELEASE);
+    }
+}
+
+/**
+ * @brief Drain the sample rings until profiling stops
+ */
+static void *drain_loop(void *arg) {
+    (void)arg;
+    while (1) {
+        usleep(PROF_DRAIN_MS * 1000);
+        pthread_mutex_lock(&prof_lock);
+        drain();
+        int keep_going = running;
+        pthread_mutex_unlock(&prof_lock);
+        if (!keep_going) {
+            break;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * @brief Compare two symbols by address for qsort()
+ */
+static int compare_symbols(const void *a, const void *b) {
+    uintptr_t x = ((const prof_symbol_t *)a)->addr;
+    uintptr_t y = ((const prof_symbol_t *)b)->addr;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Remember where the executable was loaded, it is the first object reported
+ */
+static int find_load_bias(struct dl_phdr_info *info, size_t size, void *data) {
+    (void)size;
+    (void)data;
+    load_bias = info->dlpi_addr;
+    return 1;
+}
+
+/**
+ * @brief Copy the functions out of the executable's symbol table
+ */
+static void load_symbols(const char *image, size_t size) {
+    const ElfW(Ehdr) *ehdr = (const ElfW(Ehdr) *)image;
+    if (size < sizeof(*ehdr) || memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+        ehdr->e_shoff > size || ehdr->e_shnum > (size - ehdr->e_shoff) / sizeof(ElfW(Shdr))) {
+        return;
+    }
+    const ElfW(Shdr) *sections = (const ElfW(Shdr) *)(image + ehdr->e_shoff);
+    for (size_t s = 0; s < ehdr->e_shnum; s++) {
+        if (sections[s].sh_type != SHT_SYMTAB || sections[s].sh_link >= ehdr->e_shnum) {
+            continue;
+        }
+        const ElfW(Shdr) *strtab = &sections[sections[s].sh_link];
+        if (sections[s].sh_offset > size || sections[s].sh_size > size - sections[s].sh_offset ||
+            strtab->sh_offset > size || strtab->sh_size > size - strtab->sh_offset ||
+            strtab->sh_size == 0) {
+            return;
+        }
+        const ElfW(Sym) *syms = (const ElfW(Sym) *)(image + sections[s].sh_offset);
+        size_t count = sections[s].sh_size / sizeof(ElfW(Sym));
+        symbols = malloc(count * sizeof(prof_symbol_t));
+        symbol_names = malloc(strtab->sh_size);
+        if (symbols == NULL || symbol_names == NULL) {
+            free(symbols);
+            free(symbol_names);
+            symbols = NULL;
+            symbol_names = NULL;
+            return;
+        }
+        memcpy(symbol_names, image + strtab->sh_offset, strtab->sh_size);
+        symbol_names[strtab->sh_size - 1] = '\0';
+        for (size_t i = 0; i < count; i++) {
+            if (ELF64_ST_TYPE(syms[i].st_info) != STT_FUNC || syms[i].st_value == 0 ||
+                syms[i].st_name >= strtab->sh_size) {
+                continue;
+            }
+            symbols[num_symbols].addr = syms[i].st_value;
+            symbols[num_symbols].size = syms[i].st_size;
+            symbols[num_symbols].name = symbol_names + syms[i].st_name;
+            num_symbols++;
+        }
+        qsort(symbols, num_symbols, sizeof(prof_symbol_t), compare_symbols);
+        return;
+    }
+}
+
+/**
+ * @brief Load the executable's symbols once, called with the lock held
+ */
+static void ensure_symbols(void) {
+    if (symbols_loaded) {
+        return;
+    }
+    symbols_loaded = 1;
+    dl_iterate_phdr(find_load_bias, NULL);
+
+    int fd = open("/proc/self/exe", O_RDONLY);
+    if (fd < 0) {
+        perror("Profiler symbols");
+        return;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size > 0) {
+        void *image = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (image != MAP_FAILED) {
+            load_symbols(image, (size_t)st.st_size);
+            munmap(image, (size_t)st.st_size);
+        }
+    }
+    close(fd);
+}
+
+/**
+ * @brief Name the function containing an address
+ */
+static void symbolize(uintptr_t pc, char *name, size_t size) {
+    // Our own functions, static ones included
+    uintptr_t addr = pc - load_bias;
+    size_t lo = 0;
+    size_t hi = num_symbols;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (symbols[mid].addr <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        const prof_symbol_t *sym = &symbols[lo - 1];
+        if (addr < sym->addr + (sym->size > 0 ? sym->size : 1)) {
+            snprintf(name, size, "%s", sym->name);
+            return;
+        }
+    }
+
+    // Shared libraries only have their exported functions named
+    Dl_info info;
+    if (pc == 0 || dladdr((void *)pc, &info) == 0) {
+        snprintf(name, size, "[unknown]");
+    } else if (info.dli_sname != NULL) {
+        snprintf(name, size, "%s", info.dli_sname);
+    } else if (info.dli_fname != NULL) {
+        const char *base = strrchr(info.dli_fname, '/');
+        snprintf(name, size, "[%s]", base != NULL ? base + 1 : info.dli_fname);
+    } else {
+        snprintf(name, size, "[unknown]");
+    }
+}
+
+/**
+ * @brief Compare two report lines by their frames for qsort()
+ */
+static int compare_lines(const void *a, const void *b) {
+    return strcmp(((const prof_line_t *)a)->frames, ((const prof_line_t *)b)->frames);
+}
+
+/**
+ * @brief Render the profiler's counters
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    pthread_mutex_lock(&prof_lock);
+    cserve_metrics_appendf(buf, "cserv_prof_running %d\n", running);
+    cserve_metrics_appendf(buf, "cserv_prof_stacks %zu\n", num_stacks);
+    pthread_mutex_unlock(&prof_lock);
+    cserve_metrics_appendf(buf, "cserv_prof_samples_total %lu\n",
+                           __atomic_load_n(&samples_total, __ATOMIC_RELAXED));
+    cserve_metrics_appendf(buf, "cserv_prof_dropped_total %lu\n",
+                           __atomic_load_n(&dropped_total, __ATOMIC_RELAXED));
+}
+
+/**
+ * @brief Register the calling thread and record its stack bounds
+ */
+void cserve_prof_register_thread(void) {
+    // A SIGPROF arriving halfway would claim a second ring for this thread
+    sigset_t prof;
+    sigset_t old;
+    sigemptyset(&prof);
+    sigaddset(&prof, SIGPROF);
+    pthread_sigmask(SIG_BLOCK, &prof, &old);
+    if (thread_index != -1) {
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+
+    unsigned int index = __atomic_fetch_add(&num_threads, 1, __ATOMIC_RELAXED);
+    if (index >= PROF_MAX_THREADS) {
+        thread_index = -2;
+        pthread_sigmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+    // Not async-signal-safe, which is why this is done here and not in the handler
+    pthread_attr_t attr;
+    void *addr;
+    size_t size;
+    if (pthread_getattr_np(pthread_self(), &attr) == 0) {
+        if (pthread_attr_getstack(&attr, &addr, &size) == 0) {
+            threads[index].stack_lo = (uintptr_t)addr;
+            threads[index].stack_hi = (uintptr_t)addr + size;
+        }
+        pthread_attr_destroy(&attr);
+    }
+    thread_index = (int)index;
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+}
+
+/**
+ * @brief Register the profiler's counters and the calling thread
+ */
+int cserve_prof_init(void) {
+    cserve_prof_register_thread();
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Start profiling, dropping the stacks of an earlier run
+ */
+int cserve_prof_start(void) {
+    pthread_mutex_lock(&prof_lock);
+    if (running) {
+        pthread_mutex_unlock(&prof_lock);
+        return FAILURE;
+    }
+    if (stacks == NULL) {
+        stacks = calloc(PROF_MAX_STACKS, sizeof(prof_stack_t));
+        if (stacks == NULL) {
+            printf("Error: Memory allocation failed for profiler stacks\n");
+            pthread_mutex_unlock(&prof_lock);
+            return FAILURE;
+        }
+    }
+    // Samples still in the rings belong to the earlier run
+    drain();
+    memset(stacks, 0, PROF_MAX_STACKS * sizeof(prof_stack_t));
+    num_stacks = 0;
+
+    // The handler stays installed after stopping, a late SIGPROF must not kill the server
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = handle_sigprof;
+    sa.sa_flags = SA_SIGINFO | SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGPROF, &sa, NULL);
+
+    // Shutdown signals must keep going to the main thread, the drain thread blocks everything
+    sigset_t all;
+    sigset_t old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    running = 1;
+    int rc = pthread_create(&drain_thread, NULL, drain_loop, NULL);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        printf("Error: Failed to start profiler thread\n");
+        running = 0;
+        pthread_mutex_unlock(&prof_lock);
+        return FAILURE;
+    }
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = 1000000 / PROF_HZ;
+    timer.it_value = timer.it_interval;
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        perror("Profiler timer");
+        running = 0;
+        pthread_mutex_unlock(&prof_lock);
+        pthread_join(drain_thread, NULL);
+        return FAILURE;
+    }
+    pthread_mutex_unlock(&prof_lock);
+    return SUCCESS;
+}
+
+/**
+ * @brief Stop profiling, the collected stacks stay available for the report
+ */
+void cserve_prof_stop(void) {
+    pthread_mutex_lock(&prof_lock);
+    if (!running) {
+        pthread_mutex_unlock(&prof_lock);
+        return;
+    }
+    // Even if the timer can't be disarmed, the handler stays harmless
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    if (setitimer(ITIMER_PROF, &timer, NULL) != 0) {
+        perror("Profiler timer");
+    }
+    running = 0;
+    pthread_mutex_unlock(&prof_lock);
+
+    // The drain thread makes one last pass before it exits
+    pthread_join(drain_thread, NULL);
+}
+
+/**
+ * @brief Render the collected stacks in folded format
+ */
+char *cserve_prof_report(void) {
+    cserver_metrics_buf_t buf;
+    buf.len = 0;
+    buf.cap = PROF_MAX_DEPTH * PROF_SYMBOL_SIZE;
+    buf.data = malloc(buf.cap);
+    if (buf.data == NULL) {
+        printf("Error: Memory allocation failed for profile report\n");
+        return NULL;
+    }
+    buf.data[0] = '\0';
+
+    pthread_mutex_lock(&prof_lock);
+    if (stacks == NULL) {
+        pthread_mutex_unlock(&prof_lock);
+        return buf.data;
+    }
+    drain();
+    ensure_symbols();
+
+    // Different return addresses in one function fold into the same line, merge them
+    prof_line_t *lines = malloc((num_stacks + 1) * sizeof(prof_line_t));
+    if (lines == NULL) {
+        pthread_mutex_unlock(&prof_lock);
+        printf("Error: Memory allocation failed for profile report\n");
+        free(buf.data);
+        return NULL;
+    }
+    size_t num_lines = 0;
+    char frames[PROF_MAX_DEPTH * PROF_SYMBOL_SIZE];
+    char name[PROF_SYMBOL_SIZE];
+    for (size_t i = 0; i < PROF_MAX_STACKS; i++) {
+        const prof_stack_t *s = &stacks[i];
+        if (s->count == 0) {
+            continue;
+        }
+        size_t len = 0;
+        frames[0] = '\0';
+        for (size_t f = s->stack.depth; f-- > 0;) {
+            // Return addresses point after the call, which may already be the next function
+            symbolize(f == 0 ? s->stack.pcs[f] : s->stack.pcs[f] - 1, name, sizeof(name));
+            int n = snprintf(frames + len, sizeof(frames) - len, "%s%s", len > 0 ? ";" : "",
+                             name);
+            if (n < 0 || (size_t)n >= sizeof(frames) - len) {
+                break;
+            }
+            len += (size_t)n;
+        }
+        lines[num_lines].frames = strdup(frames);
+        lines[num_lines].count = s->count;
+        if (lines[num_lines].frames != NULL) {
+            num_lines++;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+
+    qsort(lines, num_lines, sizeof(prof_line_t), compare_lines);
+    for (size_t i = 0; i < num_lines; i++) {
+        unsigned long count = lines[i].count;
+        while (i + 1 < num_lines && strcmp(lines[i].frames, lines[i + 1].frames) == 0) {
+            free(lines[i].frames);
+            count += lines[++i].count;
+        }
+        cserve_metrics_appendf(&buf, "%s %lu\n", lines[i].frames, count);
+        free(lines[i].frames);
+    }
+    free(lines);
+    return buf.data;
+}
@@ -0,0 +1,163 @@
+/**
+ * @file cserve_query.c
+ * @brief Query string normalization
+ *
+ * Rules are listed in a table and matched in order, add new ones there.
+ */
+
+// Define feature macros before including headers
+// These enable strtok_r
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_query.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include <string.h>
+
+// defines
+#define QUERY_MAX_PARAMS 32
+
+/**
+ * @brief What a rule matches against
+ */
+typedef enum {
+    QUERY_MATCH_PREFIX,   // Paths starting with pattern
+    QUERY_MATCH_EXTENSION // Paths ending with pattern
+} query_match_t;
+
+/**
+ * @brief Which parameters a route depends on
+ */
+typedef struct {
+    query_match_t match;
+    const char *pattern; // paths the rule applies to
+    const char *keep;    // comma separated names to keep, NULL keeps everything not ignored
+    int untouched;       // 1 leaves the query exactly as the client sent it
+} query_rule_t;
+
+// Query rules, first match wins
+static const query_rule_t rules[] = {
+    {QUERY_MATCH_PREFIX, BUNDLE_PATH, NULL, 0},       // the file list, however it is spelled
+    {QUERY_MATCH_PREFIX, ADMIN_PATH_PREFIX, NULL, 0}, // not cached, leave it to the endpoint
+    {QUERY_MATCH_EXTENSION, FCGI_EXTENSION, NULL, 1}, // scripts get every parameter, in order
+    {QUERY_MATCH_PREFIX, "/", "v", 0}, // files only differ by their cache-busting version
+};
+
+// Parameters that never change a response, "utm_" matches every name starting with it
+static const char *ignored[] = {"utm_", "fbclid", "gclid", "_"};
+
+/**
+ * @brief Check whether a rule matches a path
+ */
+static int rule_matches(const query_rule_t *rule, const char *path) {
+    size_t pattern_len = strlen(rule->pattern);
+    switch (rule->match) {
+    case QUERY_MATCH_PREFIX:
+        return strncmp(path, rule->pattern, pattern_len) == 0;
+    case QUERY_MATCH_EXTENSION: {
+        size_t path_len = strlen(path);
+        return path_len > pattern_len && strcmp(path + path_len - pattern_len, rule->pattern) == 0;
+    }
+    }
+    return 0;
+}
+
+/**
+ * @brief Check whether a parameter name is in a comma separated list
+ */
+static int in_list(const char *list, const char *name, size_t len) {
+    const char *p = list;
+    while (1) {
+        size_t item_len = strcspn(p, ",");
+        if (item_len == len && strncmp(p, name, len) == 0) {
+            return 1;
+        }
+        if (p[item_len] == '\0') {
+            return 0;
+        }
+        p += item_len + 1;
+    }
+}
+
+/**
+ * @brief Check whether a parameter name is one that never matters
+ */
+static int is_ignored(const char *name, size_t len) {
+    for (size_t i = 0; i < sizeof(ignored) / sizeof(ignored[0]); i++) {
+        size_t ignored_len = strlen(ignored[i]);
+        // A trailing '_' makes the entry a prefix, "_" alone is the name itself
+        int prefix = ignored_len > 1 && ignored[i][ignored_len - 1] == '_';
+        if ((prefix ? len >= ignored_len : len == ignored_len) &&
+            strncmp(name, ignored[i], ignored_len) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * @brief Compare the names of two parameters
+ */
+static int compare_names(const char *a, const char *b) {
+    size_t a_len = strcspn(a, "=");
+    size_t b_len = strcspn(b, "=");
+    int rv = strncmp(a, b, a_len < b_len ? a_len : b_len);
+    return rv != 0 ? rv : (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * @brief Rewrite the query string of a request to its canonical form
+ */
+void cserve_query_normalize(cserver_http_req_t *req) {
+    if (req->query[0] == '\0') {
+        return;
+    }
+
+    const query_rule_t *rule = NULL;
+    for (size_t i = 0; rule == NULL && i < sizeof(rules) / sizeof(rules[0]); i++) {
+        if (rule_matches(&rules[i], req->path)) {
+            rule = &rules[i];
+        }
+    }
+    if (rule == NULL || rule->untouched) {
+        return;
+    }
+
+    char copy[sizeof(req->query)];
+    memcpy(copy, req->query, sizeof(copy));
+    char *params[QUERY_MAX_PARAMS];
+    size_t count = 0;
+    unsigned long dropped = 0;
+    char *saveptr;
+    for (char *param = strtok_r(copy, "&", &saveptr); param != NULL;
+         param = strtok_r(NULL, "&", &saveptr)) {
+        size_t len = strcspn(param, "=");
+        if (is_ignored(param, len) || (rule->keep != NULL && !in_list(rule->keep, param, len))) {
+            dropped++;
+            continue;
+        }
+        if (count == QUERY_MAX_PARAMS) {
+            return;
+        }
+        // Insertion sort, stable so repeated names keep their order
+        size_t i = count++;
+        while (i > 0 && compare_names(params[i - 1], param) > 0) {
+            params[i] = params[i - 1];
+            i--;
+        }
+        params[i] = param;
+    }
+
+    // The result is never longer than the original, it fits where the original was
+    size_t len = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0) {
+            req->query[len++] = '&';
+        }
+        size_t param_len = strlen(params[i]);
+        memcpy(req->query + len, params[i], param_len);
+        len += param_len;
+    }
+    req->query[len] = '\0';
+    cserve_metrics_add(METRIC_QUERY_DROPPED, dropped);
+}
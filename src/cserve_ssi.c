@@ -0,0 +1,370 @@
+/**
+ * @file cserve_ssi.c
+ * @brief Server-side includes for HTML pages
+ */
+
+// Define feature macros before including headers
+// These enable st_mtim
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_ssi.h"
+#include "config.h"
+#include "cserve_arena.h"
+#include "cserve_bloom.h"
+#include "cserve_cache.h"
+#include "cserve_fcgi.h"
+#include "cserve_fs.h"
+#include "cserve_get_handler.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+// defines
+#define SSI_KEY_PREFIX "ssi:"
+
+/**
+ * @brief One piece of a page, literal text or an include
+ */
+typedef struct {
+    int include;   // 1 if this is an include, 0 for literal text
+    size_t offset; // start of the text, or of the include path, in the page
+    size_t length;
+} ssi_part_t;
+
+/**
+ * @brief A scanned page, kept in the file cache
+ *
+ * The parts are followed by a copy of the page they point into.
+ */
+typedef struct {
+    size_t page_size; // size of the page the template was built from
+    size_t count;     // number of parts, 0 if the page has no includes
+    ssi_part_t parts[];
+} ssi_template_t;
+
+// Stands in for includes that could not be resolved
+static const char error_message[] = "[an error occurred while processing this directive]";
+
+static int append_page(cserver_http_res_t *response, const char *path, const struct stat *st,
+                       int depth);
+
+/**
+ * @brief Parse an include directive
+ *
+ * @param start First character after "<!--#"
+ * @param end The "-->" ending the directive
+ * @param path Set to the include path
+ * @param length Set to the length of the include path
+ * @return 1 if this is <!--#include virtual="..." -->, 0 otherwise
+ */
+static int parse_include(const char *start, const char *end, const char **path, size_t *length) {
+    static const char directive[] = "include";
+    static const char attribute[] = "virtual=\"";
+    const char *p = start;
+    if (strncmp(p, directive, sizeof(directive) - 1) != 0) {
+        return 0;
+    }
+    p += sizeof(directive) - 1;
+    p += strspn(p, " \t\r\n");
+    if (strncmp(p, attribute, sizeof(attribute) - 1) != 0) {
+        return 0;
+    }
+    p += sizeof(attribute) - 1;
+    const char *quote = strchr(p, '"');
+    if (quote == NULL || quote >= end || quote == p) {
+        return 0;
+    }
+    *path = p;
+    *length = (size_t)(quote - p);
+    p = quote + 1;
+    return p + strspn(p, " \t\r\n") == end;
+}
+
+/**
+ * @brief Scan a page into a template
+ *
+ * Used as the cache loader, the key is ignored.
+ *
+ * @param key The cache key, unused
+ * @param ctx The request path of the page, resolved below the root
+ * @param data Set to a cserve_arena_alloc()ed ssi_template_t
+ * @param size Set to the size of the template in bytes
+ * @return SUCCESS on success, FAILURE on error
+ */
+static int build_template(const char *key, void *ctx, char **data, size_t *size) {
+    (void)key;
+    const char *path = ctx;
+
+    int fd = cserve_fs_open(path, O_RDONLY);
+    if (fd < 0) {
+        printf("Error: File not found: %s\n", path);
+        return FAILURE;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        printf("Error: Failed to get file size: %s\n", path);
+        return FAILURE;
+    }
+    size_t page_size = (size_t)st.st_size;
+
+    // Room for every part the page may have, trimmed by the size computed below
+    size_t header_size = sizeof(ssi_template_t) + SSI_MAX_PARTS * sizeof(ssi_part_t);
+    ssi_template_t *tmpl = cserve_arena_alloc(header_size + page_size + 1);
+    if (tmpl == NULL) {
+        close(fd);
+        printf("Error: Memory allocation failed\n");
+        return FAILURE;
+    }
+    char *page = (char *)tmpl + header_size;
+    size_t total = 0;
+    while (total < page_size) {
+        ssize_t n = read(fd, page + total, page_size - total);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        total += (size_t)n;
+    }
+    close(fd);
+    if (total != page_size) {
+        cserve_arena_free(tmpl);
+        printf("Error: Failed to read file (%zu bytes)\n", page_size);
+        return FAILURE;
+    }
+    page[page_size] = '\0';
+
+    tmpl->page_size = page_size;
+    tmpl->count = 0;
+    size_t literal = 0;
+    int includes = 0;
+    for (const char *p = strstr(page, "<!--#"); p != NULL; p = strstr(p, "<!--#")) {
+        const char *end = strstr(p + 5, "-->");
+        if (end == NULL) {
+            break;
+        }
+        const char *include;
+        size_t length;
+        if (!parse_include(p + 5, end, &include, &length)) {
+            p = end + 3; // not ours, left in the page as it is
+            continue;
+        }
+        if (tmpl->count + 3 > SSI_MAX_PARTS) {
+            printf("Error: Too many includes in %s\n", path);
+            break;
+        }
+        if (p > page + literal) {
+            tmpl->parts[tmpl->count++] = (ssi_part_t){0, literal, (size_t)(p - page) - literal};
+        }
+        tmpl->parts[tmpl->count++] = (ssi_part_t){1, (size_t)(include - page), length};
+        includes++;
+        literal = (size_t)(end + 3 - page);
+        p = end + 3;
+    }
+    if (includes == 0) {
+        // Served straight from the file cache, the template only remembers that
+        tmpl->count = 0;
+        *data = (char *)tmpl;
+        *size = sizeof(ssi_template_t);
+        return SUCCESS;
+    }
+    if (literal < page_size) {
+        tmpl->parts[tmpl->count++] = (ssi_part_t){0, literal, page_size - literal};
+    }
+
+    // Move the page up behind the parts actually used
+    size_t used = sizeof(ssi_template_t) + tmpl->count * sizeof(ssi_part_t);
+    memmove((char *)tmpl + used, page, page_size);
+    *data = (char *)tmpl;
+    *size = used + page_size;
+    return SUCCESS;
+}
+
+/**
+ * @brief Drop the cache reference held by a template buffer
+ */
+static void release_cache_entry(void *ctx) {
+    cserve_cache_release(ctx);
+}
+
+/**
+ * @brief Free a directly built template held by a template buffer
+ */
+static void release_loaded(void *ctx) {
+    cserve_arena_free(ctx);
+}
+
+/**
+ * @brief Get a page's template, scanning the page if it is not cached
+ *
+ * @return Buffer holding the template, or NULL on error with errno set
+ */
+static cserver_buf_t *get_template(const char *path, const struct stat *st) {
+    char key[sizeof(SSI_KEY_PREFIX) + sizeof(((cserver_http_req_t *)0)->path)];
+    snprintf(key, sizeof(key), "%s%s", SSI_KEY_PREFIX, path);
+
+    // The template's size is not the page's, so a same-mtime edit is caught by page_size
+    for (int attempt = 0; attempt < 2; attempt++) {
+        cserver_cache_result_t result;
+        cserver_cache_entry_t *entry = cserve_cache_acquire(
+            key, &st->st_mtim, CACHE_SIZE_UNKNOWN, build_template, (void *)path, &result);
+        if (entry != NULL) {
+            if (((const ssi_template_t *)entry->data)->page_size != (size_t)st->st_size) {
+                cserve_cache_release(entry);
+                cserve_cache_invalidate(key);
+                continue;
+            }
+            cserver_buf_t *buf =
+                cserve_buf_wrap(entry->data, entry->size, release_cache_entry, entry);
+            if (buf == NULL) {
+                errno = ENOMEM;
+            }
+            return buf;
+        }
+        if (result != CACHE_RESULT_FALLBACK) {
+            break;
+        }
+        // The in-flight scan did not finish in time, we scan the page ourselves
+        char *loaded;
+        size_t size;
+        if (build_template(key, (void *)path, &loaded, &size) != SUCCESS) {
+            break;
+        }
+        cserver_buf_t *buf = cserve_buf_wrap(loaded, size, release_loaded, loaded);
+        if (buf == NULL) {
+            errno = ENOMEM;
+        }
+        return buf;
+    }
+    errno = EIO;
+    return NULL;
+}
+
+/**
+ * @brief Append the error message standing in for an include
+ */
+static int append_error(cserver_http_res_t *response) {
+    cserver_buf_t *buf = cserve_buf_wrap(error_message, sizeof(error_message) - 1, NULL, NULL);
+    if (buf == NULL) {
+        return FAILURE;
+    }
+    int rv = http_response_append(response, buf, 0, buf->size);
+    cserve_buf_unref(buf);
+    return rv;
+}
+
+/**
+ * @brief Append a file as it is
+ */
+static int append_file(cserver_http_res_t *response, const char *path, const struct stat *st) {
+    cserver_http_segment_t segment;
+    if (cserve_get_file_segment(path, st, &segment) != SUCCESS) {
+        return FAILURE;
+    }
+    int rv = http_response_append(response, segment.buf, segment.offset, segment.length);
+    cserve_buf_unref(segment.buf);
+    if (rv != SUCCESS) {
+        errno = ENOMEM;
+    }
+    return rv;
+}
+
+/**
+ * @brief Append the target of an include directive
+ *
+ * @return SUCCESS if the include or the error message was appended, FAILURE if out of memory
+ */
+static int append_include(cserver_http_res_t *response, const char *page_path,
+                          const char *include, size_t length, int depth) {
+    // Relative paths are relative to the page's directory
+    char path[sizeof(((cserver_http_req_t *)0)->path)];
+    size_t dir_len = include[0] == '/' ? 0 : (size_t)(strrchr(page_path, '/') - page_path) + 1;
+    if (dir_len + length >= sizeof(path)) {
+        printf("Error: Include path too long in %s\n", page_path);
+        return append_error(response);
+    }
+    memcpy(path, page_path, dir_len);
+    memcpy(path + dir_len, include, length);
+    path[dir_len + length] = '\0';
+
+    // Includes nested deeper than SSI_MAX_DEPTH are most likely a page including itself
+    int html = strcmp(cserve_get_content_type(path), "text/html") == 0;
+    struct stat st;
+    if ((html && depth >= SSI_MAX_DEPTH) || response->num_segments >= SSI_MAX_SEGMENTS ||
+        validate_path(path) == FAILURE || cserve_fcgi_is_private(path) ||
+        cserve_bloom_check(path) == FAILURE || cserve_fs_stat(path, &st) != SUCCESS ||
+        !S_ISREG(st.st_mode)) {
+        printf("Error: Failed to include %s in %s\n", path, page_path);
+        return append_error(response);
+    }
+
+    int rv;
+    if (html) {
+        rv = append_page(response, path, &st, depth + 1);
+    } else {
+        rv = append_file(response, path, &st);
+    }
+    if (rv != SUCCESS) {
+        int err = errno;
+        printf("Error: Failed to include %s in %s\n", path, page_path);
+        return err == ENOMEM ? FAILURE : append_error(response);
+    }
+    cserve_metrics_inc(METRIC_SSI_INCLUDES);
+    return SUCCESS;
+}
+
+/**
+ * @brief Append a page, expanding its includes
+ */
+static int append_page(cserver_http_res_t *response, const char *path, const struct stat *st,
+                       int depth) {
+    // Too big to scan into memory, sent as it is
+    if (st->st_size > LARGE_FILE_THRESHOLD) {
+        return append_file(response, path, st);
+    }
+
+    cserver_buf_t *buf = get_template(path, st);
+    if (buf == NULL) {
+        return FAILURE;
+    }
+    const ssi_template_t *tmpl = (const ssi_template_t *)buf->data;
+    if (tmpl->count == 0) {
+        cserve_buf_unref(buf);
+        return append_file(response, path, st);
+    }
+
+    // Literal parts share the template buffer, each segment holds its own reference
+    size_t text = sizeof(ssi_template_t) + tmpl->count * sizeof(ssi_part_t);
+    int rv = SUCCESS;
+    for (size_t i = 0; rv == SUCCESS && i < tmpl->count; i++) {
+        const ssi_part_t *part = &tmpl->parts[i];
+        if (part->include) {
+            rv = append_include(response, path, buf->data + text + part->offset, part->length,
+                                depth);
+        } else {
+            rv = http_response_append(response, buf, text + part->offset, part->length);
+        }
+    }
+    cserve_buf_unref(buf);
+    if (rv != SUCCESS) {
+        errno = ENOMEM;
+        return FAILURE;
+    }
+    if (depth == 0) {
+        cserve_metrics_inc(METRIC_SSI_PAGES);
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Append a page to a response, expanding its includes
+ */
+int cserve_ssi_append(cserver_http_res_t *response, const char *path, const struct stat *st) {
+    return append_page(response, path, st, 0);
+}
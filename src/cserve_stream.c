@@ -0,0 +1,208 @@
+/**
+ * @file cserve_stream.c
+ * @brief Page-cache-friendly delivery of large files
+ */
+
+// Define feature macros before including headers
+// These enable posix_fadvise and writev
+#define _GNU_SOURCE
+#define _POSIX_C_SOURCE 200809L
+
+#include "cserve_stream.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/sendfile.h>
+#include <sys/uio.h>
+
+// defines
+#define STREAM_MAX_IOV 64
+
+/**
+ * @brief Send a range of a file to a socket
+ *
+ * Pages are dropped one chunk behind the cursor rather than right at it:
+ * the socket may still reference the chunk just handed to sendfile(), and
+ * the kernel will not drop those pages anyway.
+ */
+int cserve_stream_file(int sock, int fd, off_t offset, size_t length) {
+    off_t start = offset;
+    off_t end = offset + (off_t)length;
+    off_t dropped = offset;
+
+    // Bigger readahead window, and pages behind the reader are dropped sooner
+    posix_fadvise(fd, offset, (off_t)length, POSIX_FADV_SEQUENTIAL);
+
+    while (offset < end) {
+        size_t chunk = end - offset < STREAM_CHUNK_SIZE ? (size_t)(end - offset) : STREAM_CHUNK_SIZE;
+        ssize_t sent = sendfile(sock, fd, &offset, chunk);
+        if (sent < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("sendfile");
+            break;
+        }
+        if (sent == 0) {
+            break; // file shrank underneath us
+        }
+
+        if (offset - dropped > 2 * STREAM_CHUNK_SIZE) {
+            off_t drop_end = offset - STREAM_CHUNK_SIZE;
+            posix_fadvise(fd, dropped, drop_end - dropped, POSIX_FADV_DONTNEED);
+            dropped = drop_end;
+        }
+    }
+
+    // Whatever is left of this file in the page cache is not worth keeping either
+    posix_fadvise(fd, dropped, offset - dropped, POSIX_FADV_DONTNEED);
+
+    cserve_metrics_add(METRIC_STREAMED_BYTES, (unsigned long)(offset - start));
+    return offset == end ? SUCCESS : FAILURE;
+}
+
+/**
+ * @brief Write a vector of buffers completely, resuming after short writes
+ */
+static int write_all(int sock, struct iovec *iov, int count) {
+    while (count > 0) {
+        ssize_t sent = writev(sock, iov, count);
+        if (sent < 0) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            perror("writev");
+            return FAILURE;
+        }
+        // Skip what went out, then resume in the middle of the first partial buffer
+        while (count > 0 && (size_t)sent >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= (size_t)sent;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Send the header block and a body made of segments
+ *
+ * The header block goes out in the same writev() as the memory segments
+ * that follow it, a small response takes a single system call.
+ */
+static int send_segments(int sock, const char *head, size_t head_len,
+                         const cserver_http_segment_t *segments, size_t count) {
+    size_t i = 0;
+    int head_sent = 0;
+    while (!head_sent || i < count) {
+        if (head_sent && segments[i].buf->data == NULL) {
+            if (cserve_stream_file(sock, segments[i].buf->fd, (off_t)segments[i].offset,
+                                   segments[i].length) != SUCCESS) {
+                return FAILURE;
+            }
+            i++;
+            continue;
+        }
+
+        // Gather the run of memory segments into one writev()
+        struct iovec iov[STREAM_MAX_IOV];
+        int n = 0;
+        if (!head_sent) {
+            iov[n].iov_base = (void *)head;
+            iov[n].iov_len = head_len;
+            n++;
+            head_sent = 1;
+        }
+        while (i < count && n < STREAM_MAX_IOV && segments[i].buf->data != NULL) {
+            iov[n].iov_base = (void *)(segments[i].buf->data + segments[i].offset);
+            iov[n].iov_len = segments[i].length;
+            n++;
+            i++;
+        }
+        if (write_all(sock, iov, n) != SUCCESS) {
+            return FAILURE;
+        }
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Send the header block and a body generated by a producer
+ *
+ * Each piece is written before the producer is asked for the next one, so
+ * the socket's send buffer throttles the producer. With chunked framing
+ * every piece becomes one chunk and the body ends with the last-chunk
+ * marker, otherwise pieces are sent as they are.
+ */
+static int send_produced(int sock, const char *head, size_t head_len,
+                         const cserver_http_res_t *response) {
+    struct iovec head_iov = {(void *)head, head_len};
+    if (write_all(sock, &head_iov, 1) != SUCCESS) {
+        return FAILURE;
+    }
+
+    char buffer[STREAM_PRODUCER_BUFFER_SIZE];
+    size_t total = 0;
+    while (1) {
+        ssize_t n = response->producer(response->producer_ctx, buffer, sizeof(buffer));
+        if (n < 0) {
+            // No last chunk, so the client can tell the body was cut short
+            printf("Error: Body producer failed after %zu bytes\n", total);
+            return FAILURE;
+        }
+
+        char chunk_header[32];
+        struct iovec iov[3];
+        int count = 0;
+        if (response->chunked) {
+            // A zero-sized chunk is the last-chunk marker, followed by the empty trailer
+            iov[count].iov_base = chunk_header;
+            iov[count].iov_len = (size_t)snprintf(chunk_header, sizeof(chunk_header),
+                                                  n > 0 ? "%zx\r\n" : "0\r\n\r\n", (size_t)n);
+            count++;
+        }
+        if (n > 0) {
+            iov[count].iov_base = buffer;
+            iov[count].iov_len = (size_t)n;
+            count++;
+            if (response->chunked) {
+                iov[count].iov_base = "\r\n";
+                iov[count].iov_len = 2;
+                count++;
+            }
+        }
+        if (count > 0 && write_all(sock, iov, count) != SUCCESS) {
+            return FAILURE;
+        }
+        if (n == 0) {
+            break;
+        }
+        total += (size_t)n;
+    }
+
+    // A producer that announced its length must have kept to it
+    if (response->content_length != HTTP_CONTENT_LENGTH_UNKNOWN &&
+        total != response->content_length) {
+        printf("Error: Body producer sent %zu of %zu bytes\n", total, response->content_length);
+        return FAILURE;
+    }
+    return SUCCESS;
+}
+
+/**
+ * @brief Send a response to a socket
+ */
+int cserve_stream_response(int sock, const char *head, size_t head_len,
+                           const cserver_http_res_t *response) {
+    if (response->producer != NULL) {
+        return send_produced(sock, head, head_len, response);
+    }
+    return send_segments(sock, head, head_len, response->segments, response->num_segments);
+}
@@ -0,0 +1,247 @@
+/**
+ * @file cserve_topk.c
+ * @brief Space-Saving heavy-hitter sketches
+ *
+ * Each sketch keeps TOPK_CAPACITY (key, count, error) slots. A key that is
+ * already tracked has its count bumped; a new key replaces the slot with
+ * the smallest count and inherits that count as its error bound. Memory
+ * use is fixed no matter how many distinct keys we see.
+ */
+
+#include "cserve_topk.h"
+#include "config.h"
+#include "cserve_metrics.h"
+#include "error.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief One window worth of counters
+ */
+typedef struct {
+    cserver_topk_item_t items[TOPK_CAPACITY];
+    unsigned long hashes[TOPK_CAPACITY];
+    size_t used;
+} topk_window_t;
+
+/**
+ * @brief A sketch with its current and previous window
+ */
+typedef struct {
+    pthread_mutex_t lock;
+    time_t window_start;
+    topk_window_t current;
+    topk_window_t previous;
+} topk_sketch_t;
+
+static void render_metrics(cserver_metrics_buf_t *buf);
+
+// globals
+static topk_sketch_t sketches[TOPK_KIND_COUNT];
+
+// Sketch names, indexed by cserver_topk_kind_t
+static const char *sketch_names[TOPK_KIND_COUNT] = {
+    "path",
+    "client",
+    "user_agent",
+};
+
+/**
+ * @brief FNV-1a hash of a key, truncated the same way keys are stored
+ */
+static unsigned long hash_key(const char *key) {
+    unsigned long hash = 2166136261UL;
+    for (size_t i = 0; key[i] != '\0' && i < TOPK_KEY_SIZE - 1; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619UL;
+    }
+    return hash;
+}
+
+/**
+ * @brief Start a new window if the current one has expired, sketch lock must be held
+ */
+static void maybe_rotate(topk_sketch_t *sketch, time_t now) {
+    if (now - sketch->window_start < TOPK_WINDOW_SECONDS) {
+        return;
+    }
+    // A gap of more than one window means the previous window saw nothing
+    if (now - sketch->window_start < 2 * TOPK_WINDOW_SECONDS) {
+        sketch->previous = sketch->current;
+    } else {
+        sketch->previous.used = 0;
+    }
+    sketch->current.used = 0;
+    sketch->window_start = now - (now % TOPK_WINDOW_SECONDS);
+}
+
+/**
+ * @brief Initialize the sketches and register the metrics section
+ */
+int cserve_topk_init(void) {
+    time_t now = time(NULL);
+    for (int i = 0; i < TOPK_KIND_COUNT; i++) {
+        memset(&sketches[i], 0, sizeof(sketches[i]));
+        pthread_mutex_init(&sketches[i].lock, NULL);
+        sketches[i].window_start = now - (now % TOPK_WINDOW_SECONDS);
+    }
+    return cserve_metrics_register(render_metrics);
+}
+
+/**
+ * @brief Count one occurrence of a key
+ */
+void cserve_topk_add(cserver_topk_kind_t kind, const char *key) {
+    if (key == NULL || key[0] == '\0') {
+        return;
+    }
+    unsigned long hash = hash_key(key);
+    topk_sketch_t *sketch = &sketches[kind];
+
+    pthread_mutex_lock(&sketch->lock);
+    maybe_rotate(sketch, time(NULL));
+    topk_window_t *window = &sketch->current;
+
+    // Already tracked, and remember the smallest slot in case it is not
+    size_t min = 0;
+    for (size_t i = 0; i < window->used; i++) {
+        if (window->hashes[i] == hash &&
+            strncmp(window->items[i].key, key, TOPK_KEY_SIZE - 1) == 0) {
+            window->items[i].count++;
+            pthread_mutex_unlock(&sketch->lock);
+            return;
+        }
+        if (window->items[i].count < window->items[min].count) {
+            min = i;
+        }
+    }
+
+    size_t slot;
+    unsigned long base = 0;
+    if (window->used < TOPK_CAPACITY) {
+        slot = window->used++;
+    } else {
+        // Evict the smallest counter, its count becomes our error bound
+        slot = min;
+        base = window->items[min].count;
+    }
+    snprintf(window->items[slot].key, TOPK_KEY_SIZE, "%s", key);
+    window->items[slot].count = base + 1;
+    window->items[slot].error = base;
+    window->hashes[slot] = hash;
+    pthread_mutex_unlock(&sketch->lock);
+}
+
+/**
+ * @brief qsort() comparator, heaviest first
+ */
+static int compare_items(const void *a, const void *b) {
+    const cserver_topk_item_t *ia = a;
+    const cserver_topk_item_t *ib = b;
+    if (ia->count != ib->count) {
+        return ia->count < ib->count ? 1 : -1;
+    }
+    return strcmp(ia->key, ib->key);
+}
+
+/**
+ * @brief Copy the heaviest keys of a sketch, sorted by count
+ */
+size_t cserve_topk_snapshot(cserver_topk_kind_t kind, cserver_topk_window_t window,
+                            cserver_topk_item_t *items, size_t max_items) {
+    cserver_topk_item_t all[TOPK_CAPACITY];
+    topk_sketch_t *sketch = &sketches[kind];
+
+    pthread_mutex_lock(&sketch->lock);
+    maybe_rotate(sketch, time(NULL));
+    topk_window_t *source = window == TOPK_WINDOW_CURRENT ? &sketch->current : &sketch->previous;
+    size_t used = source->used;
+    memcpy(all, source->items, used * sizeof(cserver_topk_item_t));
+    pthread_mutex_unlock(&sketch->lock);
+
+    qsort(all, used, sizeof(cserver_topk_item_t), compare_items);
+    if (used > max_items) {
+        used = max_items;
+    }
+    memcpy(items, all, used * sizeof(cserver_topk_item_t));
+    return used;
+}
+
+/**
+ * @brief Get the name of a sketch
+ */
+const char *cserve_topk_name(cserver_topk_kind_t kind) {
+    return sketch_names[kind];
+}
+
+/**
+ * @brief Append a key as a quoted Prometheus label value
+ */
+static void append_label(cserver_metrics_buf_t *buf, const char *key) {
+    char escaped[TOPK_KEY_SIZE * 2];
+    size_t len = 0;
+    for (const char *p = key; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            escaped[len++] = '\\';
+        }
+        escaped[len++] = *p;
+    }
+    escaped[len] = '\0';
+    cserve_metrics_appendf(buf, "\"%s\"", escaped);
+}
+
+/**
+ * @brief Render the heaviest keys of the last complete window as metrics
+ */
+static void render_metrics(cserver_metrics_buf_t *buf) {
+    cserver_topk_item_t items[TOPK_METRICS_ITEMS];
+    for (int kind = 0; kind < TOPK_KIND_COUNT; kind++) {
+        size_t n = cserve_topk_snapshot(kind, TOPK_WINDOW_PREVIOUS, items, TOPK_METRICS_ITEMS);
+        for (size_t i = 0; i < n; i++) {
+            cserve_metrics_appendf(buf, "cserv_top_%s_requests{key=", sketch_names[kind]);
+            append_label(buf, items[i].key);
+            cserve_metrics_appendf(buf, "} %lu\n", items[i].count);
+        }
+    }
+}
+
+/**
+ * @brief Render all sketches as a plain text report
+ */
+char *cserve_topk_report(void) {
+    cserver_metrics_buf_t buf;
+    buf.len = 0;
+    buf.cap = TOPK_CAPACITY * TOPK_KEY_SIZE;
+    buf.data = malloc(buf.cap);
+    if (buf.data == NULL) {
+        printf("Error: Memory allocation failed for top-k report\n");
+        return NULL;
+    }
+    buf.data[0] = '\0';
+
+    static const struct {
+        cserver_topk_window_t window;
+        const char *name;
+    } windows[] = {
+        {TOPK_WINDOW_CURRENT, "current"},
+        {TOPK_WINDOW_PREVIOUS, "previous"},
+    };
+
+    cserver_topk_item_t items[TOPK_CAPACITY];
+    for (int kind = 0; kind < TOPK_KIND_COUNT; kind++) {
+        for (size_t w = 0; w < sizeof(windows) / sizeof(windows[0]); w++) {
+            size_t n = cserve_topk_snapshot(kind, windows[w].window, items, TOPK_CAPACITY);
+            cserve_metrics_appendf(&buf, "# %s, %s window (%ds)\n", sketch_names[kind],
+                                   windows[w].name, TOPK_WINDOW_SECONDS);
+            for (size_t i = 0; i < n; i++) {
+                cserve_metrics_appendf(&buf, "%10lu %10lu  %s\n", items[i].count, items[i].error,
+                                       items[i].key);
+            }
+            cserve_metrics_appendf(&buf, "\n");
+        }
+    }
+    return buf.data;
+}
@@ -9,6 +9,9 @@
 // globals
 static int PORT = DEFAULT_PORT;
 static char DIRECTORY[MAX_DIR_PATH_SIZE] = "./";
+static char STATE_FILE[MAX_DIR_PATH_SIZE] = "";
+static char FASTCGI_COMMAND[MAX_DIR_PATH_SIZE] = "";
+static char ACCESS_LOG[MAX_DIR_PATH_SIZE] = "";
 
 // Define a structure for command line arguments
 typedef struct {
@@ -24,6 +27,9 @@ static const arg_t valid_args[] = {
     {"-h", "--help", "help", "Display this help message"},
     {"-d", "--directory", "directory", "Root directory to serve"},
     {"-v", "--version", "version", "Display the version of the server"},
+    {"-s", "--state-file", "state-file", "File to persist hot paths in for cache pre-warming"},
+    {"-f", "--fastcgi", "command", "Command starting a FastCGI worker for scripts, e.g. php-cgi"},
+    {"-a", "--access-log", "file", "File to append the access log to"},
 };
 
 /**
@@ -138,6 +144,48 @@ int arg_parse(int argc, char *argv[]) {
         }
     }
 
+    // get state file
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], valid_args[4].short_flag) == 0 ||
+            strcmp(argv[i], valid_args[4].long_flag) == 0) {
+            if (i + 1 >= argc) {
+                printf("Error: Missing state file\n");
+                print_help();
+                return FAILURE;
+            }
+            snprintf(STATE_FILE, MAX_DIR_PATH_SIZE, "%s", argv[i + 1]);
+            break;
+        }
+    }
+
+    // get FastCGI worker command
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], valid_args[5].short_flag) == 0 ||
+            strcmp(argv[i], valid_args[5].long_flag) == 0) {
+            if (i + 1 >= argc) {
+                printf("Error: Missing FastCGI command\n");
+                print_help();
+                return FAILURE;
+            }
+            snprintf(FASTCGI_COMMAND, MAX_DIR_PATH_SIZE, "%s", argv[i + 1]);
+            break;
+        }
+    }
+
+    // get access log file
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], valid_args[6].short_flag) == 0 ||
+            strcmp(argv[i], valid_args[6].long_flag) == 0) {
+            if (i + 1 >= argc) {
+                printf("Error: Missing access log file\n");
+                print_help();
+                return FAILURE;
+            }
+            snprintf(ACCESS_LOG, MAX_DIR_PATH_SIZE, "%s", argv[i + 1]);
+            break;
+        }
+    }
+
     return SUCCESS;
 }
 
@@ -145,12 +193,12 @@ int main(int argc, char *argv[]) {
     if (arg_parse(argc, argv) == FAILURE) {
         return FAILURE;
     }
-    if (cserve_init(PORT, DIRECTORY) == FAILURE) {
+    if (cserve_init(PORT, DIRECTORY, STATE_FILE, FASTCGI_COMMAND, ACCESS_LOG) == FAILURE) {
         return FAILURE;
     }
     if (cserve_start() == FAILURE) {
         return FAILURE;
     }
-    // we should never reach here if everything is working correctly
+    // the server returns once it was asked to shut down
     return SUCCESS;
 }
\ No newline at end of file
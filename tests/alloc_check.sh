@@ -0,0 +1,87 @@
+#!/bin/sh
+#
+# Steady-state allocation check, run by "make check"
+#
+# Starts a cserv built with ALLOC_STATS=1 on a small generated site, warms
+# its caches, then sends the same requests again and fails if any of them
+# made a heap allocation, going by cserv_alloc_requests_allocating_total.
+#
+# usage: alloc_check.sh <cserv binary> [port] [rounds]
+
+CSERV=$1
+PORT=${2:-18080}
+ROUNDS=${3:-20}
+URL=http://127.0.0.1:$PORT
+
+if [ -z "$CSERV" ]; then
+    echo "usage: $0 <cserv binary> [port] [rounds]"
+    exit 2
+fi
+
+SITE=$(mktemp -d)
+LOG=$SITE.log
+trap 'kill $PID 2>/dev/null; wait $PID 2>/dev/null; rm -rf "$SITE" "$LOG"' EXIT
+
+# A page, the assets it links to, a directory listing and a missing file
+mkdir -p "$SITE/docs"
+printf '<html><head><link rel="stylesheet" href="/style.css"></head>' > "$SITE/index.html"
+printf '<body><script src="app.js"></script></body></html>\n' >> "$SITE/index.html"
+printf 'body { margin: 0; }\n' > "$SITE/style.css"
+printf 'console.log("app");\n' > "$SITE/app.js"
+printf 'notes\n' > "$SITE/docs/notes.txt"
+PATHS="/ /index.html /style.css /app.js /docs/ /docs/notes.txt /missing.html"
+# Just written files are not cached yet (CACHE_RACY_SECONDS), make them older
+touch -t 202001010000 "$SITE"/* "$SITE/docs"/* "$SITE"/docs "$SITE"
+
+"$CSERV" -p "$PORT" -d "$SITE" > "$LOG" 2>&1 &
+PID=$!
+
+# Wait for the server to listen
+tries=0
+until curl -s -o /dev/null "$URL/"; do
+    tries=$((tries + 1))
+    if [ $tries -ge 50 ] || ! kill -0 $PID 2>/dev/null; then
+        echo "alloc_check: cserv did not start"
+        cat "$LOG"
+        exit 1
+    fi
+    sleep 0.1
+done
+
+allocating() {
+    curl -s "$URL/_cserv/metrics" | awk '$1 == "cserv_alloc_requests_allocating_total" {print $2}'
+}
+
+requests() {
+    for path in $PATHS; do
+        curl -s -o /dev/null "$URL$path"
+    done
+}
+
+# The first requests fill the caches and are allowed to allocate
+for i in 1 2 3; do
+    requests
+done
+# Let the background threads finish warming what the pages link to
+sleep 1
+
+before=$(allocating)
+if [ -z "$before" ]; then
+    echo "alloc_check: no allocation counters, is cserv built with ALLOC_STATS=1?"
+    exit 1
+fi
+i=0
+while [ $i -lt "$ROUNDS" ]; do
+    requests
+    i=$((i + 1))
+done
+after=$(allocating)
+
+# The metrics request that read the first value allocated its output, nothing else may
+count=$((ROUNDS * $(echo $PATHS | wc -w)))
+allocated=$((after - before - 1))
+if [ $allocated -ne 0 ]; then
+    echo "alloc_check: FAILED, $allocated of $count warm requests allocated"
+    exit 1
+fi
+echo "alloc_check: ok, $count warm requests made no allocations"